@@ -9,6 +9,8 @@
 #include "cache.h"
 #include "log.h"
 #include "stat.h"
+#include "crc.h"
+#include "submap.h"
 
 static void build_bad_blk_list(void);
 static void manual_set_bad_blk(void);
@@ -23,7 +25,27 @@ static void set_blk_id(UINT32 const bank, UINT32 const region, UINT32 const id,
 static UINT16 get_blk_id(UINT32 const bank, UINT32 const region, UINT32 const id);
 static void set_vcount(UINT32 const bank, UINT32 const blk, UINT16 vcount);
 static UINT16 get_vcount(UINT32 const bank, UINT32 const blk);
-static void erase_all_log_blks(void);
+static void erase_blk(UINT32 const bank, UINT32 const blk);
+static UINT16 get_erase_cnt(UINT32 const bank, UINT32 const blk);
+static void pick_least_worn_free_blk(UINT32 const bank, UINT32 const region);
+static UINT32 pick_coldest_blk(UINT32 const bank, UINT32 const region);
+static void collect_victims(UINT32 const region, UINT32 const *banks,
+                            UINT32 const n_banks, UINT32 const wl);
+static UINT32 mark_bad_blk(UINT32 const bank, UINT32 const blk);
+static UINT32 is_log_blk(UINT32 const bank, UINT32 const blk);
+static UINT32 add_prog_fail(UINT32 const bank, UINT32 const blk, UINT32 const page);
+static UINT32 find_prog_fail(UINT32 const bank, UINT32 const blk, UINT32 const page);
+static void retire_free_blk(UINT32 const bank, UINT32 const region, UINT32 const idx);
+static void relocate_bad_blk(UINT32 const bank, UINT32 const blk,
+                             UINT32 const lpns, UINT32 const n_pgs);
+static void load_blk_summary(UINT32 const bank, UINT32 const blk, UINT32 const lpns);
+static UINT32 relocate_full_bad_blks(UINT32 const bank, UINT32 const region);
+static void load_bad_blk_bmp(void);
+static void persist_bad_blk_bmp(void);
+
+/* grown bad blocks are appended to block 1 of bank 0: magic, CRC32C, bitmap */
+#define BAD_BLK_TBL_BLK 1
+#define BAD_BLK_TBL_SECTS (ROUND_UP(2 * sizeof(UINT32) + BAD_BLK_BMP_BYTES, BYTES_PER_SECTOR) / BYTES_PER_SECTOR)
 
 typedef struct {
     /* [tail, rsv) are GC-available used blocks */
@@ -38,24 +60,48 @@ typedef struct {
     UINT32 free_blk_cnt;
     UINT32 bad_blk_cnt;
     blk_list_t blk_lists[NUM_REGIONS];
-    UINT32 blk_log;
-    UINT32 blk_log_first, blk_log_last;
+    /**
+     * Log blocks of the current generation, oldest first. One more than
+     * LOG_BLKS_PER_BANK may be drawn while the reclaim is pending.
+     */
+    UINT16 blks_log[MAX_LOG_BLKS_PER_BANK + 1];
+    UINT32 n_log;
     UINT32 blks_map[2];
     UINT32 vt_blk;
+    /* erases since the last wear leveling check */
+    UINT32 n_erase_wl;
 } blkmgr_t;
 
+/**
+ * A program failure waiting for blkmgr_handle_bad_blks(). The data to be
+ * re-issued is either the copyback source or saved in FAIL_BUF, as the
+ * buffer it was programmed from may be reused before the failure is handled.
+ */
+typedef struct {
+    UINT32 bank, blk, page;
+    UINT32 src_ppn;
+    #ifdef VST
+    UINT8 spare[SUBMAP_SPARE_BYTES];
+    #endif
+} prog_fail_t;
+
 static blkmgr_t blkmgr[NUM_BANKS];
 static UINT8 map_blk_idx;
-static UINT32 log_blk_cnt;
 static UINT8 first_gc;
-/* for GC, dont need to initialize */
-static UINT32 lpns[PAGES_PER_VBLK];
+static prog_fail_t prog_fails[NUM_FAIL_BUFFERS];
+static UINT32 n_prog_fails;
+static UINT32 n_new_bad_blks;
+static UINT32 map_blk_failed;
+static UINT32 log_blk_failed;
+static UINT32 bad_blk_tbl_pg;
 extern UINT32 enable_gc_opt;
 
 void init_blkmgr(void)
 {
     mem_set_dram(BAD_BLK_BMP_ADDR, 0, BAD_BLK_BMP_BYTES);
+    mem_set_dram(ERASE_CNT_ADDR, 0, ERASE_CNT_BYTES);
     build_bad_blk_list();
+    load_bad_blk_bmp();
     uart_printf("[init_blkmgr] Bad block built.\n");
     #ifndef VST
     erase_all_blks();
@@ -64,10 +110,16 @@ void init_blkmgr(void)
 
     mem_set_dram(VCOUNT_ADDR, 0, VCOUNT_BYTES);
     map_blk_idx = 0;
-    log_blk_cnt = NUM_LOG_BLKS_PER_BANK * NUM_BANKS;
-    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
         blkmgr[bank].vt_blk = 0;
+        blkmgr[bank].n_log = 0;
+        blkmgr[bank].n_erase_wl = 0;
+    }
     first_gc = 1;
+    n_prog_fails = 0;
+    n_new_bad_blks = 0;
+    map_blk_failed = 0;
+    log_blk_failed = 0;
 
     init_blk_list();
     uart_printf("[init_blkmgr] Block list initialized.\n");
@@ -86,28 +138,31 @@ void blkmgr_toggle_map_blk_idx(void)
 void blkmgr_erase_cur_map_blk(void)
 {
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
-        nand_block_erase(bank, blkmgr[bank].blks_map[map_blk_idx]);
+        erase_blk(bank, blkmgr[bank].blks_map[map_blk_idx]);
 }
 
 void erase_all_blks(void)
 {
-    /* erase all blocks, except the first block */
+    /* erase all blocks, except the first block and the bad block table */
     UINT32 cnt;
 
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
         cnt = 0;
-        for (UINT32 blk = 1; blk < VBLKS_PER_BANK; blk++) {
+        for (UINT32 blk = BAD_BLK_TBL_BLK + 1; blk < VBLKS_PER_BANK; blk++) {
             if (!is_bad_block(bank, blk)) {
                 cnt++;
                 #if OPTION_SHOW_ERASE_BLK_INFO
                 uart_printf("bb (%u, %u)\n", bank, blk);
                 #endif
-                nand_block_erase(bank, blk);
+                erase_blk(bank, blk);
                 set_vcount(bank, blk, 0);
             } else {
                 set_vcount(bank, blk, VC_MAX);
             }
         }
+        /* log blocks drawn by init_pgmap() before format stay out of GC */
+        for (UINT32 i = 0; i < blkmgr[bank].n_log; i++)
+            set_vcount(bank, blkmgr[bank].blks_log[i], VC_MAX);
         #if OPTION_SHOW_ERASE_BLK_INFO
         uart_printf("[bad block cnt] Bank %u: %u.\n", bank, cnt);
         #endif
@@ -116,35 +171,51 @@ void erase_all_blks(void)
 
 UINT32 get_and_inc_active_blk(UINT32 const bank, UINT32 const region)
 {
-    blkmgr[bank].free_blk_cnt--;
-    blkmgr[bank].blk_lists[region].free--;
     UINT32 blk_free;
     UINT32 head = blkmgr[bank].blk_lists[region].head;
-    blk_free = get_blk_id(bank, region, head);
+    /* free blocks that failed to erase are retired when they come up */
+    while (1) {
+        pick_least_worn_free_blk(bank, region);
+        blk_free = get_blk_id(bank, region, head);
+        if (!is_bad_block(bank, blk_free))
+            break;
+        retire_free_blk(bank, region, head);
+    }
+    blkmgr[bank].free_blk_cnt--;
+    blkmgr[bank].blk_lists[region].free--;
     blkmgr[bank].blk_lists[region].head =
             (head + 1) % blkmgr[bank].blk_lists[region].size;
     return blk_free;
 }
 
+/**
+ * Log blocks come from the free blocks of the cold region, so the physical
+ * blocks holding the log rotate with the rest of the data. They are marked
+ * VC_MAX while live so that GC never picks them as victims.
+ *
+ * A bank that has drawn its last log block triggers a log reclaim at the
+ * next commit (see blkmgr_reach_log_reclaim_threshold()). The log pages
+ * written until then, at most a cache flush and a checkpoint, fit in the
+ * spare block of blks_log.
+ */
 UINT32 get_log_blk(UINT32 const bank)
 {
-    UINT32 blk_log = blkmgr[bank].blk_log;
-    log_blk_cnt--;
-    if (blk_log > blkmgr[bank].blk_log_last) {
-        /* this should not happen */
-        uart_printf("Running out of log blocks.\n");
-        while (1)
-            ;
-    }
-    do {
-        blkmgr[bank].blk_log++;
-    } while (is_bad_block(bank, blkmgr[bank].blk_log));
+    ASSERT(blkmgr[bank].n_log < LOG_BLKS_PER_BANK + 1);
+    UINT32 blk_log = get_and_inc_active_blk(bank, NUM_REGIONS - 1);
+    set_vcount(bank, blk_log, VC_MAX);
+    blkmgr[bank].blks_log[blkmgr[bank].n_log++] = blk_log;
     return blk_log;
 }
 
-void revert_log_blk(UINT32 const bank)
+UINT32 blkmgr_get_log_head(UINT32 const bank)
+{
+    return blkmgr[bank].blks_log[0];
+}
+
+/* only used at mount, where the log head is taken from the map commit page */
+void blkmgr_set_log_head(UINT32 const bank, UINT32 const blk)
 {
-    blkmgr[bank].blk_log = blkmgr[bank].blk_log_first;
+    blkmgr[bank].blks_log[0] = blk;
 }
 
 UINT32 get_rsv_blk(UINT32 const bank, UINT32 const region)
@@ -166,13 +237,21 @@ UINT32 n_cur_rsv_blks(void)
     return n_rsv_blks;
 }
 
+/**
+ * Blocks from the active block of each region on become GC-unavailable. Log
+ * blocks taken from the region after its active block sit behind it.
+ */
 void push_rsv(UINT32 const bank)
 {
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
         for (UINT32 region = 0; region < NUM_REGIONS; region++) {
-            UINT32 head = blkmgr[bank].blk_lists[region].head;
-            UINT32 size = blkmgr[bank].blk_lists[region].size;
-            blkmgr[bank].blk_lists[region].rsv = (head + size - 1) % size;
+            blk_list_t *list_p = &blkmgr[bank].blk_lists[region];
+            UINT32 size = list_p->size;
+            UINT32 rsv = (list_p->head + size - 1) % size;
+            UINT32 blk_active = get_active_ppn(bank, region) / PAGES_PER_VBLK;
+            while (get_blk_id(bank, region, rsv) != blk_active && rsv != list_p->tail)
+                rsv = (rsv + size - 1) % size;
+            list_p->rsv = rsv;
         }
     }
 }
@@ -212,127 +291,242 @@ UINT32 reach_gc_threshold(UINT32 const bank, UINT32 const region)
     return (blkmgr[bank].blk_lists[region].free < GC_THRESHOLD);
 }
 
+/**
+ * Victims are taken from [tail, rsv), the blocks filled before the last
+ * commit. Returns 1 if a bank due for GC has none left, in which case a
+ * commit must come first.
+ */
+UINT32 blkmgr_lack_gc_victims(UINT32 const region)
+{
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        if (reach_gc_threshold(bank, region) &&
+                blkmgr[bank].blk_lists[region].tail == blkmgr[bank].blk_lists[region].rsv)
+            return 1;
+    return 0;
+}
+
 extern UINT32 verbose;
-void garbage_collection(UINT32 const bank, UINT32 const region)
+/* Collect one victim in every bank that is below the GC threshold of the region. */
+void garbage_collection(UINT32 const region)
 {
-    UINT32 lpn;
-    UINT32 vt_blk;
-    UINT32 vt_page;
-    UINT16 vcount;
+    UINT32 banks[NUM_BANKS];
+    UINT32 n_banks = 0;
+
+    /* an empty [tail, rsv) would have get_victim_blk() scan free blocks too */
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        if (reach_gc_threshold(bank, region) &&
+                blkmgr[bank].blk_lists[region].tail != blkmgr[bank].blk_lists[region].rsv)
+            banks[n_banks++] = bank;
+    if (!n_banks)
+        return;
 
     if (first_gc) {
         uart_printf("First GC.\n");
         first_gc = 0;
     }
-    #if 0
-    uart_printf("GC bank %u\n", bank);
-    #endif
-    ptimer_start();
     cache_collect_dirty_rate();
+    collect_victims(region, banks, n_banks, 0);
+}
 
-    if (blkmgr[bank].vt_blk) {
-        stat_gc_erase_sync();
-        nand_block_erase(bank, blkmgr[bank].vt_blk);
-        blkmgr[bank].vt_blk = 0;
+/**
+ * Static wear leveling. Blocks holding cold data are never chosen by GC, so
+ * they stay at a low erase count while the others wear out. Every
+ * WL_CHECK_INTERVAL erases of a bank, its least worn used block of the cold
+ * region is collected if it lags WL_THRESHOLD erases behind the most worn
+ * block, which moves the cold data onto a worn block and returns the least
+ * worn block to the free blocks.
+ */
+void blkmgr_wear_leveling(void)
+{
+    UINT32 const region = NUM_REGIONS - 1;
+    UINT32 banks[NUM_BANKS];
+    UINT32 n_banks = 0;
+
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
+        if (blkmgr[bank].n_erase_wl < WL_CHECK_INTERVAL)
+            continue;
+        blkmgr[bank].n_erase_wl = 0;
+        if (pick_coldest_blk(bank, region))
+            banks[n_banks++] = bank;
     }
+    if (!n_banks)
+        return;
+    collect_victims(region, banks, n_banks, 1);
+    stat_record_wl(n_banks);
+}
 
-    vt_blk = get_victim_blk(bank, region);
-    vcount = get_vcount(bank, vt_blk);
+/**
+ * The summary reads of all victims are issued before waiting for any of them,
+ * and the copybacks are interleaved across banks, so that the flash of every
+ * bank involved works at the same time instead of one bank after another.
+ * For wear leveling, the victims are already placed at the tail.
+ */
+static void collect_victims(UINT32 const region, UINT32 const *banks,
+                            UINT32 const n_banks, UINT32 const wl)
+{
+    UINT32 vt_blks[NUM_BANKS];
+    UINT16 vcounts_vt[NUM_BANKS];
+    UINT32 n_valid[NUM_BANKS];
+    UINT32 n_moved = 0;
+    UINT32 lpn;
+    UINT32 vt_page;
+    UINT32 t;
 
-    #if 0
-    uart_printf("Vt blk = %u\n", vt_blk);
-    #endif
-    nand_page_ptread(bank, vt_blk, PAGES_PER_VBLK - 1, 0,
-            ROUND_UP(sizeof(UINT32) * PAGES_PER_VBLK, BYTES_PER_SECTOR) /
-            BYTES_PER_SECTOR, FTL_BUF(bank), RETURN_WHEN_DONE);
-    mem_copy(lpns, FTL_BUF(bank),
-            sizeof(UINT32) * PAGES_PER_VBLK);
+    /* the copyback sources of failed GC programs must not be erased first */
+    if (n_prog_fails)
+        blkmgr_handle_bad_blks();
+    ptimer_start();
 
-    UINT32 n_valid = 0;
-    for (vt_page = 0; vt_page < (PAGES_PER_VBLK - 1); vt_page++) {
-        UINT32 ppn = vt_blk * PAGES_PER_VBLK + vt_page;
-        lpn = lpns[vt_page];
-
-        if (get_ppn(lpn) == ppn) {
-            /* Valid pages in victim blocks always written to cold region. */
-            UINT32 gc_ppn = get_and_inc_active_ppn(bank, NUM_REGIONS - 1);
-            UINT32 gc_blk = gc_ppn / PAGES_PER_VBLK;
-            UINT32 gc_page = gc_ppn % PAGES_PER_VBLK;
-            set_ppn(lpn, gc_ppn);
-            set_lpn(bank, NUM_REGIONS - 1, gc_page, lpn);
-            set_vcount(bank, gc_blk, get_vcount(bank, gc_blk) + 1);
-            log_insert_mapent(lpn, gc_ppn);
-            n_valid++;
+    for (UINT32 i = 0; i < n_banks; i++) {
+        UINT32 bank = banks[i];
+        #if 0
+        uart_printf("GC bank %u\n", bank);
+        #endif
+        if (blkmgr[bank].vt_blk) {
+            stat_gc_erase_sync();
+            erase_blk(bank, blkmgr[bank].vt_blk);
+            blkmgr[bank].vt_blk = 0;
+        }
 
-            #ifdef VST
-            UINT8 spare[64];
-            UINT32 gc_tag = (UINT32)-2;
-            mem_copy(spare, &lpn, sizeof(UINT32));
-            mem_copy(spare + 8, &gc_tag, sizeof(UINT32));
-            set_spare(spare, 12);
-            #endif
+        if (wl)
+            vt_blks[i] = get_blk_id(bank, region, blkmgr[bank].blk_lists[region].tail);
+        else
+            vt_blks[i] = get_victim_blk(bank, region);
+        vcounts_vt[i] = get_vcount(bank, vt_blks[i]);
+        n_valid[i] = 0;
+        #if 0
+        uart_printf("Vt blk = %u\n", vt_blks[i]);
+        #endif
+        /**
+         * A block without valid pages needs no summary, which is also the case
+         * for retired log blocks that do not have one.
+         */
+        if (vcounts_vt[i] != 0)
+            nand_page_ptread(bank, vt_blks[i], PAGES_PER_VBLK - 1, 0,
+                    ROUND_UP(sizeof(UINT32) * PAGES_PER_VBLK, BYTES_PER_SECTOR) /
+                    BYTES_PER_SECTOR, GC_BUF(bank), RETURN_ON_ISSUE);
+    }
+    flash_finish();
+
+    for (vt_page = 0; vt_page < (PAGES_PER_VBLK - 1); vt_page++) {
+        for (UINT32 i = 0; i < n_banks; i++) {
+            UINT32 bank = banks[i];
+            UINT32 vt_blk = vt_blks[i];
+            UINT32 ppn = GPPN(bank, vt_blk * PAGES_PER_VBLK + vt_page);
+            if (!vcounts_vt[i])
+                continue;
+            lpn = read_dram_32(GC_BUF(bank) + vt_page * sizeof(UINT32));
+
+            if (get_ppn(lpn) == ppn) {
+                /* Valid pages in victim blocks always written to cold region. */
+                UINT32 gc_ppn = get_and_inc_active_ppn(bank, NUM_REGIONS - 1);
+                UINT32 gc_blk = gc_ppn / PAGES_PER_VBLK;
+                UINT32 gc_page = gc_ppn % PAGES_PER_VBLK;
+                set_ppn(lpn, GPPN(bank, gc_ppn));
+                set_lpn(bank, NUM_REGIONS - 1, gc_page, lpn);
+                set_vcount(bank, gc_blk, get_vcount(bank, gc_blk) + 1);
+                log_insert_mapent(lpn, GPPN(bank, gc_ppn));
+                n_valid[i]++;
+                n_moved++;
+
+                #ifdef VST
+                UINT8 spare[64];
+                UINT32 gc_tag = (UINT32)-2;
+                mem_copy(spare, &lpn, sizeof(UINT32));
+                mem_copy(spare + 8, &gc_tag, sizeof(UINT32));
+                set_spare(spare, 12);
+                #endif
 
-            if (!enable_gc_opt)
-                nand_page_copyback(bank, vt_blk, vt_page,
-                        gc_blk, gc_page);
+                if (!enable_gc_opt)
+                    nand_page_copyback(bank, vt_blk, vt_page,
+                            gc_blk, gc_page);
+            }
         }
     }
-    stat_gc_vcount(vcount);
 
-    #if 0
-    if (vcount != 0) {
-        uart_printf("v (%u, %u)\n",
-                n_valid, vcount);
-    }
-    #endif
-    if (n_valid != vcount) {
-        for (UINT32 i = 0; i < PAGES_PER_VBLK; i++)
-            uart_printf("%u: %u\n", i, lpns[i]);
-        uart_printf("n_valid = %u, vcount = %u\n", n_valid, vcount);
-    }
-    ASSERT(n_valid == vcount);
-    /* Assertion fail: GC threshold set too large */
-    ASSERT(n_valid < PAGES_PER_VBLK - 1);
+    for (UINT32 i = 0; i < n_banks; i++) {
+        UINT32 bank = banks[i];
+        if (!wl)
+            stat_gc_vcount(vcounts_vt[i]);
+        if (n_valid[i] != vcounts_vt[i]) {
+            for (UINT32 j = 0; j < PAGES_PER_VBLK; j++)
+                uart_printf("%u: %u\n", j, read_dram_32(GC_BUF(bank) + j * sizeof(UINT32)));
+            uart_printf("n_valid = %u, vcount = %u\n", n_valid[i], vcounts_vt[i]);
+        }
+        ASSERT(n_valid[i] == vcounts_vt[i]);
+        /* Assertion fail: GC threshold set too large */
+        ASSERT(wl || n_valid[i] < PAGES_PER_VBLK - 1);
 
-    blkmgr[bank].vt_blk = vt_blk;
+        blkmgr[bank].vt_blk = vt_blks[i];
 
-    /* update metadata */
-    set_vcount(bank, vt_blk, 0);
-    blkmgr[bank].free_blk_cnt++;
-    blkmgr[bank].blk_lists[region].free++;
+        /* update metadata */
+        set_vcount(bank, vt_blks[i], 0);
+        blkmgr[bank].free_blk_cnt++;
+        blkmgr[bank].blk_lists[region].free++;
 
-    /* update blk list */
-    blkmgr[bank].blk_lists[region].tail =
-            (blkmgr[bank].blk_lists[region].tail + 1) %
-            blkmgr[bank].blk_lists[region].size;
+        /* update blk list */
+        blkmgr[bank].blk_lists[region].tail =
+                (blkmgr[bank].blk_lists[region].tail + 1) %
+                blkmgr[bank].blk_lists[region].size;
+    }
 
-    stat_record_gc(bank, ptimer_stop());
+    t = ptimer_stop();
+    if (wl)
+        return;
+    /* the banks collected in parallel, so each takes its share of the batch */
+    for (UINT32 i = 0; i < n_banks; i++)
+        stat_record_gc(banks[i], t / n_banks);
+    stat_record_gc_batch(n_moved, t);
 }
 
 void blkmgr_erase_vt_blk(UINT32 const bank)
 {
-    if (_BSP_FSM(REAL_BANK(bank)) != BANK_IDLE)
+    if (_BSP_FSM(REAL_BANK(bank)) != BANK_IDLE || n_prog_fails)
         return;
     if (blkmgr[bank].vt_blk) {
         stat_gc_erase_async();
-        nand_block_erase(bank, blkmgr[bank].vt_blk);
+        erase_blk(bank, blkmgr[bank].vt_blk);
         blkmgr[bank].vt_blk = 0;
     }
 }
 
 UINT32 blkmgr_reach_log_reclaim_threshold(void)
 {
-    return (log_blk_cnt < 3);
-    //return (log_blk_cnt <= 1 * NUM_BANKS);
-    //return (log_blk_cnt < 50 * NUM_BANKS);
+    /* a log block gone bad breaks the chain, so a new generation is started */
+    if (log_blk_failed)
+        return 1;
+    /* a new generation starts with one log block per bank */
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        if (blkmgr[bank].n_log > 1 && blkmgr[bank].n_log >= LOG_BLKS_PER_BANK)
+            return 1;
+    return 0;
 }
 
+/**
+ * Start a new log generation and persist the page map, whose commit page
+ * records the head of the new generation. The blocks of the old generation
+ * are covered by the map from then on and are handed over to GC, which
+ * erases them lazily like any other invalid block.
+ */
 void blkmgr_reclaim_log(void)
 {
+    UINT16 blks_old[NUM_BANKS][MAX_LOG_BLKS_PER_BANK];
+    UINT32 n_old[NUM_BANKS];
+
     stat_reclaim_log();
+    log_blk_failed = 0;
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
+        n_old[bank] = blkmgr[bank].n_log;
+        for (UINT32 i = 0; i < n_old[bank]; i++)
+            blks_old[bank][i] = blkmgr[bank].blks_log[i];
+        blkmgr[bank].n_log = 0;
+        get_log_blk(bank);
+    }
     pgmap_persist_map_table();
-    erase_all_log_blks();
-    log_blk_cnt = NUM_LOG_BLKS_PER_BANK * NUM_BANKS;
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        for (UINT32 i = 0; i < n_old[bank]; i++)
+            if (!is_bad_block(bank, blks_old[bank][i]))
+                set_vcount(bank, blks_old[bank][i], 0);
 }
 
 UINT32 blkmgr_first_gc_triggered(void)
@@ -340,6 +534,110 @@ UINT32 blkmgr_first_gc_triggered(void)
     return !first_gc;
 }
 
+UINT32 blkmgr_is_bad_blk(UINT32 const bank, UINT32 const blk)
+{
+    return is_bad_block(bank, blk);
+}
+
+/**
+ * Runtime flash failures are reported by ftl_isr(), or by the flash wrappers
+ * of VST. As they may be reported in the middle of any flash operation of
+ * the FTL, they only mark the block bad and record what has to be redone.
+ * An active block or log block that went bad is given up at its next
+ * allocation, and the rest is done by blkmgr_handle_bad_blks().
+ */
+void blkmgr_report_prog_fail(UINT32 const bank, UINT32 const blk,
+                             UINT32 const page, UINT32 const buf)
+{
+    UINT32 i;
+
+    if (!mark_bad_blk(bank, blk)) {
+        if (blk == blkmgr[bank].blks_map[0] || blk == blkmgr[bank].blks_map[1])
+            map_blk_failed = 1;
+        return;
+    }
+    /* the log is not patched but superseded by a new generation */
+    if (is_log_blk(bank, blk)) {
+        log_blk_failed = 1;
+        return;
+    }
+    i = add_prog_fail(bank, blk, page);
+    if (i != NUM_FAIL_BUFFERS)
+        mem_copy(FAIL_BUF(i), buf, BYTES_PER_PAGE);
+}
+
+void blkmgr_report_cb_fail(UINT32 const bank, UINT32 const src_blk,
+                           UINT32 const src_page, UINT32 const dst_blk,
+                           UINT32 const dst_page)
+{
+    UINT32 i;
+
+    if (!mark_bad_blk(bank, dst_blk))
+        return;
+    i = add_prog_fail(bank, dst_blk, dst_page);
+    if (i != NUM_FAIL_BUFFERS)
+        prog_fails[i].src_ppn = src_blk * PAGES_PER_VBLK + src_page;
+}
+
+void blkmgr_report_erase_fail(UINT32 const bank, UINT32 const blk)
+{
+    mark_bad_blk(bank, blk);
+}
+
+UINT32 blkmgr_has_bad_blks(void)
+{
+    return (n_prog_fails || n_new_bad_blks);
+}
+
+/* returns 1 if a program failure in a map block voided the last map copy */
+UINT32 blkmgr_take_map_blk_fail(void)
+{
+    UINT32 failed = map_blk_failed;
+    map_blk_failed = 0;
+    return failed;
+}
+
+/**
+ * Relocate the valid pages of the data blocks that went bad, re-issuing the
+ * failed programs to fresh blocks, then persist the bad block table and
+ * commit. Like GC, it must only run when every write is durable, as the
+ * relocated pages are tagged as GC copies. The loop picks up failures of
+ * the relocation itself.
+ */
+void blkmgr_handle_bad_blks(void)
+{
+    UINT32 n_blks;
+
+    do {
+        n_blks = 0;
+        for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
+            for (UINT32 region = 0; region < NUM_REGIONS; region++) {
+                UINT32 n_pgs;
+                UINT32 blk;
+                /* the pending ones go first, to free a slot for the active block */
+                while ((blk = pgmap_take_bad_blk(bank, region, &n_pgs, GC_BUF(bank)))) {
+                    relocate_bad_blk(bank, blk, GC_BUF(bank), n_pgs);
+                    n_blks++;
+                }
+                pgmap_abandon_bad_blk(bank, region);
+                while ((blk = pgmap_take_bad_blk(bank, region, &n_pgs, GC_BUF(bank)))) {
+                    relocate_bad_blk(bank, blk, GC_BUF(bank), n_pgs);
+                    n_blks++;
+                }
+                n_blks += relocate_full_bad_blks(bank, region);
+            }
+        }
+    } while (n_blks);
+    n_prog_fails = 0;
+
+    if (n_new_bad_blks) {
+        uart_printf("%u grown bad blocks retired.\n", n_new_bad_blks);
+        persist_bad_blk_bmp();
+        n_new_bad_blks = 0;
+    }
+    record_tag();
+}
+
 static void build_bad_blk_list(void)
 {
     #ifndef VST
@@ -491,21 +789,6 @@ static void init_blk_list(void)
             blk++;
         } while (n_map != 2);
 
-        UINT32 n_log = 0;
-        do {
-            if (!is_bad_block(bank, blk)) {
-                if (n_log == 0) {
-                    blkmgr[bank].blk_log = blk;
-                    blkmgr[bank].blk_log_first = blk;
-                } else if (n_log == NUM_LOG_BLKS_PER_BANK - 1) {
-                    blkmgr[bank].blk_log_last = blk;
-                }
-                blkmgr[bank].free_blk_cnt--;
-                n_log++;
-            }
-            blk++;
-        } while (n_log != NUM_LOG_BLKS_PER_BANK);
-
         UINT32 id = 0;
         do {
             if (!is_bad_block(bank, blk)) {
@@ -517,7 +800,7 @@ static void init_blk_list(void)
 
         blkmgr[bank].blk_lists[0].offset = 0;
         //blkmgr[bank].blk_lists[0].size = id / 4;
-        blkmgr[bank].blk_lists[0].size = 60;
+        blkmgr[bank].blk_lists[0].size = HOT_REGION_BLKS;
         blkmgr[bank].blk_lists[0].free = blkmgr[bank].blk_lists[0].size;
 
         blkmgr[bank].blk_lists[1].offset = blkmgr[bank].blk_lists[0].size;
@@ -547,11 +830,11 @@ static UINT32 get_victim_blk(UINT32 const bank, UINT32 const region)
     idx = tail;
     blk = get_blk_id(bank, region, idx);
     vcount_min = vcounts[blk];
-    ASSERT(vcount_min < PAGES_PER_VBLK);
+    ASSERT(vcount_min < PAGES_PER_VBLK || vcount_min == VC_MAX);
     for (UINT32 i = (idx + 1) % size; i != rsv; i = (i + 1) % size) {
         blk = get_blk_id(bank, region, i);
         vcount = vcounts[blk];
-        ASSERT(vcount < PAGES_PER_VBLK);
+        ASSERT(vcount < PAGES_PER_VBLK || vcount == VC_MAX);
         if (vcount < vcount_min) {
             vcount_min = vcount;
             idx = i;
@@ -643,18 +926,316 @@ static UINT16 get_vcount(UINT32 const bank, UINT32 const blk)
             sizeof(UINT16));
 }
 
-static void erase_all_log_blks(void)
+static void erase_blk(UINT32 const bank, UINT32 const blk)
 {
-    UINT32 blks[NUM_BANKS];
-    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
-        blks[bank] = blkmgr[bank].blk_log_first;
+    UINT32 addr = ERASE_CNT_ADDR + (bank * VBLKS_PER_BANK + blk) * sizeof(UINT16);
+    UINT16 cnt = read_dram_16(addr);
 
-    for (UINT32 cnt_erase = 0; cnt_erase < NUM_LOG_BLKS_PER_BANK; cnt_erase++) {
-        for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
-            nand_block_erase(bank, blks[bank]);
-            do {
-                blks[bank]++;
-            } while (get_vcount(bank, blks[bank]) == VC_MAX);
+    nand_block_erase(bank, blk);
+    if (cnt != 0xFFFF)
+        write_dram_16(addr, cnt + 1);
+    blkmgr[bank].n_erase_wl++;
+}
+
+static UINT16 get_erase_cnt(UINT32 const bank, UINT32 const blk)
+{
+    return read_dram_16(ERASE_CNT_ADDR + (bank * VBLKS_PER_BANK + blk) *
+            sizeof(UINT16));
+}
+
+/**
+ * Swap the least worn of the next WL_WINDOW free blocks into head. The victim
+ * of the last GC sits at the end of the free blocks until it is erased and
+ * must not be handed out before that.
+ */
+static void pick_least_worn_free_blk(UINT32 const bank, UINT32 const region)
+{
+    UINT32 head = blkmgr[bank].blk_lists[region].head;
+    UINT32 size = blkmgr[bank].blk_lists[region].size;
+    UINT32 n = blkmgr[bank].blk_lists[region].free;
+    UINT32 idx = head;
+    UINT32 blk;
+    UINT16 cnt, cnt_min;
+
+    if (n > WL_WINDOW)
+        n = WL_WINDOW;
+    cnt_min = 0xFFFF;
+    for (UINT32 j = 0, i = head; j < n; j++, i = (i + 1) % size) {
+        blk = get_blk_id(bank, region, i);
+        if (blk == blkmgr[bank].vt_blk)
+            continue;
+        cnt = get_erase_cnt(bank, blk);
+        if (cnt < cnt_min) {
+            cnt_min = cnt;
+            idx = i;
         }
     }
+    if (idx != head) {
+        blk = get_blk_id(bank, region, idx);
+        set_blk_id(bank, region, idx, get_blk_id(bank, region, head));
+        set_blk_id(bank, region, head, blk);
+    }
+}
+
+/**
+ * Swap the least worn GC-available block into tail if it lags WL_THRESHOLD
+ * erases behind the most worn block of the bank. Live log blocks are skipped.
+ * Returns 1 if a block needs to be migrated.
+ */
+static UINT32 pick_coldest_blk(UINT32 const bank, UINT32 const region)
+{
+    UINT32 tail = blkmgr[bank].blk_lists[region].tail;
+    UINT32 rsv = blkmgr[bank].blk_lists[region].rsv;
+    UINT32 size = blkmgr[bank].blk_lists[region].size;
+    UINT32 idx = size;
+    UINT32 blk;
+    UINT16 cnt, cnt_min, cnt_max;
+
+    cnt_max = 0;
+    for (blk = 0; blk < VBLKS_PER_BANK; blk++) {
+        cnt = get_erase_cnt(bank, blk);
+        if (cnt > cnt_max)
+            cnt_max = cnt;
+    }
+    cnt_min = 0xFFFF;
+    for (UINT32 i = tail; i != rsv; i = (i + 1) % size) {
+        blk = get_blk_id(bank, region, i);
+        if (get_vcount(bank, blk) == VC_MAX)
+            continue;
+        cnt = get_erase_cnt(bank, blk);
+        if (cnt < cnt_min) {
+            cnt_min = cnt;
+            idx = i;
+        }
+    }
+    if (idx == size || cnt_max - cnt_min <= WL_THRESHOLD)
+        return 0;
+
+    #if 0
+    uart_printf("WL bank %u blk %u erase cnt %u max %u\n", bank,
+            get_blk_id(bank, region, idx), cnt_min, cnt_max);
+    #endif
+    blk = get_blk_id(bank, region, idx);
+    set_blk_id(bank, region, idx, get_blk_id(bank, region, tail));
+    set_blk_id(bank, region, tail, blk);
+    return 1;
+}
+
+/* returns 1 if the block is one that can be retired */
+static UINT32 mark_bad_blk(UINT32 const bank, UINT32 const blk)
+{
+    uart_printf("Runtime bad block (%u, %u).\n", bank, blk);
+    /* blocks outside the block lists keep being used */
+    if (blk <= BAD_BLK_TBL_BLK || blk == blkmgr[bank].blks_map[0] ||
+            blk == blkmgr[bank].blks_map[1])
+        return 0;
+    if (!is_bad_block(bank, blk)) {
+        set_bit_dram(BAD_BLK_BMP_ADDR + bank*(VBLKS_PER_BANK/8 + 1), blk);
+        inc_bad_blk_cnt(bank);
+        n_new_bad_blks++;
+        stat_grown_bad_blk();
+    }
+    return 1;
+}
+
+static UINT32 is_log_blk(UINT32 const bank, UINT32 const blk)
+{
+    for (UINT32 i = 0; i < blkmgr[bank].n_log; i++)
+        if (blkmgr[bank].blks_log[i] == blk)
+            return 1;
+    return 0;
+}
+
+/**
+ * Returns NUM_FAIL_BUFFERS if every buffer is taken. The failure is then
+ * not tracked: the block is still retired, but the failed page is moved
+ * like the others, relying on ECC to read back what was programmed.
+ */
+static UINT32 add_prog_fail(UINT32 const bank, UINT32 const blk, UINT32 const page)
+{
+    if (n_prog_fails == NUM_FAIL_BUFFERS) {
+        uart_printf("Running out of fail buffers.\n");
+        return NUM_FAIL_BUFFERS;
+    }
+    prog_fails[n_prog_fails].bank = bank;
+    prog_fails[n_prog_fails].blk = blk;
+    prog_fails[n_prog_fails].page = page;
+    prog_fails[n_prog_fails].src_ppn = (UINT32)-1;
+    #ifdef VST
+    get_spare(prog_fails[n_prog_fails].spare, SUBMAP_SPARE_BYTES);
+    #endif
+    return n_prog_fails++;
+}
+
+static UINT32 find_prog_fail(UINT32 const bank, UINT32 const blk, UINT32 const page)
+{
+    UINT32 i;
+    for (i = 0; i < n_prog_fails; i++)
+        if (prog_fails[i].bank == bank && prog_fails[i].blk == blk &&
+                prog_fails[i].page == page)
+            break;
+    return i;
+}
+
+/* move a free block to the GC-available end of the list, where VC_MAX keeps it */
+static void retire_free_blk(UINT32 const bank, UINT32 const region, UINT32 const idx)
+{
+    UINT32 size = blkmgr[bank].blk_lists[region].size;
+    UINT32 tail = (blkmgr[bank].blk_lists[region].tail + size - 1) % size;
+    UINT16 blk = get_blk_id(bank, region, idx);
+
+    set_blk_id(bank, region, idx, get_blk_id(bank, region, tail));
+    set_blk_id(bank, region, tail, blk);
+    blkmgr[bank].blk_lists[region].tail = tail;
+    blkmgr[bank].blk_lists[region].free--;
+    blkmgr[bank].free_blk_cnt--;
+    set_vcount(bank, blk, VC_MAX);
+}
+
+static void relocate_bad_blk(UINT32 const bank, UINT32 const blk,
+                             UINT32 const lpns, UINT32 const n_pgs)
+{
+    for (UINT32 pg = 0; pg < n_pgs; pg++) {
+        UINT32 lpn = read_dram_32(lpns + pg * sizeof(UINT32));
+        if (get_ppn(lpn) != GPPN(bank, blk * PAGES_PER_VBLK + pg))
+            continue;
+
+        UINT32 new_ppn = get_and_inc_active_ppn(bank, NUM_REGIONS - 1);
+        UINT32 new_blk = new_ppn / PAGES_PER_VBLK;
+        UINT32 new_page = new_ppn % PAGES_PER_VBLK;
+        set_ppn(lpn, GPPN(bank, new_ppn));
+        set_lpn(bank, NUM_REGIONS - 1, new_page, lpn);
+        set_vcount(bank, new_blk, get_vcount(bank, new_blk) + 1);
+        dec_vcount(bank, blk);
+        log_insert_mapent(lpn, GPPN(bank, new_ppn));
+
+        /* the failed page is re-issued as it was, the others are GC copies */
+        UINT32 i = find_prog_fail(bank, blk, pg);
+        if (i != n_prog_fails) {
+            #ifdef VST
+            set_spare(prog_fails[i].spare, SUBMAP_SPARE_BYTES);
+            #endif
+            if (prog_fails[i].src_ppn != (UINT32)-1)
+                nand_page_copyback(bank,
+                        prog_fails[i].src_ppn / PAGES_PER_VBLK,
+                        prog_fails[i].src_ppn % PAGES_PER_VBLK,
+                        new_blk, new_page);
+            else
+                nand_page_program(bank, new_blk, new_page, FAIL_BUF(i));
+        } else {
+            #ifdef VST
+            UINT8 spare[64];
+            UINT32 gc_tag = (UINT32)-2;
+            mem_copy(spare, &lpn, sizeof(UINT32));
+            mem_copy(spare + 8, &gc_tag, sizeof(UINT32));
+            set_spare(spare, 12);
+            #endif
+            nand_page_copyback(bank, blk, pg, new_blk, new_page);
+        }
+    }
+    ASSERT(get_vcount(bank, blk) == 0);
+    set_vcount(bank, blk, VC_MAX);
+}
+
+/**
+ * Load the summary of a full block into lpns. A failed summary page is taken
+ * from its fail buffer, and one that does not read back is rebuilt from the
+ * page map.
+ */
+static void load_blk_summary(UINT32 const bank, UINT32 const blk, UINT32 const lpns)
+{
+    UINT32 bytes = PAGES_PER_VBLK * sizeof(UINT32) + sizeof(UINT32);
+    UINT32 i = find_prog_fail(bank, blk, PAGES_PER_VBLK - 1);
+
+    if (i != n_prog_fails) {
+        mem_copy(lpns, FAIL_BUF(i), bytes);
+        return;
+    }
+    nand_page_ptread(bank, blk, PAGES_PER_VBLK - 1, 0,
+            ROUND_UP(bytes + sizeof(UINT32), BYTES_PER_SECTOR) / BYTES_PER_SECTOR,
+            lpns, RETURN_WHEN_DONE);
+    if (read_dram_32(lpns + bytes) == crc32c(lpns, bytes))
+        return;
+
+    UINT32 gblk = GPPN(bank, blk * PAGES_PER_VBLK) / PAGES_PER_VBLK;
+    mem_set_dram(lpns, 0, bytes);
+    for (UINT32 lpn = 0; lpn < NUM_MAP_ENTS; lpn++) {
+        UINT32 ppn = get_ppn(lpn);
+        if (ppn / PAGES_PER_VBLK == gblk)
+            write_dram_32(lpns + (ppn % PAGES_PER_VBLK) * sizeof(UINT32), lpn);
+    }
+}
+
+/**
+ * A block that went bad while all the slots for bad active blocks were taken
+ * is closed like any full block. Relocate those of the region, and return
+ * how many there were.
+ */
+static UINT32 relocate_full_bad_blks(UINT32 const bank, UINT32 const region)
+{
+    UINT32 head = blkmgr[bank].blk_lists[region].head;
+    UINT32 size = blkmgr[bank].blk_lists[region].size;
+    UINT32 blk_active = get_active_ppn(bank, region) / PAGES_PER_VBLK;
+    UINT32 n_blks = 0;
+
+    for (UINT32 i = blkmgr[bank].blk_lists[region].tail; i != head; i = (i + 1) % size) {
+        UINT32 blk = get_blk_id(bank, region, i);
+        UINT32 vcount = get_vcount(bank, blk);
+        if (!is_bad_block(bank, blk) || blk == blk_active || vcount == 0 ||
+                vcount == VC_MAX)
+            continue;
+        load_blk_summary(bank, blk, GC_BUF(bank));
+        relocate_bad_blk(bank, blk, GC_BUF(bank), PAGES_PER_VBLK - 1);
+        n_blks++;
+    }
+    return n_blks;
+}
+
+static void load_bad_blk_bmp(void)
+{
+    UINT32 buf = TEMP_BUF_ADDR;
+    UINT32 pg;
+
+    for (pg = 0; pg < PAGES_PER_VBLK; pg++) {
+        nand_page_ptread(0, BAD_BLK_TBL_BLK, pg, 0, BAD_BLK_TBL_SECTS, buf,
+                RETURN_WHEN_DONE);
+        if (read_dram_32(buf) != 600 ||
+                read_dram_32(buf + 4) != crc32c(buf + 8, BAD_BLK_BMP_BYTES))
+            break;
+    }
+    bad_blk_tbl_pg = pg;
+    if (pg == 0)
+        return;
+
+    nand_page_ptread(0, BAD_BLK_TBL_BLK, pg - 1, 0, BAD_BLK_TBL_SECTS, buf,
+            RETURN_WHEN_DONE);
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
+        UINT32 bmp = buf + 8 + bank*(VBLKS_PER_BANK/8 + 1);
+        for (UINT32 blk = BAD_BLK_TBL_BLK + 1; blk < VBLKS_PER_BANK; blk++) {
+            if (tst_bit_dram(bmp, blk) && !is_bad_block(bank, blk)) {
+                set_bit_dram(BAD_BLK_BMP_ADDR + bank*(VBLKS_PER_BANK/8 + 1), blk);
+                inc_bad_blk_cnt(bank);
+            }
+        }
+    }
+}
+
+/**
+ * Append the bad block bitmap to its table. The table block is erased when
+ * it is full, or before its first use since it may hold anything.
+ */
+static void persist_bad_blk_bmp(void)
+{
+    UINT32 buf = TEMP_BUF_ADDR;
+
+    if (bad_blk_tbl_pg == 0 || bad_blk_tbl_pg == PAGES_PER_VBLK) {
+        erase_blk(0, BAD_BLK_TBL_BLK);
+        bad_blk_tbl_pg = 0;
+    }
+    write_dram_32(buf, 600);
+    write_dram_32(buf + 4, crc32c(BAD_BLK_BMP_ADDR, BAD_BLK_BMP_BYTES));
+    mem_copy(buf + 8, BAD_BLK_BMP_ADDR, BAD_BLK_BMP_BYTES);
+    nand_page_ptprogram(0, BAD_BLK_TBL_BLK, bad_blk_tbl_pg, 0,
+            BAD_BLK_TBL_SECTS, buf);
+    bad_blk_tbl_pg++;
 }
@@ -13,7 +13,8 @@ void blkmgr_erase_cur_map_blk(void);
 void erase_all_blks(void);
 UINT32 get_and_inc_active_blk(UINT32 const bank, UINT32 const region);
 UINT32 get_log_blk(UINT32 const bank);
-void revert_log_blk(UINT32 const bank);
+UINT32 blkmgr_get_log_head(UINT32 const bank);
+void blkmgr_set_log_head(UINT32 const bank, UINT32 const blk);
 UINT32 get_rsv_blk(UINT32 const bank, UINT32 const region);
 UINT32 n_cur_rsv_blks(void);
 void push_rsv(UINT32 const bank);
@@ -21,10 +22,22 @@ void inc_vcount(UINT32 const bank, UINT32 const blk);
 void dec_vcount(UINT32 const bank, UINT32 const blk);
 UINT32 blkmgr_reach_batch_gc_threshold(void);
 UINT32 reach_gc_threshold(UINT32 const bank, UINT32 const region);
-void garbage_collection(UINT32 const bank, UINT32 const region);
+UINT32 blkmgr_lack_gc_victims(UINT32 const region);
+void garbage_collection(UINT32 const region);
+void blkmgr_wear_leveling(void);
 void blkmgr_erase_vt_blk(UINT32 const bank);
 UINT32 blkmgr_reach_log_reclaim_threshold(void);
 void blkmgr_reclaim_log(void);
 UINT32 blkmgr_first_gc_triggered(void);
+UINT32 blkmgr_is_bad_blk(UINT32 const bank, UINT32 const blk);
+void blkmgr_report_prog_fail(UINT32 const bank, UINT32 const blk,
+                             UINT32 const page, UINT32 const buf);
+void blkmgr_report_cb_fail(UINT32 const bank, UINT32 const src_blk,
+                           UINT32 const src_page, UINT32 const dst_blk,
+                           UINT32 const dst_page);
+void blkmgr_report_erase_fail(UINT32 const bank, UINT32 const blk);
+UINT32 blkmgr_has_bad_blks(void);
+UINT32 blkmgr_take_map_blk_fail(void);
+void blkmgr_handle_bad_blks(void);
 
 #endif // BLKMGR_H
@@ -6,6 +6,7 @@
 #include "ftl.h"
 #include "board.h"
 #include "cache.h"
+#include "blkmgr.h"
 
 void ftl_isr(void)
 {
@@ -36,13 +37,24 @@ void ftl_isr(void)
         }
         if (flags & (FIRQ_BADBLK_H | FIRQ_BADBLK_L)) {
             uart_printf("BSP interrupt at bank: 0x%x\n", bank);
+            UINT32 row = GETREG(BSP_ROW_H(bank));
             if (fc == FC_COL_ROW_IN_PROG || fc == FC_IN_PROG || fc == FC_PROG) {
                 uart_printf("Find runtime bad block on programming blk #%d\n",
-                        GETREG(BSP_ROW_H(bank)) / PAGES_PER_BLK);
+                        row / PAGES_PER_BLK);
+                /* the buffer is saved, as it may be reused before the page is re-issued */
+                blkmgr_report_prog_fail(bank, row / PAGES_PER_BLK, row % PAGES_PER_BLK,
+                        ROUND_DOWN(GETREG(BSP_DMA_ADDR(bank)), BYTES_PER_PAGE));
+            } else if (fc == FC_COPYBACK) {
+                UINT32 row_dst = GETREG(BSP_DST_ROW_H(bank));
+                uart_printf("Find runtime bad block on copyback to blk #%d\n",
+                        row_dst / PAGES_PER_BLK);
+                blkmgr_report_cb_fail(bank, row / PAGES_PER_BLK, row % PAGES_PER_BLK,
+                        row_dst / PAGES_PER_BLK, row_dst % PAGES_PER_BLK);
             } else {
                 uart_printf("Find runtime bad block on erasing blk #%d\n",
-                        GETREG(BSP_ROW_H(bank)) / PAGES_PER_BLK);
+                        row / PAGES_PER_BLK);
                 ASSERT(fc == FC_ERASE);
+                blkmgr_report_erase_fail(bank, row / PAGES_PER_BLK);
             }
         }
     }
@@ -9,11 +9,17 @@
 #include "cache.h"
 #include "log.h"
 #include "stat.h"
+#include "board.h"
+#include "submap.h"
+
+#define SECT_BMP_WORDS  ((SECTORS_PER_PAGE + 31) / 32)
 
 typedef struct {
     UINT8 dirty;
     UINT16 pg_span;
     UINT32 lpn;
+    /* sectors of the buffer holding data of lpn; the rest is read on flush */
+    UINT32 valid[SECT_BMP_WORDS];
 } cache_ent_t;
 
 typedef struct {
@@ -21,24 +27,56 @@ typedef struct {
     UINT8 stall;
     UINT16 n_dirty_bufs;
     UINT16 buf_id_incomplete;
+    UINT8 bank_incomplete;      /* the bank buf_id_incomplete is programmed to */
     UINT8 lru_list[NUM_CACHE_BUFFERS_PER_BANK];
+    /* write-back: drain above wm_hi until back to wm_lo */
+    UINT8 draining;
+    UINT8 wm_hi;
+    UINT8 wm_lo;
+    UINT8 n_visit;
+    UINT8 n_idle;               /* visits of this window finding the bank idle */
+    UINT8 n_arrive;             /* entries dirtied in this window */
+    UINT8 arrive_rate;          /* smoothed n_arrive */
+    UINT8 idle_rate;            /* smoothed n_idle */
 } cache_t;
 
 static cache_t cache[NUM_BANKS];
 static UINT32 pool_bank;
+/* host writes since the last tick and since the last periodic flush */
+static UINT32 n_arrive_tick;
+static UINT32 n_arrive_flush;
+static UINT32 n_tick;
 extern UINT32 g_ftl_write_buf_id;
 extern UINT32 g_epoch;
 extern UINT16 g_pg_span;
 extern UINT32 enable_gc_opt;
 
+static void set_valid(cache_ent_t *ent_p, UINT32 sect, UINT32 n_sect);
+static UINT32 is_valid(cache_ent_t *ent_p, UINT32 sect);
+static UINT32 get_chunk_mask(cache_ent_t *ent_p);
+static UINT32 pick_bank(UINT32 const bank);
+static void wb_visit(UINT32 const bank);
+
 void init_cache(void)
 {
     pool_bank = 0;
+    n_arrive_tick = 0;
+    n_arrive_flush = 0;
+    n_tick = 0;
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
         cache[bank].stall = 0;
         cache[bank].n_dirty_bufs = 0;
         cache[bank].buf_id_incomplete = -1;
-        for (UINT32 i = 0; i < NUM_CACHE_BUFFERS_PER_BANK; i++) {
+        cache[bank].bank_incomplete = bank;
+        cache[bank].draining = 0;
+        cache[bank].wm_hi = CACHE_BUFS_PER_BANK / 2;
+        cache[bank].wm_lo = CACHE_BUFS_PER_BANK / 2;
+        cache[bank].n_visit = 0;
+        cache[bank].n_idle = 0;
+        cache[bank].n_arrive = 0;
+        cache[bank].arrive_rate = 0;
+        cache[bank].idle_rate = 0;
+        for (UINT32 i = 0; i < CACHE_BUFS_PER_BANK; i++) {
             cache[bank].ents[i].dirty = 0;
             cache[bank].ents[i].lpn = -1;
             cache[bank].lru_list[i] = i;
@@ -48,15 +86,63 @@ void init_cache(void)
 
 void pool_write_buf(void)
 {
-    if (cache[pool_bank].n_dirty_bufs > NUM_CACHE_BUFFERS_PER_BANK / 2)
+    cache_t *cache_p = &cache[pool_bank];
+
+    wb_visit(pool_bank);
+    if (cache_p->n_dirty_bufs > cache_p->wm_hi)
+        cache_p->draining = 1;
+    else if (cache_p->n_dirty_bufs <= cache_p->wm_lo)
+        cache_p->draining = 0;
+
+    if (cache_p->draining)
         dequeue(pool_bank);
     else
         blkmgr_erase_vt_blk(pool_bank);
     pool_bank = (pool_bank + 1) % NUM_BANKS;
 }
 
+/**
+ * Pool from the idle loop of Main(): a cache whose bank is idle is drained
+ * down to its low watermark, ahead of the host.
+ */
+void pool_idle_write_buf(void)
+{
+    cache_t *cache_p = &cache[pool_bank];
+
+    wb_visit(pool_bank);
+    if (cache_p->n_dirty_bufs > cache_p->wm_lo &&
+            _BSP_FSM(REAL_BANK(pool_bank)) == BANK_IDLE) {
+        /* dequeue() returns 0 whether or not it took a page */
+        UINT32 n_dirty = cache_p->n_dirty_bufs;
+        dequeue(pool_bank);
+        if (cache_p->n_dirty_bufs < n_dirty)
+            stat_record_idle_drain(pool_bank);
+    } else {
+        blkmgr_erase_vt_blk(pool_bank);
+    }
+    pool_bank = (pool_bank + 1) % NUM_BANKS;
+}
+
+/**
+ * Called by the timer every second. The periodic flush is due AUTO_FLUSH
+ * seconds after the last one, or as soon as the host has written since then
+ * but not within the last second.
+ */
+void cache_flush_tick(void)
+{
+    n_tick++;
+    if (n_arrive_flush != 0 && (n_tick >= AUTO_FLUSH || n_arrive_tick == 0)) {
+        if (n_tick < AUTO_FLUSH)
+            stat_record_early_flush();
+        schedule_flush_depent();
+        n_arrive_flush = 0;
+        n_tick = 0;
+    }
+    n_arrive_tick = 0;
+}
+
 void enqueue(UINT32 const bank, UINT32 const lpn, UINT32 const buf_id,
-             UINT32 const hole_left, UINT32 const hole_right, UINT32 const comp)
+             UINT32 const hole_left, UINT32 const hole_right)
 {
     #if EXP_DETAIL
     uart_printf("Eq bk %u lpn %u buf %u\n", bank, lpn, buf_id);
@@ -66,6 +152,25 @@ void enqueue(UINT32 const bank, UINT32 const lpn, UINT32 const buf_id,
 
     wait_buf_complete(bank, buf_id);
 
+    /**
+     * A new entry holds only the sectors written. The rest of an unmapped
+     * page reads as never written, and the buffer may still hold the page
+     * from before it was trimmed.
+     */
+    if (ent_p->lpn != lpn) {
+        mem_set_sram(ent_p->valid, 0, sizeof(ent_p->valid));
+        if (get_ppn(lpn) == 0) {
+            if (!enable_gc_opt && hole_left + hole_right != 0) {
+                #ifdef VST
+                omit_next_dram_op();
+                #endif
+                mem_set_dram(CACHE_BUF(bank, buf_id), 0xffffffff, BYTES_PER_PAGE);
+            }
+            set_valid(ent_p, 0, SECTORS_PER_PAGE);
+        }
+    }
+    set_valid(ent_p, hole_left, SECTORS_PER_PAGE - hole_left - hole_right);
+
     if (!enable_gc_opt)
         mem_copy(CACHE_BUF(bank, buf_id) + hole_left * BYTES_PER_SECTOR,
                 WR_BUF_PTR(g_ftl_write_buf_id) + hole_left * BYTES_PER_SECTOR,
@@ -76,16 +181,24 @@ void enqueue(UINT32 const bank, UINT32 const lpn, UINT32 const buf_id,
     /* epoch is a global variable increases by 1 on receiving a write request */
     mem_copy(EPOCHS(bank, buf_id), &g_epoch, sizeof(UINT32));
     //ent_p->epoch = g_epoch;
-    if (!ent_p->dirty)
+    if (!ent_p->dirty) {
         cache_p->n_dirty_bufs++;
+        if (cache_p->n_arrive < 0xff)
+            cache_p->n_arrive++;
+    }
     ent_p->dirty = 1;
-    if (!comp)
-        cache_p->buf_id_incomplete = buf_id;
+    /* cache_flush_tick() clears the counters from the timer interrupt */
+    UINT32 was_disabled = disable_irq();
+    n_arrive_tick++;
+    n_arrive_flush++;
+    if (!was_disabled)
+        enable_irq();
+    stat_record_queue_depth(bank, cache_p->n_dirty_bufs);
 
     UINT16 idx_prev;
     for (idx_prev = 0; cache_p->lru_list[idx_prev] != buf_id; idx_prev++)
         ;
-    ASSERT(idx_prev < NUM_CACHE_BUFFERS_PER_BANK);
+    ASSERT(idx_prev < CACHE_BUFS_PER_BANK);
     for (UINT16 i = idx_prev; i > 0; i--)
         cache_p->lru_list[i] = cache_p->lru_list[i - 1];
     cache_p->lru_list[0] = buf_id;
@@ -102,60 +215,96 @@ UINT32 dequeue(UINT32 const bank)
 {
     if ((GETREG(WR_STAT) & 0x00000001) != 0)
         return 0;
-    if (_BSP_FSM(REAL_BANK(bank)) != BANK_IDLE || cache[bank].stall)
+    if (cache[bank].stall)
         return 0;
 
     cache_t *cache_p = &cache[bank];
 
+    /* a cache has at most one program in flight, on whichever bank */
+    if (_BSP_FSM(REAL_BANK(cache_p->bank_incomplete)) != BANK_IDLE)
+        return 0;
     cache_p->buf_id_incomplete = -1;
 
     UINT32 idx = 0;
-    while (idx < NUM_CACHE_BUFFERS_PER_BANK && !cache_p->ents[idx].dirty)
+    while (idx < CACHE_BUFS_PER_BANK && !cache_p->ents[idx].dirty)
         idx++;
 
     /* no dirty entry */
-    if (idx == NUM_CACHE_BUFFERS_PER_BANK)
+    if (idx == CACHE_BUFS_PER_BANK)
         return 1;
 
     /* find flushed buffer based on LRU */
-    for (UINT32 i = 0; i < NUM_CACHE_BUFFERS_PER_BANK; i++)
+    for (UINT32 i = 0; i < CACHE_BUFS_PER_BANK; i++)
         if (cache_p->ents[cache_p->lru_list[i]].dirty)
             idx = cache_p->lru_list[i];
 
     UINT32 lpn = cache_p->ents[idx].lpn;
 
+    /* a small update is packed instead of being merged with the old page */
+    UINT32 mask = get_chunk_mask(&cache_p->ents[idx]);
+    if (mask && !enable_gc_opt) {
+        /* packs are programmed to the bank of their pages */
+        if (_BSP_FSM(REAL_BANK(bank)) != BANK_IDLE)
+            return 0;
+        UINT32 ret = submap_pack(bank, lpn, CACHE_BUF(bank, idx), mask,
+                get_cache_ent_epoch(bank, idx), cache_p->ents[idx].pg_span);
+        if (ret == SUBMAP_BUSY)
+            return 0;
+        if (ret == SUBMAP_PACKED) {
+            cache_p->ents[idx].dirty = 0;
+            cache_p->n_dirty_bufs--;
+            return 0;
+        }
+    }
+
+    UINT32 bank_dst = pick_bank(bank);
+    if (bank_dst == -1)
+        return 0;
+
+    /**
+     * The old page is read right before it is replaced. Waiting on other
+     * banks below may pool the caches, which must not dequeue this one again.
+     */
+    stall_cache(bank);
+    cache_fill_holes(bank, idx);
+
     UINT32 old_ppn, new_ppn;
     old_ppn = get_ppn(lpn);
     UINT32 blk, page;
     UINT32 region = 1;
     /* this is an update operation */
     if (old_ppn != 0) {
-        blk = old_ppn / PAGES_PER_VBLK;
-        page = old_ppn % PAGES_PER_VBLK;
-        dec_vcount(bank, blk);
+        UINT32 bank_old = GPPN_BANK(old_ppn);
+        blk = GPPN_PPN(old_ppn) / PAGES_PER_VBLK;
+        dec_vcount(bank_old, blk);
         UINT32 epoch_old;
-        mem_copy(&epoch_old, BLK_TIME(bank, blk), sizeof(UINT32));
+        mem_copy(&epoch_old, BLK_TIME(bank_old, blk), sizeof(UINT32));
         UINT32 dist = g_epoch - epoch_old;
         stat_update_distance(dist);
         if (dist < stat_get_dist_median())
             //region = 0;
             region = 1;
     }
-    stat_region_balance_factor(bank, region);
+    stat_region_balance_factor(bank_dst, region);
 
-    new_ppn = get_and_inc_active_ppn(bank, region);
+    new_ppn = get_and_inc_active_ppn(bank_dst, region);
+    release_cache(bank);
     blk = new_ppn / PAGES_PER_VBLK;
     page = new_ppn % PAGES_PER_VBLK;
+    if (bank_dst != bank)
+        stat_record_redirect(bank_dst);
 
-    set_lpn(bank, region, page, lpn);
-    set_ppn(lpn, new_ppn);
-    inc_vcount(bank, blk);
+    set_lpn(bank_dst, region, page, lpn);
+    set_ppn(lpn, GPPN(bank_dst, new_ppn));
+    inc_vcount(bank_dst, blk);
 
     /* for checkpointing */
-    log_insert_mapent(lpn, new_ppn);
+    log_insert_mapent(lpn, GPPN(bank_dst, new_ppn));
+    submap_release(lpn);
 
     //mem_copy(HEAD_BUF(bank), CACHE_BUF(bank, idx), BYTES_PER_PAGE);
     cache_p->buf_id_incomplete = idx;
+    cache_p->bank_incomplete = bank_dst;
 
     cache_p->ents[idx].dirty = 0;
     cache_p->n_dirty_bufs--;
@@ -171,7 +320,7 @@ UINT32 dequeue(UINT32 const bank)
     /* async full-page program */
     if (!enable_gc_opt) {
         stat_data_page();
-        nand_page_program(bank, blk, page, CACHE_BUF(bank, idx));
+        nand_page_program(bank_dst, blk, page, CACHE_BUF(bank, idx));
     }
 
     #if EXP_DETAIL
@@ -188,7 +337,7 @@ void wait_buf_complete(UINT32 const bank, UINT32 const buf_id)
     if (buf_id == cache_p->buf_id_incomplete) {
         while ((GETREG(WR_STAT) & 0x00000001) != 0)
             ;
-        while (_BSP_FSM(REAL_BANK(bank)) != BANK_IDLE)
+        while (_BSP_FSM(REAL_BANK(cache_p->bank_incomplete)) != BANK_IDLE)
             ;
         cache_p->buf_id_incomplete = -1;
     }
@@ -203,20 +352,109 @@ void flush_write_buf(void)
             done &= dequeue(bank);
         }
     } while (!done);
+    submap_flush();
     flash_finish();
     #if 0
     uart_printf("Write buffer flushed\n");
     #endif
 }
 
+/**
+ * Read the sectors of the old page that were not written into the buffer.
+ * A single hole is read in place; otherwise the old page is read into the
+ * (otherwise unused) copy buffer of the bank and the holes are merged. A
+ * page with chunks in packs is always read whole through its overlay.
+ */
+void cache_fill_holes(UINT32 const bank, UINT32 const buf_id)
+{
+    cache_ent_t *ent_p = &cache[bank].ents[buf_id];
+    UINT32 n_holes = 0, base = 0, cnt = 0;
+
+    for (UINT32 sect = 0; sect < SECTORS_PER_PAGE; sect++) {
+        if (is_valid(ent_p, sect))
+            continue;
+        if (sect == 0 || is_valid(ent_p, sect - 1)) {
+            n_holes++;
+            base = sect;
+            cnt = 0;
+        }
+        cnt++;
+    }
+    if (n_holes == 0)
+        return;
+
+    stat_record_fill_holes(n_holes);
+    if (!enable_gc_opt) {
+        UINT32 gppn = get_ppn(ent_p->lpn);
+        UINT32 bank_old = GPPN_BANK(gppn);
+        UINT32 ppn = GPPN_PPN(gppn);
+        UINT32 idx = submap_lookup(ent_p->lpn);
+        ASSERT(gppn != 0);
+        wait_buf_complete(bank, buf_id);
+        wait_bank_free(bank);
+        if (n_holes == 1 && idx == -1) {
+            nand_page_ptread(bank_old, ppn / PAGES_PER_VBLK, ppn % PAGES_PER_VBLK,
+                    base, cnt, CACHE_BUF(bank, buf_id), RETURN_WHEN_DONE);
+        } else {
+            if (idx == -1)
+                nand_page_ptread(bank_old, ppn / PAGES_PER_VBLK, ppn % PAGES_PER_VBLK,
+                        0, SECTORS_PER_PAGE, _COPY_BUF(bank), RETURN_WHEN_DONE);
+            else
+                submap_read_page(bank, ent_p->lpn, idx, _COPY_BUF(bank),
+                        0, SECTORS_PER_PAGE);
+            for (UINT32 sect = 0; sect < SECTORS_PER_PAGE; sect = base + cnt) {
+                for (base = sect; base < SECTORS_PER_PAGE && is_valid(ent_p, base); base++)
+                    ;
+                for (cnt = 0; base + cnt < SECTORS_PER_PAGE && !is_valid(ent_p, base + cnt); cnt++)
+                    ;
+                if (cnt != 0)
+                    mem_copy(CACHE_BUF(bank, buf_id) + base * BYTES_PER_SECTOR,
+                            _COPY_BUF(bank) + base * BYTES_PER_SECTOR,
+                            cnt * BYTES_PER_SECTOR);
+            }
+        }
+    }
+    set_valid(ent_p, 0, SECTORS_PER_PAGE);
+}
+
 UINT32 exist_in_cache(UINT32 const bank, UINT32 const lpn)
 {
-    for (UINT32 i = 0; i < NUM_CACHE_BUFFERS_PER_BANK; i++)
+    for (UINT32 i = 0; i < CACHE_BUFS_PER_BANK; i++)
         if (cache[bank].ents[i].lpn == lpn)
             return i;
     return -1;
 }
 
+/* drop a clean entry of an unmapped page so that reads no longer hit it */
+void cache_invalidate(UINT32 const bank, UINT32 const lpn)
+{
+    UINT32 buf_id = exist_in_cache(bank, lpn);
+
+    if (buf_id == -1)
+        return;
+    ASSERT(!cache[bank].ents[buf_id].dirty);
+    cache[bank].ents[buf_id].lpn = -1;
+}
+
+/**
+ * Drop the entry of a page written as a whole around the cache. A dirty
+ * entry is never flushed; its write depends on the one replacing it.
+ */
+void cache_drop(UINT32 const bank, UINT32 const lpn)
+{
+    UINT32 buf_id = exist_in_cache(bank, lpn);
+
+    if (buf_id == -1)
+        return;
+    cache_ent_t *ent_p = &cache[bank].ents[buf_id];
+    if (ent_p->dirty) {
+        insert_dep_entry(get_cache_ent_epoch(bank, buf_id), ent_p->pg_span);
+        ent_p->dirty = 0;
+        cache[bank].n_dirty_bufs--;
+    }
+    ent_p->lpn = -1;
+}
+
 UINT32 is_cache_ent_dirty(UINT32 const bank, UINT32 const buf_id)
 {
     return cache[bank].ents[buf_id].dirty;
@@ -242,11 +480,11 @@ UINT32 get_clean_cache_buf(UINT32 const bank)
     UINT32 idx = 0;
     while (cache_p->ents[idx].dirty) {
         pool_write_buf();
-        idx = (idx + 1) % NUM_CACHE_BUFFERS_PER_BANK;
+        idx = (idx + 1) % CACHE_BUFS_PER_BANK;
     }
 
     /* find clean buffer based on LRU */
-    for (UINT32 i = 0; i < NUM_CACHE_BUFFERS_PER_BANK; i++)
+    for (UINT32 i = 0; i < CACHE_BUFS_PER_BANK; i++)
         if (!cache_p->ents[cache_p->lru_list[i]].dirty)
             idx = cache_p->lru_list[i];
 
@@ -278,3 +516,91 @@ UINT32 cache_get_total_dirty_bufs(void)
         n += cache[bank].n_dirty_bufs;
     return n;
 }
+
+static void set_valid(cache_ent_t *ent_p, UINT32 sect, UINT32 n_sect)
+{
+    for (; n_sect != 0; sect++, n_sect--)
+        ent_p->valid[sect / 32] |= 1 << (sect % 32);
+}
+
+static UINT32 is_valid(cache_ent_t *ent_p, UINT32 sect)
+{
+    return (ent_p->valid[sect / 32] >> (sect % 32)) & 1;
+}
+
+/**
+ * Mask of the chunks written if the entry is a small update: every chunk is
+ * either written or a hole, and at most PACK_MAX_CHUNKS are written.
+ */
+static UINT32 get_chunk_mask(cache_ent_t *ent_p)
+{
+    UINT32 mask = 0, n_chunks = 0;
+
+    if (!OPTION_SUBPAGE_MAP)
+        return 0;
+    for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++) {
+        UINT32 n_valid = 0;
+        for (UINT32 sect = c * SECTORS_PER_CHUNK; sect < (c + 1) * SECTORS_PER_CHUNK; sect++)
+            n_valid += is_valid(ent_p, sect);
+        if (n_valid == SECTORS_PER_CHUNK) {
+            mask |= 1 << c;
+            n_chunks++;
+        } else if (n_valid != 0) {
+            return 0;
+        }
+    }
+    return n_chunks <= PACK_MAX_CHUNKS ? mask : 0;
+}
+
+/**
+ * The bank to program the next page of the cache of bank to: its own bank if
+ * idle, or else the first idle bank that is neither reserved by a read nor
+ * short of free blocks. Returns -1 if there is none.
+ */
+static UINT32 pick_bank(UINT32 const bank)
+{
+    if (_BSP_FSM(REAL_BANK(bank)) == BANK_IDLE)
+        return bank;
+    if (!OPTION_DYNAMIC_BANK)
+        return -1;
+    for (UINT32 i = 1; i < NUM_BANKS; i++) {
+        UINT32 b = (bank + i) % NUM_BANKS;
+        if (_BSP_FSM(REAL_BANK(b)) == BANK_IDLE && !cache[b].stall &&
+                !reach_gc_threshold(b, 1))
+            return b;
+    }
+    return -1;
+}
+
+/**
+ * Every WB_WINDOW visits of the pool the watermarks of a bank are set again.
+ * The high one leaves room for about the entries dirtied in half a window,
+ * so a busy cache is drained early enough not to fill up, and a quiet one
+ * keeps its pages longer to absorb overwrites. The low one drains deeper as
+ * the bank is found idle, where draining costs the host nothing.
+ */
+static void wb_visit(UINT32 const bank)
+{
+    cache_t *cache_p = &cache[bank];
+
+    if (_BSP_FSM(REAL_BANK(bank)) == BANK_IDLE)
+        cache_p->n_idle++;
+    if (++cache_p->n_visit < WB_WINDOW)
+        return;
+
+    cache_p->arrive_rate = (cache_p->arrive_rate * 3 + cache_p->n_arrive) / 4;
+    cache_p->idle_rate = (cache_p->idle_rate * 3 + cache_p->n_idle) / 4;
+    cache_p->n_visit = 0;
+    cache_p->n_idle = 0;
+    cache_p->n_arrive = 0;
+
+    UINT32 room = cache_p->arrive_rate / 2;
+    if (room < WB_MIN_ROOM)
+        room = WB_MIN_ROOM;
+    if (room > CACHE_BUFS_PER_BANK / 2)
+        room = CACHE_BUFS_PER_BANK / 2;
+    cache_p->wm_hi = CACHE_BUFS_PER_BANK - room;
+    UINT32 depth = 1 + WB_MAX_DEPTH * cache_p->idle_rate / WB_WINDOW;
+    cache_p->wm_lo = cache_p->wm_hi - depth;
+    stat_record_watermarks(bank, cache_p->wm_hi, cache_p->wm_lo);
+}
@@ -8,12 +8,17 @@
 
 void init_cache(void);
 void pool_write_buf(void);
+void pool_idle_write_buf(void);
+void cache_flush_tick(void);
 void enqueue(UINT32 const bank, UINT32 const lpn, UINT32 const buf_id,
-             UINT32 const hole_left, UINT32 const hole_right, UINT32 const comp);
+             UINT32 const hole_left, UINT32 const hole_right);
 UINT32 dequeue(UINT32 const bank);
+void cache_fill_holes(UINT32 const bank, UINT32 const buf_id);
 void wait_buf_complete(UINT32 const bank, UINT32 const buf_id);
 void flush_write_buf(void);
 UINT32 exist_in_cache(UINT32 const bank, UINT32 const lpn);
+void cache_invalidate(UINT32 const bank, UINT32 const lpn);
+void cache_drop(UINT32 const bank, UINT32 const lpn);
 UINT32 is_cache_ent_dirty(UINT32 const bank, UINT32 const buf_id);
 UINT32 get_cache_ent_epoch(UINT32 const bank, UINT32 const buf_id);
 UINT16 get_cache_ent_pg_span(UINT32 const bank, UINT32 const buf_id);
@@ -0,0 +1,52 @@
+/**
+ * crc.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#include "ftl.h"
+#include "crc.h"
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/**
+ * Byte-wise table-driven CRC32C. Slice-by-8 would need 8 KB of tables, which
+ * does not pay off in SRAM; the table below takes 1 KB.
+ */
+static UINT32 crc_table[256];
+
+void init_crc(void)
+{
+    for (UINT32 i = 0; i < 256; i++) {
+        UINT32 crc = i;
+        for (UINT32 j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        crc_table[i] = crc;
+    }
+}
+
+/* addr is in DRAM; the bulk is read by words and the tail by bytes */
+UINT32 crc32c_update(UINT32 crc, UINT32 const addr, UINT32 const bytes)
+{
+    UINT32 pos = addr;
+    UINT32 end = addr + bytes;
+
+    while (pos % sizeof(UINT32) && pos != end)
+        crc = (crc >> 8) ^ crc_table[(crc ^ read_dram_8(pos++)) & 0xFF];
+    while (pos + sizeof(UINT32) <= end) {
+        crc ^= read_dram_32(pos);
+        crc = (crc >> 8) ^ crc_table[crc & 0xFF];
+        crc = (crc >> 8) ^ crc_table[crc & 0xFF];
+        crc = (crc >> 8) ^ crc_table[crc & 0xFF];
+        crc = (crc >> 8) ^ crc_table[crc & 0xFF];
+        pos += sizeof(UINT32);
+    }
+    while (pos != end)
+        crc = (crc >> 8) ^ crc_table[(crc ^ read_dram_8(pos++)) & 0xFF];
+    return crc;
+}
+
+UINT32 crc32c(UINT32 const addr, UINT32 const bytes)
+{
+    return crc32c_update(CRC32C_INIT, addr, bytes) ^ CRC32C_INIT;
+}
@@ -0,0 +1,15 @@
+/**
+ * crc.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#define CRC32C_INIT 0xFFFFFFFF
+
+void init_crc(void);
+UINT32 crc32c_update(UINT32 crc, UINT32 const addr, UINT32 const bytes);
+UINT32 crc32c(UINT32 const addr, UINT32 const bytes);
+
+#endif // CRC_H
@@ -5,6 +5,8 @@
  * 1. page-level mapping
  * 2. garbage collection
  * 3. write buffer and cache flushing
+ * 4. sub-page mapping of small updates
+ * 5. sequential write streams around the cache
  */
 
 #include <stdlib.h>
@@ -16,6 +18,9 @@
 #include "log.h"
 #include "stat.h"
 #include "board.h"
+#include "crc.h"
+#include "submap.h"
+#include "stream.h"
 
 static void init_dram(void);
 static void load_metadata(void);
@@ -27,6 +32,16 @@ UINT32 g_epoch;
 UINT32 g_ftl_read_buf_id, g_ftl_write_buf_id;
 UINT32 verbose;
 UINT32 enable_gc_opt;
+#ifdef VST
+ftl_cfg_t ftl_cfg = {
+    GC_THRESHOLD_DEFAULT,
+    BATCH_GC_THRESHOLD_DEFAULT,
+    HOT_REGION_BLKS_DEFAULT,
+    AUTO_FLUSH_DEFAULT,
+    NUM_CACHE_BUFFERS_PER_BANK,
+    MAX_LOG_BLKS_PER_BANK
+};
+#endif
 
 void ftl_open(void)
 {
@@ -36,10 +51,16 @@ void ftl_open(void)
 
     init_dram();
     uart_printf("Initializing DRAM done.\n");
+    init_crc();
     init_blkmgr();
     uart_printf("Initializing blkmgr done.\n");
     init_pgmap();
     uart_printf("Initializing pgmap done.\n");
+    /* page map segments are still being read; overlap the cache init with it */
+    init_cache();
+    uart_printf("Initializing cache done.\n");
+    init_submap();
+    init_stream();
 
     g_ftl_read_buf_id = 0;
     g_ftl_write_buf_id = 0;
@@ -54,11 +75,9 @@ void ftl_open(void)
     } else {
         load_metadata();
     }
+    pgmap_wait_restore();
     uart_printf("Format done.\n");
 
-    init_cache();
-    uart_printf("Initializing cache done.\n");
-
     flash_clear_irq();
 
     set_intr_mask(FIRQ_DATA_CORRUPT | FIRQ_BADBLK_L | FIRQ_BADBLK_H);
@@ -77,7 +96,8 @@ void ftl_open(void)
     //start_timer(TIMER_CH2, TIMER_PRESCALE_2, 3448276);
     /* 30 s */
     //start_timer(TIMER_CH2, TIMER_PRESCALE_2, 10344828);
-    start_timer(TIMER_CH2, TIMER_PRESCALE_2, 344828 * AUTO_FLUSH);
+    /* ticks every second; cache_flush_tick() decides when to flush */
+    start_timer(TIMER_CH2, TIMER_PRESCALE_2, 344828);
     #endif
 
     uart_printf("ftl_open() ends\n");
@@ -95,12 +115,13 @@ void ftl_open(void)
     uart_printf("Number of cache buffers per banks: %d\n", NUM_CACHE_BUFFERS_PER_BANK);
     uart_printf("Number of blocks reserved: %d\n", NUM_BLKS_RSV);
     uart_printf("Number of mapents per page: %d\n", NUM_MAPENTS_PER_PAGE);
-    uart_printf("Sanity check (mapents): %d < %d\n", NUM_MAPENTS_PER_PAGE * 8 + 8, BYTES_PER_PAGE);
-    ASSERT(NUM_MAPENTS_PER_PAGE * 8 + 8 < BYTES_PER_PAGE);
-    uart_printf("Sanity check (depents): %d < %d\n", NUM_DEPENTS_PER_PAGE * 12 + 8, BYTES_PER_PAGE);
-    ASSERT(NUM_DEPENTS_PER_PAGE * 20 + 8 < BYTES_PER_PAGE);
-    uart_printf("[optr] Auto-flush: %u s | GC batch: %u blks | Chkpt area: %u blks\n",
-                AUTO_FLUSH, BATCH_GC_THRESHOLD, NUM_LOG_BLKS_PER_BANK * NUM_BANKS);
+    uart_printf("Sanity check (log page): %d < %d\n",
+            LOG_PG_BODY_OFFSET + LOG_MAPENT_MAX_BYTES + LOG_DEPENT_BYTES, BYTES_PER_PAGE);
+    ASSERT(LOG_PG_BODY_OFFSET + LOG_MAPENT_MAX_BYTES + LOG_DEPENT_BYTES < BYTES_PER_PAGE);
+    uart_printf("[optr] Auto-flush: <= %u s | GC batch: %u blks | Chkpt area: up to %u blks\n",
+                AUTO_FLUSH, BATCH_GC_THRESHOLD, LOG_BLKS_PER_BANK * NUM_BANKS);
+    uart_printf("[optr] GC threshold: %u blks | Hot region: %u blks | Cache buffers used per bank: %u\n",
+                GC_THRESHOLD, HOT_REGION_BLKS, CACHE_BUFS_PER_BANK);
 
     UINT32 version = 10;
     uart_printf("Experimental FTL version %u\n", version);
@@ -112,7 +133,6 @@ void ftl_close(void)
     #if 1
     //record_depent();
     ftl_flush();
-    record_mapent();
     record_tag();
     #endif
     pgmap_close();
@@ -129,6 +149,9 @@ void ftl_read(UINT32 const lba, UINT32 const n_sect)
     #if 0
     cache_collect_dirty_rate();
     #endif
+    /* pages that failed to program are only readable once re-issued */
+    if (blkmgr_has_bad_blks())
+        ftl_prefix_flush();
 
     remain_sect = n_sect;
     lpn = lba / SECTORS_PER_PAGE;
@@ -148,15 +171,31 @@ void ftl_read(UINT32 const lba, UINT32 const n_sect)
         bank = get_bank(lpn);
         ppn = get_ppn(lpn);
 
-        UINT32 buf_id;
+        UINT32 buf_id, idx;
         buf_id = exist_in_cache(bank, lpn);
         if (buf_id == -1) {
-            if (ppn != 0) {
+            if ((idx = submap_lookup(lpn)) != -1) {
+                /* the sectors are assembled from the base and packs */
                 stall_cache(bank);
                 wait_bank_free(bank);
-                nand_page_ptread_to_host(bank, ppn / PAGES_PER_VBLK, ppn % PAGES_PER_VBLK,
-                        base_sect, cnt_sect);
+                submap_read_page(bank, lpn, idx, _COPY_BUF(bank), base_sect, cnt_sect);
                 release_cache(bank);
+                UINT32 next_read_buf_id = (g_ftl_read_buf_id + 1) % NUM_RD_BUFFERS;
+                wait_rdbuf_free(next_read_buf_id);
+                mem_copy(RD_BUF_PTR(g_ftl_read_buf_id) + base_sect * BYTES_PER_SECTOR,
+                        _COPY_BUF(bank) + base_sect * BYTES_PER_SECTOR,
+                        cnt_sect * BYTES_PER_SECTOR);
+                flash_finish();
+                set_bm_read_limit(next_read_buf_id);
+                g_ftl_read_buf_id = next_read_buf_id;
+            } else if (ppn != 0) {
+                /* the page may have been programmed to another bank */
+                UINT32 bank_ppn = GPPN_BANK(ppn);
+                stall_cache(bank_ppn);
+                wait_bank_free(bank_ppn);
+                nand_page_ptread_to_host(bank_ppn, GPPN_PPN(ppn) / PAGES_PER_VBLK,
+                        GPPN_PPN(ppn) % PAGES_PER_VBLK, base_sect, cnt_sect);
+                release_cache(bank_ppn);
             } else {
                 /* try to read a logical page that has never been written to */
                 UINT32 next_read_buf_id = (g_ftl_read_buf_id + 1) % NUM_RD_BUFFERS;
@@ -175,6 +214,7 @@ void ftl_read(UINT32 const lba, UINT32 const n_sect)
             #if 0
             uart_printf("R hit %u\n", lpn);
             #endif
+            cache_fill_holes(bank, buf_id);
             wait_buf_complete(bank, buf_id);
             UINT32 next_read_buf_id = (g_ftl_read_buf_id + 1) % NUM_RD_BUFFERS;
             wait_rdbuf_free(next_read_buf_id);
@@ -198,7 +238,6 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
     UINT32 remain_sect, base_sect, cnt_sect;
     UINT32 lpn;
     UINT32 bank;
-    UINT32 comp;
     UINT32 total_dirty_bufs;
 
     if (!n_sect)
@@ -215,6 +254,7 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
 
     UINT32 lpn_end = (lba + n_sect - 1) / SECTORS_PER_PAGE;
     g_pg_span = lpn_end - lpn + 1;
+    UINT32 seq = stream_detect(lba, n_sect);
 
     #if 0
     uart_printf("w %d %d\n", lba, n_sect);
@@ -241,67 +281,39 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
             #endif
         }
 
+        /* full pages of a sequential stream bypass the cache */
+        if (seq && cnt_sect == SECTORS_PER_PAGE && !enable_gc_opt) {
+            stream_write_page(bank, lpn);
+            remain_sect -= cnt_sect;
+            lpn++;
+            continue;
+        }
+
         UINT32 buf_id;
-        comp = 1;
         buf_id = exist_in_cache(bank, lpn);
         /* no existing entry with same lpn */
         if (buf_id == -1) {
             buf_id = get_clean_cache_buf(bank);
-            UINT32 ppn = get_ppn(lpn);
-            if (ppn != 0) {
-                if (cnt_sect == SECTORS_PER_PAGE) {
-                    stat_record_full_write(bank);
-                    #if 0
-                    uart_printf("Full W bk %u lpn %u buf %u\n", bank, lpn, buf_id);
-                    #endif
-                } else {
-                    if (base_sect == 0 || (base_sect + cnt_sect) % SECTORS_PER_PAGE == 0) {
-                        comp = 0;
-                        UINT32 base_preread;
-                        if (base_sect == 0)
-                            base_preread = cnt_sect;
-                        else
-                            base_preread = 0;
-                        UINT32 cnt_preread = SECTORS_PER_PAGE - cnt_sect;
-                        stat_record_update_side(bank);
-                        stall_cache(bank);
-                        wait_bank_free(bank);
-                        nand_page_ptread(bank,
-                                ppn / PAGES_PER_VBLK, ppn % PAGES_PER_VBLK,
-                                base_preread, cnt_preread,
-                                CACHE_BUF(bank, buf_id), RETURN_ON_ISSUE);
-                        release_cache(bank);
-                    }
-                    else {
-                        stat_record_update_center(bank);
-                        stall_cache(bank);
-                        wait_bank_free(bank);
-                        nand_page_ptread(bank,
-                                ppn / PAGES_PER_VBLK, ppn % PAGES_PER_VBLK,
-                                0, SECTORS_PER_PAGE,
-                                //CACHE_BUF(bank, buf_id), RETURN_WHEN_DONE);
-                                CACHE_BUF(bank, buf_id), RETURN_ON_ISSUE);
-                        wait_wr_free();
-                        wait_bank_free(bank);
-                        release_cache(bank);
-                    }
-                    #if 0
-                    uart_printf("Preread bk %u lpn %u buf %u\n", bank, lpn, buf_id);
-                    #endif
-                }
-            } else {
+            /**
+             * The rest of a partially written page is not read here, but when
+             * the entry is flushed, unless it has been overwritten by then.
+             */
+            if (get_ppn(lpn) == 0)
                 stat_record_insert(bank);
-                #if 0
-                uart_printf("New write bk %u lpn %u buf %u\n", bank, lpn, buf_id);
-                #endif
-            }
+            else if (cnt_sect == SECTORS_PER_PAGE)
+                stat_record_full_write(bank);
+            else if (base_sect == 0 || base_sect + cnt_sect == SECTORS_PER_PAGE)
+                stat_record_update_side(bank);
+            else
+                stat_record_update_center(bank);
+            #if 0
+            uart_printf("New W bk %u lpn %u buf %u\n", bank, lpn, buf_id);
+            #endif
         } else {
             if (is_cache_ent_dirty(bank, buf_id)) {
                 UINT32 epoch_src = get_cache_ent_epoch(bank, buf_id);
                 UINT16 pg_span = get_cache_ent_pg_span(bank, buf_id);
                 insert_dep_entry(epoch_src, pg_span);
-                if (is_depents_full())
-                    record_depent();
             }
             stat_record_merge_write(bank);
             #if 0
@@ -310,13 +322,20 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
         }
 
         enqueue(bank, lpn, buf_id, base_sect,
-                SECTORS_PER_PAGE - (base_sect + cnt_sect), comp);
+                SECTORS_PER_PAGE - (base_sect + cnt_sect));
 
         base_sect = 0;
         remain_sect -= cnt_sect;
         lpn++;
     }
 
+    /**
+     * The write is complete once enqueued. The epoch is advanced before GC,
+     * which commits when it meets grown bad blocks, so that the commit covers
+     * the write flushed below.
+     */
+    g_epoch++;
+
     if (blkmgr_reach_batch_gc_threshold()) {
         total_dirty_bufs = ftl_prefix_flush();
         stat_gc_flush_page(total_dirty_bufs);
@@ -325,11 +344,11 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
             done_gc = 1;
             /* TODO: Currently, we only use region 1 */
             for (UINT32 region = 1; region < NUM_REGIONS; region++) {
-                for (bank = 0; bank < NUM_BANKS; bank++) {
-                    if (reach_gc_threshold(bank, region)) {
-                        garbage_collection(bank, region);
-                    }
+                if (blkmgr_lack_gc_victims(region)) {
+                    ftl_prefix_flush();
+                    record_tag();
                 }
+                garbage_collection(region);
             }
 
             /* TODO: Currently, we only use region 1 */
@@ -341,14 +360,13 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
                 }
             }
         }
+        blkmgr_wear_leveling();
     }
-    g_epoch++;
 
     if (reach_chkpt_threshold()) {
         stat_record_chkpt();
         total_dirty_bufs = ftl_prefix_flush();
         stat_chkpt_flush_page(total_dirty_bufs);
-        record_mapent();
         record_tag();
     }
 
@@ -358,6 +376,9 @@ void ftl_write(UINT32 const lba, UINT32 const n_sect)
         stat_manual_flush_page(total_dirty_bufs);
     }
 
+    if (blkmgr_has_bad_blks())
+        ftl_prefix_flush();
+
     stat_periodic_show_stat();
 }
 
@@ -376,6 +397,11 @@ UINT32 ftl_prefix_flush(void)
     UINT32 total_dirty_bufs = cache_get_total_dirty_bufs();
     record_depent();
     flush_write_buf();
+    /* small updates of pages with no overlay left make room once durable */
+    submap_evict();
+    /* grown bad blocks are handled once every write is durable */
+    if (blkmgr_has_bad_blks())
+        blkmgr_handle_bad_blks();
     return total_dirty_bufs;
 }
 
@@ -389,6 +415,20 @@ void ftl_standby(void)
         uart_printf("Verbose off.\n");
 }
 
+/**
+ * Idle work of Main(): a periodic flush that fell due while the host was
+ * quiet, or else draining the caches ahead of the host.
+ */
+void ftl_background(void)
+{
+    if (reach_flush_depent()) {
+        UINT32 total_dirty_bufs = ftl_prefix_flush();
+        stat_manual_flush_page(total_dirty_bufs);
+        return;
+    }
+    pool_idle_write_buf();
+}
+
 void ftl_idle(void)
 {
     uart_printf("Start warming up to trigger GC.\n");
@@ -419,32 +459,56 @@ void ftl_idle(void)
     uart_printf("GC triggered, ready to accept requests.\n");
 }
 
-void ftl_trim(UINT32 const reserved, UINT32 const n_range_ents)
+/**
+ * DSM TRIM. The payload of n_sects sectors holds 64 range entries per sector,
+ * each a 48-bit lba and a 16-bit sector count. Only whole pages are unmapped.
+ * The ranges of a command are unmapped as one batch behind a single flush and
+ * commit, and the command takes an epoch like a write so that it is ordered
+ * with the writes around it.
+ */
+void ftl_trim(UINT32 const reserved, UINT32 const n_sects)
 {
+    UINT32 lba, n_sects_range;
+    UINT32 buf;
+    UINT32 n_unmapped = 0;
     #if 0
-    uart_printf("t %u %u\n", reserved, n_range_ents);
+    uart_printf("t %u %u\n", reserved, n_sects);
     #endif
-    UINT32 lba, n_sects;
-    for (UINT32 i = 0; i < n_range_ents; i++) {
-        while (!is_write_buf_valid())
-            ;
-        for (UINT32 j = 0; j < 512 / 8; j++) {
-            lba = read_dram_32(WR_BUF_PTR(g_ftl_write_buf_id) +
-                    (2 * j) * sizeof(UINT32));
-            n_sects = read_dram_32(WR_BUF_PTR(g_ftl_write_buf_id) +
-                    (2 * j + 1) * sizeof(UINT32));
-            n_sects = n_sects >> 16;
-            UINT32 lpn = (lba + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
-            UINT32 lpn_end = (lba + n_sects) / SECTORS_PER_PAGE;
-            UINT32 pg = lpn_end - lpn;
+    /* cached writes are made durable first, so that no dirty page is unmapped */
+    ftl_prefix_flush();
 
-            pgmap_trim(lpn, pg);
+    for (UINT32 sect = 0; sect < n_sects; sect++) {
+        if (sect % SECTORS_PER_PAGE == 0) {
+            while (!is_write_buf_valid())
+                ;
+        }
+        buf = WR_BUF_PTR(g_ftl_write_buf_id) + (sect % SECTORS_PER_PAGE) * BYTES_PER_SECTOR;
+        for (UINT32 j = 0; j < BYTES_PER_SECTOR / 8; j++) {
+            UINT32 hi = read_dram_32(buf + (2 * j + 1) * sizeof(UINT32));
+            lba = read_dram_32(buf + (2 * j) * sizeof(UINT32));
+            n_sects_range = hi >> 16;
+            if (!n_sects_range || (hi & 0xffff) || lba >= NUM_LSECTORS)
+                continue;
+            n_sects_range = MIN(n_sects_range, NUM_LSECTORS - lba);
+            UINT32 lpn = (lba + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+            UINT32 lpn_end = (lba + n_sects_range) / SECTORS_PER_PAGE;
+            if (lpn < lpn_end)
+                n_unmapped += pgmap_trim(lpn, lpn_end - lpn);
+            /* the unmaps are committed in chunks if they would overflow the log */
+            if (reach_chkpt_threshold())
+                record_tag();
         }
 
-        g_ftl_write_buf_id = (g_ftl_write_buf_id + 1) % NUM_WR_BUFFERS;
-        SETREG(BM_STACK_WRSET, g_ftl_write_buf_id);
-        SETREG(BM_STACK_RESET, 0x01);
+        if (sect % SECTORS_PER_PAGE == SECTORS_PER_PAGE - 1 || sect == n_sects - 1) {
+            g_ftl_write_buf_id = (g_ftl_write_buf_id + 1) % NUM_WR_BUFFERS;
+            SETREG(BM_STACK_WRSET, g_ftl_write_buf_id);
+            SETREG(BM_STACK_RESET, 0x01);
+        }
     }
+
+    g_epoch++;
+    record_tag();
+    stat_host_trim(n_unmapped);
 }
 
 UINT32 ftl_get_epoch_incomplete(void)
@@ -459,6 +523,7 @@ void ftl_recovery(void)
     done = analyze();
     if (!done)
         rebuild();
+    submap_rebuild();
 }
 
 UINT32 ftl_get_epoch(void)
@@ -502,6 +567,9 @@ static void format(void)
 {
     uart_printf("New SSD, start formating.\n");
 
+    /* map blocks are erased below; no restore read may be in flight */
+    pgmap_wait_restore();
+
     erase_all_blks();
 
     save_metadata();
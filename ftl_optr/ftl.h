@@ -42,8 +42,12 @@
 #define NUM_HEAD_BUFFERS    NUM_BANKS
 #define NUM_DEP_BUFFERS     1
 #define NUM_CHKPT_BUFFERS   (2 * NUM_BANKS)
+#define NUM_GC_BUFFERS      NUM_BANKS
+#define NUM_FAIL_BUFFERS    NUM_BANKS
+#define NUM_PACK_BUFFERS    (OPTION_SUBPAGE_MAP ? 2 * NUM_BANKS : 0)
+#define NUM_BAD_ACTIVE_BLKS 4           // bad active blocks pending per region
 
-#define DRAM_BYTES_OTHER    ((NUM_COPY_BUFFERS + NUM_FTL_BUFFERS + NUM_HIL_BUFFERS + NUM_TEMP_BUFFERS + NUM_CACHE_BUFFERS + NUM_HEAD_BUFFERS + NUM_DEP_BUFFERS + NUM_CHKPT_BUFFERS) * BYTES_PER_PAGE + BAD_BLK_BMP_BYTES + PAGE_MAP_BYTES + LPNS_BYTES + VCOUNT_BYTES + EPOCHS_BYTES + BLK_LIST_BYTES + BLK_TIME_BYTES)
+#define DRAM_BYTES_OTHER    ((NUM_COPY_BUFFERS + NUM_FTL_BUFFERS + NUM_HIL_BUFFERS + NUM_TEMP_BUFFERS + NUM_CACHE_BUFFERS + NUM_HEAD_BUFFERS + NUM_DEP_BUFFERS + NUM_CHKPT_BUFFERS + NUM_GC_BUFFERS + NUM_FAIL_BUFFERS + NUM_PACK_BUFFERS) * BYTES_PER_PAGE + BAD_BLK_BMP_BYTES + PAGE_MAP_BYTES + ERASE_CNT_BYTES + LPNS_BYTES + VCOUNT_BYTES + EPOCHS_BYTES + BLK_LIST_BYTES + BLK_TIME_BYTES + BAD_LPNS_BYTES + PACK_LIVE_BYTES + SUBMAP_STAMP_BYTES)
 
 #define WR_BUF_PTR(BUF_ID)  (WR_BUF_ADDR + ((UINT32)(BUF_ID)) * BYTES_PER_PAGE)
 #define WR_BUF_ID(BUF_PTR)  ((((UINT32)BUF_PTR) - WR_BUF_ADDR) / BYTES_PER_PAGE)
@@ -56,10 +60,17 @@
 #define CACHE_BUF(BANK, BUF_ID)     (CACHE_BUF_ADDR + ((BANK) * NUM_CACHE_BUFFERS_PER_BANK + (BUF_ID)) * BYTES_PER_PAGE)
 #define HEAD_BUF(BANK)      (HEAD_BUF_ADDR + (BANK) * BYTES_PER_PAGE)
 #define CHKPT_BUF(BUF_ID)   (CHKPT_BUF_ADDR + (BUF_ID) * BYTES_PER_PAGE)
+#define GC_BUF(BANK)        (GC_BUF_ADDR + (BANK) * BYTES_PER_PAGE)
+#define FAIL_BUF(ID)        (FAIL_BUF_ADDR + (ID) * BYTES_PER_PAGE)
+#define PACK_BUF(BANK)      (PACK_BUF_ADDR + (BANK) * BYTES_PER_PAGE)
+#define PACK_RD_BUF(BANK)   (PACK_BUF_ADDR + (NUM_BANKS + (BANK)) * BYTES_PER_PAGE)
 #define EPOCHS(BANK, BUF_ID)    (EPOCHS_ADDR + ((BANK) * NUM_CACHE_BUFFERS_PER_BANK + (BUF_ID)) * sizeof(UINT32))
 #define LPNS(BANK, REGION, PAGE)    (LPNS_ADDR + (BANK) * LPNS_BYTES_PER_BANK + (REGION) * LPNS_BYTES_PER_REG + (PAGE) * sizeof(UINT32))
+#define BAD_LPNS(BANK, REGION, IDX) (BAD_LPNS_ADDR + ((IDX) * LPNS_BYTES) + (BANK) * LPNS_BYTES_PER_BANK + (REGION) * LPNS_BYTES_PER_REG)
 #define BLK_TIME(BANK, BLK) (BLK_TIME_ADDR + (BANK * VBLKS_PER_BANK + BLK) * sizeof(UINT32))
-#define RECOVERY_PAGE_EPOCH(LPN)    (RECOVERY_PAGE_EPOCH_ADDR + (LPN) * sizeof(UINT32))
+#define RECOVERY_PAGE_EPOCH(LPN)    (RECOVERY_PAGE_EPOCH_ADDR + RECOVERY_EPOCH_IDX(LPN) * sizeof(UINT32))
+#define PACK_LIVE(PACK)     (PACK_LIVE_ADDR + (PACK))
+#define SUBMAP_STAMP(IDX)   (SUBMAP_STAMP_ADDR + (IDX) * sizeof(UINT32))
 
 ///////////////////////////////
 // DRAM segmentation
@@ -97,16 +108,29 @@
 #define CHKPT_BUF_ADDR      (DEP_BUF_ADDR + DEP_BUF_BYTES)
 #define CHKPT_BUF_BYTES     (NUM_CHKPT_BUFFERS * BYTES_PER_PAGE)
 
-#define PAGE_MAP_ADDR       (CHKPT_BUF_ADDR + CHKPT_BUF_BYTES)          // page mapping table
-#define PAGE_MAP_BYTES      ((NUM_LPAGES * sizeof(UINT32) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
+#define GC_BUF_ADDR         (CHKPT_BUF_ADDR + CHKPT_BUF_BYTES)              // summaries of the GC victims
+#define GC_BUF_BYTES        (NUM_GC_BUFFERS * BYTES_PER_PAGE)
 
-#define LPNS_ADDR           (PAGE_MAP_ADDR + PAGE_MAP_BYTES)
+#define FAIL_BUF_ADDR       (GC_BUF_ADDR + GC_BUF_BYTES)                    // data of failed programs
+#define FAIL_BUF_BYTES      (NUM_FAIL_BUFFERS * BYTES_PER_PAGE)
+
+#define PACK_BUF_ADDR       (FAIL_BUF_ADDR + FAIL_BUF_BYTES)                // open packs and chunk reads of sub-page mapping
+#define PACK_BUF_BYTES      (NUM_PACK_BUFFERS * BYTES_PER_PAGE)
+
+#define PAGE_MAP_ADDR       (PACK_BUF_ADDR + PACK_BUF_BYTES)      // page mapping table
+#define PAGE_MAP_BYTES      ((NUM_MAP_ENTS * sizeof(UINT32) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
+
+/* erase count of each block, right behind the page map so that both are persisted together */
+#define ERASE_CNT_ADDR      (PAGE_MAP_ADDR + PAGE_MAP_BYTES)
+#define ERASE_CNT_BYTES     ((NUM_BANKS * VBLKS_PER_BANK * sizeof(UINT16) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
+
+#define LPNS_ADDR           (ERASE_CNT_ADDR + ERASE_CNT_BYTES)
 #define LPNS_BYTES_PER_REG  ((PAGES_PER_VBLK * sizeof(UINT32) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
 #define LPNS_BYTES_PER_BANK (LPNS_BYTES_PER_REG * NUM_REGIONS)
 #define LPNS_BYTES          (NUM_BANKS * LPNS_BYTES_PER_BANK)
 
-#define BAD_BLK_BMP_ADDR    (LPNS_ADDR + LPNS_BYTES)              // bitmap of initial bad blocks
-#define BAD_BLK_BMP_BYTES   (((NUM_VBLKS / 8) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
+#define BAD_BLK_BMP_ADDR    (LPNS_ADDR + LPNS_BYTES)              // bitmap of initial and grown bad blocks
+#define BAD_BLK_BMP_BYTES   ((NUM_BANKS * (VBLKS_PER_BANK / 8 + 1) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
 
 #define VCOUNT_ADDR         (BAD_BLK_BMP_ADDR + BAD_BLK_BMP_BYTES)
 #define VCOUNT_BYTES        ((NUM_BANKS * VBLKS_PER_BANK * sizeof(UINT16) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
@@ -120,6 +144,15 @@
 #define BLK_TIME_ADDR       (BLK_LIST_ADDR + BLK_LIST_BYTES)
 #define BLK_TIME_BYTES      ((NUM_BANKS * VBLKS_PER_BANK * sizeof(UINT32) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
 
+#define BAD_LPNS_ADDR       (BLK_TIME_ADDR + BLK_TIME_BYTES)      // summaries of active blocks gone bad
+#define BAD_LPNS_BYTES      (NUM_BAD_ACTIVE_BLKS * LPNS_BYTES)
+
+#define PACK_LIVE_ADDR      (BAD_LPNS_ADDR + BAD_LPNS_BYTES)      // mapped chunks of each pack
+#define PACK_LIVE_BYTES     (OPTION_SUBPAGE_MAP ? ROUND_UP(NUM_PACKS, BYTES_PER_SECTOR) : 0)
+
+#define SUBMAP_STAMP_ADDR   (PACK_LIVE_ADDR + PACK_LIVE_BYTES)    // epoch of the last update packed to each overlay
+#define SUBMAP_STAMP_BYTES  (OPTION_SUBPAGE_MAP ? ROUND_UP(NUM_SUBMAP_ENTS * sizeof(UINT32), BYTES_PER_SECTOR) : 0)
+
 // #define BLKS_PER_BANK        VBLKS_PER_BANK
 
 /**
@@ -127,23 +160,123 @@
  * during recovery.
  */
 #define RECOVERY_PAGE_EPOCH_ADDR    DRAM_BASE
-#define RECOVERY_PAGE_EPOCH_BYTES   ((NUM_LPAGES * sizeof(UINT32) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
+#define RECOVERY_PAGE_EPOCH_BYTES   ((RECOVERY_EPOCH_ENTS * sizeof(UINT32) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR * BYTES_PER_SECTOR)
 
 #define ROUND_UP(x, a) (((x) + (a) - 1) / (a) * (a))
 #define ROUND_DOWN(x, a) ((x) / (a) * (a))
 #define VC_MAX 0xCDCD
-#define NUM_LOG_BLKS_PER_BANK 2
+/* log blocks are drawn from the free blocks on demand, up to this many per bank */
+#define MAX_LOG_BLKS_PER_BANK 4
 //#define NUM_MAPENTS_PER_PAGE 3600
 #define NUM_MAPENTS_PER_PAGE 1800
-//#define NUM_DEPENTS_PER_PAGE 1500
-#define NUM_DEPENTS_PER_PAGE 750
 #define NUM_BLKS_RSV 1600
 #define NUM_REGIONS 2
 #define OPTION_SHOW_ERASE_BLK_INFO 0
 //#define GC_THRESHOLD 50
-#define GC_THRESHOLD 120
-#define BATCH_GC_THRESHOLD 16
-#define AUTO_FLUSH 5
+#define GC_THRESHOLD_DEFAULT 120
+#define BATCH_GC_THRESHOLD_DEFAULT 16
+#define HOT_REGION_BLKS_DEFAULT 60
+/* the longest interval in seconds between periodic flushes */
+#define AUTO_FLUSH_DEFAULT 5
+/**
+ * Tuning knobs. The firmware uses the defaults above as constants; VST
+ * reads them from FTL_CONFIG at vst_open_ftl() (see vst/port.c), so that a
+ * sweep needs no rebuild. The cache and the log stay sized for
+ * NUM_CACHE_BUFFERS_PER_BANK and MAX_LOG_BLKS_PER_BANK, of which
+ * CACHE_BUFS_PER_BANK and LOG_BLKS_PER_BANK are used.
+ */
+#ifdef VST
+typedef struct {
+    UINT32 gc_threshold;
+    UINT32 batch_gc_threshold;
+    UINT32 hot_region_blks;
+    UINT32 auto_flush;
+    UINT32 cache_bufs_per_bank;
+    UINT32 log_blks_per_bank;
+} ftl_cfg_t;
+extern ftl_cfg_t ftl_cfg;
+#define GC_THRESHOLD        (ftl_cfg.gc_threshold)
+#define BATCH_GC_THRESHOLD  (ftl_cfg.batch_gc_threshold)
+#define HOT_REGION_BLKS     (ftl_cfg.hot_region_blks)
+#define AUTO_FLUSH          (ftl_cfg.auto_flush)
+#define CACHE_BUFS_PER_BANK (ftl_cfg.cache_bufs_per_bank)
+#define LOG_BLKS_PER_BANK   (ftl_cfg.log_blks_per_bank)
+#else
+#define GC_THRESHOLD        GC_THRESHOLD_DEFAULT
+#define BATCH_GC_THRESHOLD  BATCH_GC_THRESHOLD_DEFAULT
+#define HOT_REGION_BLKS     HOT_REGION_BLKS_DEFAULT
+#define AUTO_FLUSH          AUTO_FLUSH_DEFAULT
+#define CACHE_BUFS_PER_BANK NUM_CACHE_BUFFERS_PER_BANK
+#define LOG_BLKS_PER_BANK   MAX_LOG_BLKS_PER_BANK
+#endif
+/**
+ * Write-back watermarks are set every WB_WINDOW visits of a bank by the pool,
+ * keeping at least WB_MIN_ROOM clean buffers and draining at most
+ * WB_MAX_DEPTH + 1 entries below the high watermark at once.
+ */
+#define WB_WINDOW 64
+#define WB_MIN_ROOM 2
+#define WB_MAX_DEPTH (CACHE_BUFS_PER_BANK / 8)
+/**
+ * Wear leveling: a new active block is the least worn of the next
+ * WL_WINDOW free blocks, and every WL_CHECK_INTERVAL erases of a bank the
+ * least worn used block is migrated if it lags WL_THRESHOLD erases behind
+ * the most worn one.
+ */
+#define WL_WINDOW 8
+#define WL_CHECK_INTERVAL 64
+#define WL_THRESHOLD 100
+/**
+ * Sub-page mapping (see submap.c): an update of at most PACK_MAX_CHUNKS
+ * aligned chunks is packed with other small updates of the bank into a
+ * shared flash page instead of being merged with the rest of its page.
+ * Packs, overlay chunks and overlay owners are entries of the page map
+ * behind the NUM_LPAGES pages, so they are logged and persisted like pages.
+ * Without the option, the map and DRAM hold none of them.
+ */
+#define OPTION_SUBPAGE_MAP 1
+#define SECTORS_PER_CHUNK 8
+#define CHUNKS_PER_PAGE (SECTORS_PER_PAGE / SECTORS_PER_CHUNK)
+#define BYTES_PER_CHUNK (SECTORS_PER_CHUNK * BYTES_PER_SECTOR)
+#define PACK_MAX_CHUNKS (CHUNKS_PER_PAGE / 2)
+#define PACK_MAX_ENTS 4                 // updates per pack, bounded by the spare area in VST
+#define NUM_SUBMAP_ENTS 4096            // pages that may have chunks in packs
+#define SUBMAP_WAYS 4
+#define SUBMAP_EVICT_MAX 64             // overlays merged back per flush
+#define NUM_PACKS 4096                  // both bounded by RECOVERY_PAGE_EPOCH fitting below DEP_BUF
+#define PACK_LPN_BASE       ROUND_UP(NUM_LPAGES, NUM_BANKS)
+#define PACK_LPN(PACK)      (PACK_LPN_BASE + (PACK))
+#define CHUNK_LPN_BASE      (PACK_LPN_BASE + NUM_PACKS)
+#define CHUNK_LPN(IDX, C)   (CHUNK_LPN_BASE + (IDX) * CHUNKS_PER_PAGE + (C))
+#define OWNER_LPN_BASE      (CHUNK_LPN_BASE + NUM_SUBMAP_ENTS * CHUNKS_PER_PAGE)
+#define OWNER_LPN(IDX)      (OWNER_LPN_BASE + (IDX))
+/* recovery stamps pages, chunks and owners, but never packs */
+#if OPTION_SUBPAGE_MAP
+#define NUM_MAP_ENTS        (OWNER_LPN_BASE + NUM_SUBMAP_ENTS)
+#define RECOVERY_EPOCH_ENTS (NUM_MAP_ENTS - NUM_PACKS)
+#define RECOVERY_EPOCH_IDX(LPN) ((LPN) < CHUNK_LPN_BASE ? (LPN) : (LPN) - NUM_PACKS)
+#else
+#define NUM_MAP_ENTS        NUM_LPAGES
+#define RECOVERY_EPOCH_ENTS NUM_LPAGES
+#define RECOVERY_EPOCH_IDX(LPN) (LPN)
+#endif
+/**
+ * Sequential streams (see stream.c): the full pages of a stream that has
+ * run STREAM_SEQ_SECTORS sectors are programmed straight from the SATA
+ * write buffers instead of going through the cache.
+ */
+#define OPTION_SEQ_STREAM 1
+#define NUM_STREAMS 4
+#define STREAM_SEQ_SECTORS (NUM_BANKS * SECTORS_PER_PAGE)
+/**
+ * Dynamic banks: a dirty page is programmed to its own bank (lpn % NUM_BANKS)
+ * if that is idle, or else to any idle bank, so the map holds global ppns,
+ * which name the bank of the page as well.
+ */
+#define OPTION_DYNAMIC_BANK 1
+#define GPPN(BANK, PPN)     ((BANK) * PAGES_PER_BANK + (PPN))
+#define GPPN_BANK(X)        ((X) / PAGES_PER_BANK)
+#define GPPN_PPN(X)         ((X) % PAGES_PER_BANK)
 
 ///////////////////////////////
 // FTL public functions
@@ -158,8 +291,9 @@ void ftl_flush(void);
 UINT32 ftl_prefix_flush(void);
 void ftl_standby(void);
 void ftl_idle(void);
+void ftl_background(void);
 void ftl_isr(void);
-void ftl_trim(UINT32 const reserved, UINT32 const n_range_ents);
+void ftl_trim(UINT32 const reserved, UINT32 const n_sects);
 UINT32 ftl_get_epoch_incomplete(void);
 void ftl_recovery(void);
 UINT32 ftl_get_epoch(void);
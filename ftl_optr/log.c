@@ -9,30 +9,57 @@
 #include "cache.h"
 #include "log.h"
 #include "stat.h"
+#include "crc.h"
+#include "submap.h"
 
-static void set_chkpt_ent(UINT32 const bank, UINT32 const n_valid,
-                          UINT32 const lpn, UINT32 const ppn);
-static void set_mapent(UINT32 const idx, UINT32 const lpn, UINT32 const ppn);
+static UINT32 log_pg_room(void);
+static UINT32 varint_bytes(UINT64 val);
+static void put_varint(UINT64 val);
+static void put_mapent_run(void);
 static void set_dep_entry(UINT32 const idx, UINT32 const src,
                           UINT32 const dst, UINT16 const req_size);
-static void persist_mapent(UINT32 const bank_chkpt, UINT32 const idx,
-                           UINT32 const cnt);
-static void persist_tag(UINT32 const bank_chkpt);
-static void persist_depent(UINT32 const cnt_deps, UINT32 const bank_chkpt);
+static void set_tag(void);
+static void seal_log_pg(UINT32 const reason);
+static void reset_pred_ppns(void);
 
+#define SEAL_FULL 0
+#define SEAL_FLUSH 1
+#define SEAL_TAG 2
+
+/**
+ * Depents, mapents and commit tags of consecutive epochs are packed into
+ * shared log pages (group commit). The open page is built in a ring of
+ * CHKPT_BUFs and is only programmed when it is full, when a flush needs the
+ * depents in it to be durable, or when a commit tag is written.
+ */
 typedef struct {
+    /* records in the open log page */
     UINT32 cnt_deps;
     UINT32 cnt_mapents;
+    /* bytes of encoded mapents and the pending run in the open log page */
+    UINT32 mapent_bytes;
+    UINT32 run_len;
+    UINT32 prev_lpn;
+    /* encoded mapent bytes since the last commit tag */
+    UINT32 mapent_bytes_chkpt;
+    UINT32 buf_id;
     UINT32 bank_active;
     UINT32 require_flush_depent;
 } chkpt_t;
 
 static chkpt_t chkpt;
+static UINT32 pred_ppns[NUM_BANKS];
 
 void init_log(void)
 {
     chkpt.cnt_deps = 0;
     chkpt.cnt_mapents = 0;
+    chkpt.mapent_bytes = 0;
+    chkpt.run_len = 0;
+    chkpt.prev_lpn = 0;
+    chkpt.mapent_bytes_chkpt = 0;
+    reset_pred_ppns();
+    chkpt.buf_id = 0;
     chkpt.bank_active = 0;
     chkpt.require_flush_depent = 0;
 }
@@ -40,60 +67,47 @@ void init_log(void)
 extern UINT32 g_epoch;
 void insert_dep_entry(UINT32 const epoch_src, UINT16 const pg_span)
 {
+    if (log_pg_room() < LOG_DEPENT_BYTES)
+        seal_log_pg(SEAL_FULL);
     set_dep_entry(chkpt.cnt_deps, epoch_src, g_epoch, pg_span);
     chkpt.cnt_deps++;
 }
 
-UINT32 is_depents_full(void)
-{
-    return (chkpt.cnt_deps >= NUM_DEPENTS_PER_PAGE);
-}
-
 void log_insert_mapent(UINT32 const lpn, UINT32 const ppn)
 {
-    set_mapent(chkpt.cnt_mapents, lpn, ppn);
+    UINT32 bank = lpn % NUM_BANKS;
+
+    if (log_pg_room() < LOG_MAPENT_MAX_BYTES)
+        seal_log_pg(SEAL_FULL);
+    if (lpn == chkpt.prev_lpn + 1 && ppn == pred_ppns[bank]) {
+        chkpt.run_len++;
+    } else {
+        put_mapent_run();
+        /* widened first, as the flag bit would push out the top bit */
+        put_varint((UINT64)ZIGZAG(lpn - (chkpt.prev_lpn + 1)) << 1);
+        put_varint(ZIGZAG(ppn - pred_ppns[bank]));
+    }
+    chkpt.prev_lpn = lpn;
+    pred_ppns[bank] = ppn + 1;
     chkpt.cnt_mapents++;
 }
 
 UINT32 reach_chkpt_threshold(void)
 {
-    /* 512 is an arbitrary number to fully utilize the last mapent page */
-    return (chkpt.cnt_mapents > (NUM_BANKS - 1) * NUM_MAPENTS_PER_PAGE - 512 ||
+    /**
+     * The checkpoint interval is bounded by the log space the mapents take,
+     * i.e. NUM_BANKS - 1 pages of raw mapents, so better compression defers it.
+     * 512 is an arbitrary number to fully utilize the last mapent page.
+     */
+    return (chkpt.mapent_bytes_chkpt >
+            ((NUM_BANKS - 1) * NUM_MAPENTS_PER_PAGE - 512) * 2 * sizeof(UINT32) ||
             blkmgr_reach_log_reclaim_threshold());
 }
 
 static UINT32 pg_have_used;
 /* Invoke ftl_flush() before this method */
-void record_mapent(void)
-{
-    UINT32 pg;
-    UINT32 idx = 0;
-    UINT32 pg_used = 0;
-    UINT32 bank_chkpt = chkpt.bank_active;
-    while (chkpt.cnt_mapents) {
-        pg = chkpt.cnt_mapents > NUM_MAPENTS_PER_PAGE ?
-             NUM_MAPENTS_PER_PAGE : chkpt.cnt_mapents;
-        persist_mapent(bank_chkpt, idx, pg);
-        idx += pg;
-        chkpt.cnt_mapents -= pg;
-        pg_used++;
-        bank_chkpt = (bank_chkpt + 1) % NUM_BANKS;
-    }
-
-    pg_have_used += pg_used;
-    chkpt.bank_active = bank_chkpt;
-
-    #if 0
-    uart_printf("Record map ent done. Use %u pgs. Have used %u pgs\n",
-            pg_used, pg_have_used);
-    #endif
-}
-
 void record_tag(void)
 {
-    UINT32 bank_chkpt = chkpt.bank_active;
-    UINT32 pg_used = 0;
-
     /**
      * When this function is called upon format(), one must ensures it's
      * called after init_pgmap() so that the reserve blocks will not become -1.
@@ -101,18 +115,16 @@ void record_tag(void)
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
         push_rsv(bank);
 
+    /* the tag shares the open log page with the mapents preceding it */
     flash_finish();
-    persist_tag(bank_chkpt);
-    bank_chkpt = (bank_chkpt + 1) % NUM_BANKS;
-    pg_used++;
+    set_tag();
+    seal_log_pg(SEAL_TAG);
     flash_finish();
-
-    pg_have_used += pg_used;
-    chkpt.bank_active = bank_chkpt;
+    chkpt.mapent_bytes_chkpt = 0;
+    submap_commit();
 
     #if 0
-    uart_printf("Record commit tag done. Use %u pgs. Have used %u pgs\n",
-            pg_used, pg_have_used);
+    uart_printf("Record commit tag done. Have used %u pgs\n", pg_have_used);
     #endif
 
     if (blkmgr_reach_log_reclaim_threshold()) {
@@ -126,26 +138,19 @@ void record_tag(void)
     }
 }
 
+/**
+ * Make the depents inserted so far durable. Only pads the open log page when
+ * it holds depents; mapents alone are not needed until the next commit tag.
+ */
 void record_depent(void)
 {
     chkpt.require_flush_depent = 0;
     if (!chkpt.cnt_deps)
         return;
-    stat_record_dep(chkpt.cnt_deps);
-    UINT32 bank_chkpt = chkpt.bank_active;
-    UINT32 pg_used = 0;
-
-    persist_depent(chkpt.cnt_deps, bank_chkpt);
-    bank_chkpt = (bank_chkpt + 1) % NUM_BANKS;
-    pg_used++;
-    
-    pg_have_used += pg_used;
-    chkpt.bank_active = bank_chkpt;
-    chkpt.cnt_deps = 0;
+    seal_log_pg(SEAL_FLUSH);
 
     #if 0
-    uart_printf("Record dep ent done. Use %u pgs. Have used %u pgs\n",
-            pg_used, pg_have_used);
+    uart_printf("Record dep ent done. Have used %u pgs\n", pg_have_used);
     #endif
 }
 
@@ -159,85 +164,147 @@ void schedule_flush_depent(void)
     chkpt.require_flush_depent = 1;
 }
 
-static void set_chkpt_ent(UINT32 const bank, UINT32 const n_valid,
-                          UINT32 const lpn, UINT32 const ppn)
+/**
+ * CRC32C over the header, the tag, the mapents and the depents of the log
+ * page in buf, skipping the CRC field itself and the unused middle. Returns 0
+ * if the header does not describe a valid layout, which no valid page has.
+ */
+UINT32 log_pg_crc(UINT32 const buf)
+{
+    UINT32 mapent_bytes = read_dram_32(buf + 16);
+    UINT32 n_deps = read_dram_32(buf + 8);
+    UINT32 dep_bytes, crc;
+
+    if (mapent_bytes > BYTES_PER_PAGE || n_deps > BYTES_PER_PAGE / LOG_DEPENT_BYTES)
+        return 0;
+    dep_bytes = n_deps * LOG_DEPENT_BYTES;
+    if (LOG_PG_BODY_OFFSET + mapent_bytes + dep_bytes > BYTES_PER_PAGE)
+        return 0;
+    crc = crc32c_update(CRC32C_INIT, buf, LOG_PG_CRC_OFFSET);
+    crc = crc32c_update(crc, buf + LOG_PG_TAG_OFFSET,
+            LOG_PG_BODY_OFFSET - LOG_PG_TAG_OFFSET + mapent_bytes);
+    crc = crc32c_update(crc, buf + BYTES_PER_PAGE - dep_bytes, dep_bytes);
+    crc ^= CRC32C_INIT;
+    return crc ? crc : 1;
+}
+
+/* mapents grow from the front of the body, depents from the end of the page */
+static UINT32 log_pg_room(void)
+{
+    UINT32 run_bytes = chkpt.run_len ? varint_bytes((chkpt.run_len << 1) | 1) : 0;
+    return BYTES_PER_PAGE - LOG_PG_BODY_OFFSET -
+           chkpt.mapent_bytes - run_bytes -
+           chkpt.cnt_deps * LOG_DEPENT_BYTES;
+}
+
+static UINT32 varint_bytes(UINT64 val)
 {
-    UINT32 base = HEAD_BUF(bank) + sizeof(UINT32) + sizeof(UINT32) + n_valid * (2 * sizeof(UINT32));
-    write_dram_32(base, lpn);
-    write_dram_32(base + 4, ppn);
+    UINT32 n = 1;
+    while (val >= 0x80) {
+        val >>= 7;
+        n++;
+    }
+    return n;
 }
 
-static void set_mapent(UINT32 const idx, UINT32 const lpn, UINT32 const ppn)
+/* every mapent byte goes through here, including runs flushed on sealing */
+static void put_varint(UINT64 val)
 {
-    ASSERT(idx < 2 * NUM_BANKS * NUM_MAPENTS_PER_PAGE);
-    UINT32 base = CHKPT_BUF(idx / NUM_MAPENTS_PER_PAGE) +
-                  sizeof(UINT32) + sizeof(UINT32) +
-                  (idx % NUM_MAPENTS_PER_PAGE) * (2 * sizeof(UINT32));
-    write_dram_32(base, lpn);
-    write_dram_32(base + 4, ppn);
+    UINT32 addr = CHKPT_BUF(chkpt.buf_id) + LOG_PG_BODY_OFFSET + chkpt.mapent_bytes;
+    UINT32 bytes = chkpt.mapent_bytes;
+    while (val >= 0x80) {
+        write_dram_8(addr++, (val & 0x7F) | 0x80);
+        val >>= 7;
+    }
+    write_dram_8(addr++, val);
+    chkpt.mapent_bytes = addr - (CHKPT_BUF(chkpt.buf_id) + LOG_PG_BODY_OFFSET);
+    chkpt.mapent_bytes_chkpt += chkpt.mapent_bytes - bytes;
+}
+
+static void put_mapent_run(void)
+{
+    if (!chkpt.run_len)
+        return;
+    put_varint((chkpt.run_len << 1) | 1);
+    chkpt.run_len = 0;
 }
 
 static void set_dep_entry(UINT32 const idx, UINT32 const src,
                           UINT32 const dst, UINT16 const req_size)
 {
-    UINT32 base = DEP_BUF_ADDR + sizeof(UINT32) + sizeof(UINT32) + idx * (2 * sizeof(UINT32) + sizeof(UINT32));
+    UINT32 base = CHKPT_BUF(chkpt.buf_id) + BYTES_PER_PAGE -
+                  (idx + 1) * LOG_DEPENT_BYTES;
     mem_copy(base, &src, sizeof(UINT32));
     mem_copy(base + 4, &dst, sizeof(UINT32));
     write_dram_32(base + 8, req_size);
 }
 
-static void persist_mapent(UINT32 const bank_chkpt, UINT32 const idx,
-                           UINT32 const cnt)
-{
-    write_dram_32(CHKPT_BUF(idx / NUM_MAPENTS_PER_PAGE), 200);
-    write_dram_32(CHKPT_BUF(idx / NUM_MAPENTS_PER_PAGE) + 4, cnt);
-    UINT32 ppn_chkpt = get_log_ppn(bank_chkpt);
-    #if 0
-    uart_printf("record at %u %u\n", bank_chkpt, ppn_chkpt);
-    #endif
-    stat_chkpt_page();
-    nand_page_program(
-            bank_chkpt,
-            ppn_chkpt / PAGES_PER_VBLK, ppn_chkpt % PAGES_PER_VBLK,
-            CHKPT_BUF(idx / NUM_MAPENTS_PER_PAGE)
-    );
-}
-
 /* order is preserved by bank and blk id */
-static void persist_tag(UINT32 const bank_chkpt)
+static void set_tag(void)
 {
     UINT32 epoch_latest = g_epoch - 1;
-    write_dram_32(HEAD_BUF(bank_chkpt), 100);
-    mem_copy(HEAD_BUF(bank_chkpt) + 4, &epoch_latest, sizeof(UINT32));
+    UINT32 base = CHKPT_BUF(chkpt.buf_id) + LOG_PG_TAG_OFFSET;
+    mem_copy(base, &epoch_latest, sizeof(UINT32));
     UINT32 active_ppns[NUM_BANKS][NUM_REGIONS];
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
         for (UINT32 region = 0; region < NUM_REGIONS; region++)
             active_ppns[bank][region] = get_active_ppn(bank, region);
-    mem_copy(HEAD_BUF(bank_chkpt) + 8, active_ppns, sizeof(active_ppns));
-    UINT32 ppn_chkpt = get_log_ppn(bank_chkpt);
-    #if 0
-    uart_printf("tag at %u %u\n", bank_chkpt, ppn_chkpt);
-    #endif
-    stat_tag_page();
-    nand_page_program(
-            bank_chkpt,
-            ppn_chkpt / PAGES_PER_VBLK, ppn_chkpt % PAGES_PER_VBLK,
-            HEAD_BUF(bank_chkpt)
-    );
+    mem_copy(base + 4, active_ppns, sizeof(active_ppns));
 }
 
-static void persist_depent(UINT32 const cnt_deps, UINT32 const bank_chkpt)
+static void seal_log_pg(UINT32 const reason)
 {
-    write_dram_32(DEP_BUF_ADDR, 300);
-    write_dram_32(DEP_BUF_ADDR + 4, cnt_deps);
+    UINT32 buf = CHKPT_BUF(chkpt.buf_id);
+    put_mapent_run();
+    write_dram_32(buf, 400);
+    write_dram_32(buf + 4, chkpt.cnt_mapents);
+    write_dram_32(buf + 8, chkpt.cnt_deps);
+    write_dram_32(buf + 12, reason == SEAL_TAG);
+    write_dram_32(buf + 16, chkpt.mapent_bytes);
+    write_dram_32(buf + LOG_PG_CRC_OFFSET, log_pg_crc(buf));
+
+    UINT32 bank_chkpt = chkpt.bank_active;
     UINT32 ppn_chkpt = get_log_ppn(bank_chkpt);
     #if 0
-    uart_printf("dep at %u %u\n", bank_chkpt, ppn_chkpt);
+    uart_printf("log pg at %u %u (%u, %u, %u)\n", bank_chkpt, ppn_chkpt,
+            chkpt.cnt_mapents, chkpt.cnt_deps, reason);
     #endif
-    stat_dep_page();
+    switch (reason) {
+    case SEAL_FULL:
+        stat_chkpt_page();
+        break;
+    case SEAL_FLUSH:
+        stat_dep_page();
+        break;
+    case SEAL_TAG:
+        stat_tag_page();
+        break;
+    }
+    if (chkpt.cnt_deps)
+        stat_record_dep(chkpt.cnt_deps);
+    stat_record_mapent(chkpt.cnt_mapents, chkpt.mapent_bytes);
     nand_page_program(
             bank_chkpt,
             ppn_chkpt / PAGES_PER_VBLK, ppn_chkpt % PAGES_PER_VBLK,
-            DEP_BUF_ADDR
+            buf
     );
+    pg_have_used++;
+    chkpt.bank_active = (bank_chkpt + 1) % NUM_BANKS;
+    chkpt.cnt_mapents = 0;
+    chkpt.cnt_deps = 0;
+    chkpt.mapent_bytes = 0;
+    chkpt.prev_lpn = 0;
+    reset_pred_ppns();
+
+    /* programs from the previous round of the ring must be done before reuse */
+    chkpt.buf_id = (chkpt.buf_id + 1) % NUM_CHKPT_BUFFERS;
+    if (chkpt.buf_id == 0)
+        flash_finish();
+}
+
+/* the ppns predicted for the first page of each bank in a log page */
+static void reset_pred_ppns(void)
+{
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        pred_ppns[bank] = GPPN(bank, 0);
 }
@@ -6,12 +6,36 @@
 #ifndef LOG_H
 #define LOG_H
 
+/**
+ * Layout of a log page: magic (400), number of mapents, number of depents,
+ * whether the page carries a commit tag, bytes of encoded mapents, CRC32C of
+ * the used part of the page, the tag (epoch and active ppns), then mapents
+ * growing forward and depents growing backward from the end.
+ */
+#define LOG_PG_CRC_OFFSET   (5 * sizeof(UINT32))
+#define LOG_PG_TAG_OFFSET   (6 * sizeof(UINT32))
+#define LOG_PG_TAG_BYTES    (sizeof(UINT32) + NUM_BANKS * NUM_REGIONS * sizeof(UINT32))
+#define LOG_PG_BODY_OFFSET  (LOG_PG_TAG_OFFSET + LOG_PG_TAG_BYTES)
+#define LOG_DEPENT_BYTES    (3 * sizeof(UINT32))
+
+/**
+ * Mapents are stored as a stream of varint tokens. The lpn is predicted as
+ * the previous lpn plus one and the (global) ppn as the page after the
+ * previous ppn of an lpn of the same home bank (lpn % NUM_BANKS); predictors
+ * restart on every page.
+ * A token with its lowest bit set is a run of N correctly predicted entries;
+ * otherwise it carries the zigzag lpn delta and is followed by the zigzag ppn
+ * delta.
+ */
+#define LOG_MAPENT_MAX_BYTES    (2 * 5)
+#define ZIGZAG(x)           (((UINT32)(x) << 1) ^ (UINT32)((int)(x) >> 31))
+#define UNZIGZAG(x)         (((UINT32)(x) >> 1) ^ (0U - ((UINT32)(x) & 1)))
+
 void init_log(void);
 void insert_dep_entry(UINT32 const epoch_src, UINT16 const pg_span);
-UINT32 is_depents_full(void);
 void log_insert_mapent(UINT32 const lpn, UINT32 const ppn);
 UINT32 reach_chkpt_threshold(void);
-void record_mapent(void);
+UINT32 log_pg_crc(UINT32 const buf);
 void record_tag(void);
 void record_depent(void);
 UINT32 reach_flush_depent(void);
@@ -7,19 +7,58 @@
 #include "blkmgr.h"
 #include "pgmap.h"
 #include "cache.h"
+#include "log.h"
 #include "board.h"
+#include "crc.h"
+#include "submap.h"
 
-#define PGMAP_COMMIT_PG (ROUND_UP(ROUND_UP(PAGE_MAP_BYTES, BYTES_PER_PAGE) / BYTES_PER_PAGE, NUM_BANKS) / NUM_BANKS)
+/* the erase counts follow the page map in DRAM and are persisted with it */
+#define PGMAP_BYTES (PAGE_MAP_BYTES + ERASE_CNT_BYTES)
+#define NUM_PGMAP_SEGS (ROUND_UP(PGMAP_BYTES, BYTES_PER_PAGE) / BYTES_PER_PAGE)
+#define PGMAP_COMMIT_PG (ROUND_UP(NUM_PGMAP_SEGS, NUM_BANKS) / NUM_BANKS)
+/**
+ * commit page: magic, epoch, number of segments, CRC32C of each segment,
+ * log head of each bank, CRC32C of everything before it
+ */
+#define PGMAP_COMMIT_HDR_BYTES (3 * sizeof(UINT32))
+#define PGMAP_COMMIT_HEADS_OFFSET (PGMAP_COMMIT_HDR_BYTES + NUM_PGMAP_SEGS * sizeof(UINT32))
+#define PGMAP_COMMIT_CRC_OFFSET (PGMAP_COMMIT_HEADS_OFFSET + NUM_BANKS * sizeof(UINT32))
+#define PGMAP_COMMIT_SECTS (ROUND_UP(PGMAP_COMMIT_CRC_OFFSET + sizeof(UINT32), BYTES_PER_SECTOR) / BYTES_PER_SECTOR)
 
-static UINT32 check_pgmap_commit(UINT32 const blk);
+static UINT32 check_pgmap_commit(UINT32 const buf);
 static void record_pgmap_commit(UINT32 const blk);
+static void set_log_heads(UINT32 const *blks);
+static void issue_restore(void);
+static UINT32 verify_restore(void);
+static UINT32 abandon_active_blk(UINT32 const bank, UINT32 const region);
 
 typedef struct {
     UINT32 active_ppns[NUM_REGIONS];
+    /* active blocks given up as bad, and the pages programmed in them */
+    UINT32 blks_bad[NUM_REGIONS][NUM_BAD_ACTIVE_BLKS];
+    UINT32 n_pgs_bad[NUM_REGIONS][NUM_BAD_ACTIVE_BLKS];
+    UINT32 n_bad[NUM_REGIONS];
     UINT32 log_ppn;
+    UINT32 log_scan_ppn;
 } pgmap_t;
 
+/**
+ * State of the page map restore at mount. Segment reads are left in flight
+ * by pgmap_restore_map_table() and checked by pgmap_wait_restore().
+ */
+typedef struct {
+    UINT32 pending;
+    UINT32 n_cand;
+    UINT32 idx_cand[2];
+    UINT32 epoch_cand[2];
+    UINT32 csums[2][NUM_PGMAP_SEGS];
+    UINT32 log_heads[2][NUM_BANKS];
+    /* log heads allocated at format, used when no map has been persisted */
+    UINT32 log_heads_init[NUM_BANKS];
+} restore_t;
+
 static pgmap_t pgmap[NUM_BANKS];
+static restore_t restore;
 extern UINT32 g_epoch;
 
 /* init_pgmap() must be called after init_blkmgr() is called */
@@ -27,10 +66,13 @@ void init_pgmap(void)
 {
     mem_set_dram(PAGE_MAP_ADDR, 0, PAGE_MAP_BYTES);
     mem_set_dram(BLK_TIME_ADDR, 0, BLK_TIME_BYTES);
+    ASSERT(PGMAP_COMMIT_SECTS <= SECTORS_PER_PAGE);
 
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
-        for (UINT32 region = 0; region < NUM_REGIONS; region++)
+        for (UINT32 region = 0; region < NUM_REGIONS; region++) {
             pgmap[bank].active_ppns[region] = get_and_inc_active_blk(bank, region) * PAGES_PER_VBLK;
+            pgmap[bank].n_bad[region] = 0;
+        }
         pgmap[bank].log_ppn = get_log_blk(bank) * PAGES_PER_VBLK;
     }
 
@@ -87,7 +129,9 @@ UINT32 get_and_inc_active_ppn(UINT32 const bank, UINT32 const region)
     ppn = pgmap[bank].active_ppns[region];
     blk = ppn / PAGES_PER_VBLK;
 
-    if (ppn % PAGES_PER_VBLK == PAGES_PER_VBLK - 1) {
+    if (blkmgr_is_bad_blk(bank, blk) && abandon_active_blk(bank, region)) {
+        ppn = pgmap[bank].active_ppns[region];
+    } else if (ppn % PAGES_PER_VBLK == PAGES_PER_VBLK - 1) {
         /* program p2l table into summary page, and clear in-sram p2l table */
         UINT32 blk_clean = get_and_inc_active_blk(bank, region);
         ppn = blk_clean * PAGES_PER_VBLK;
@@ -100,6 +144,8 @@ UINT32 get_and_inc_active_ppn(UINT32 const bank, UINT32 const region)
         /* create link to next open block */
         write_dram_32(FTL_BUF(bank) + pos, blk_clean);
         pos += sizeof(UINT32);
+        write_dram_32(FTL_BUF(bank) + pos, crc32c(FTL_BUF(bank), pos));
+        pos += sizeof(UINT32);
 
         stall_cache(bank);
         wait_bank_free(bank);
@@ -118,10 +164,52 @@ UINT32 get_and_inc_active_ppn(UINT32 const bank, UINT32 const region)
     return ppn;
 }
 
-void pgmap_trim(UINT32 const lpn, UINT32 const n_pages)
+/* give up the active block if it went bad */
+void pgmap_abandon_bad_blk(UINT32 const bank, UINT32 const region)
+{
+    if (blkmgr_is_bad_blk(bank, pgmap[bank].active_ppns[region] / PAGES_PER_VBLK))
+        abandon_active_blk(bank, region);
+}
+
+/**
+ * Returns an abandoned block of the region, or 0 if there is none. Its
+ * summary is copied to lpns, as the slot is reused by the next abandonment.
+ */
+UINT32 pgmap_take_bad_blk(UINT32 const bank, UINT32 const region,
+                          UINT32 *n_pgs, UINT32 const lpns)
+{
+    UINT32 idx;
+
+    if (!pgmap[bank].n_bad[region])
+        return 0;
+    idx = --pgmap[bank].n_bad[region];
+    *n_pgs = pgmap[bank].n_pgs_bad[region][idx];
+    mem_copy(lpns, BAD_LPNS(bank, region, idx), sizeof(UINT32) * PAGES_PER_VBLK);
+    return pgmap[bank].blks_bad[region][idx];
+}
+
+/**
+ * Unmap the pages and return how many of them were mapped. The unmaps are
+ * logged as mapents to ppn 0 and become durable with the next commit tag.
+ * The pages must not be dirty in the cache.
+ */
+UINT32 pgmap_trim(UINT32 const lpn, UINT32 const n_pages)
 {
-    for (UINT32 p = lpn; p < lpn + n_pages; p++)
+    UINT32 n_unmapped = 0;
+
+    for (UINT32 p = lpn; p < lpn + n_pages; p++) {
+        UINT32 bank = p % NUM_BANKS;
+        UINT32 ppn = get_ppn(p);
+        cache_invalidate(bank, p);
+        submap_release(p);
+        if (!ppn)
+            continue;
+        dec_vcount(GPPN_BANK(ppn), GPPN_PPN(ppn) / PAGES_PER_VBLK);
         set_ppn(p, 0);
+        log_insert_mapent(p, 0);
+        n_unmapped++;
+    }
+    return n_unmapped;
 }
 
 UINT32 get_log_ppn(UINT32 const bank)
@@ -131,11 +219,21 @@ UINT32 get_log_ppn(UINT32 const bank)
     ppn = pgmap[bank].log_ppn;
 
     /**
-     * The last page in every log block is not used, as we have to differentiate
-     * whether a log block is full or empty.
+     * The last page in every log block links to the next log block, as log
+     * blocks are not contiguous. A log block gone bad is left without a link,
+     * as the log is about to be reclaimed.
      */
-    if (ppn % PAGES_PER_VBLK == PAGES_PER_VBLK - 1)
+    if (blkmgr_is_bad_blk(bank, ppn / PAGES_PER_VBLK)) {
         ppn = get_log_blk(bank) * PAGES_PER_VBLK;
+    } else if (ppn % PAGES_PER_VBLK == PAGES_PER_VBLK - 1) {
+        UINT32 blk_next = get_log_blk(bank);
+        write_dram_32(HEAD_BUF(bank), 500);
+        write_dram_32(HEAD_BUF(bank) + 4, blk_next);
+        write_dram_32(HEAD_BUF(bank) + 8, crc32c(HEAD_BUF(bank), 2 * sizeof(UINT32)));
+        nand_page_ptprogram(bank, ppn / PAGES_PER_VBLK, PAGES_PER_VBLK - 1,
+                0, 1, HEAD_BUF(bank));
+        ppn = blk_next * PAGES_PER_VBLK;
+    }
     pgmap[bank].log_ppn = ppn + 1;
 
     return ppn;
@@ -143,103 +241,286 @@ UINT32 get_log_ppn(UINT32 const bank)
 
 void revert_log_ppn(UINT32 const bank)
 {
-    revert_log_blk(bank);
-    UINT32 blk_log = get_log_blk(bank);
-    pgmap[bank].log_ppn = blk_log * PAGES_PER_VBLK;
+    pgmap[bank].log_ppn = blkmgr_get_log_head(bank) * PAGES_PER_VBLK;
 }
 
+/**
+ * Read-only counterpart of get_log_ppn() for recovery, which follows the
+ * links written by it. A missing link yields the last page itself, which
+ * then parses as the end of the log.
+ */
+UINT32 scan_log_ppn(UINT32 const bank)
+{
+    UINT32 ppn;
+
+    ppn = pgmap[bank].log_scan_ppn;
+    if (ppn % PAGES_PER_VBLK == PAGES_PER_VBLK - 1) {
+        nand_page_ptread(bank, ppn / PAGES_PER_VBLK, PAGES_PER_VBLK - 1,
+                0, 1, HEAD_BUF(bank), RETURN_WHEN_DONE);
+        if (read_dram_32(HEAD_BUF(bank)) == 500 &&
+                read_dram_32(HEAD_BUF(bank) + 8) == crc32c(HEAD_BUF(bank), 2 * sizeof(UINT32)))
+            ppn = read_dram_32(HEAD_BUF(bank) + 4) * PAGES_PER_VBLK;
+    }
+    pgmap[bank].log_scan_ppn = ppn + 1;
+
+    return ppn;
+}
+
+void rewind_log_scan(UINT32 const bank)
+{
+    pgmap[bank].log_scan_ppn = blkmgr_get_log_head(bank) * PAGES_PER_VBLK;
+}
+
+/**
+ * Read the commit pages of both map copies and issue the segment reads of the
+ * newest one without waiting for them, so that the rest of mount (cache init,
+ * log scan) overlaps with the transfer. pgmap_wait_restore() must be called
+ * before the page map is accessed.
+ */
 void pgmap_restore_map_table(void)
 {
     uart_printf("Start restoring page map.\n");
     UINT32 epochs[2];
-    epochs[0] = check_pgmap_commit(blkmgr_get_map_blk(0));
-    blkmgr_toggle_map_blk_idx();
-    epochs[1] = check_pgmap_commit(blkmgr_get_map_blk(0));
+
+    restore.pending = 0;
+    restore.n_cand = 0;
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        restore.log_heads_init[bank] = blkmgr_get_log_head(bank);
+    /**
+     * Both commit pages live in bank 0, so issue both before waiting.
+     * map_blk_idx is toggled twice and ends up where it started.
+     */
+    for (UINT32 i = 0; i < 2; i++) {
+        nand_page_ptread(0, blkmgr_get_map_blk(0), PGMAP_COMMIT_PG, 0,
+                PGMAP_COMMIT_SECTS, FTL_BUF(i), RETURN_ON_ISSUE);
+        blkmgr_toggle_map_blk_idx();
+    }
+    flash_finish();
+    for (UINT32 i = 0; i < 2; i++) {
+        epochs[i] = check_pgmap_commit(FTL_BUF(i));
+        if (epochs[i]) {
+            mem_copy(restore.csums[i], FTL_BUF(i) + PGMAP_COMMIT_HDR_BYTES,
+                    NUM_PGMAP_SEGS * sizeof(UINT32));
+            mem_copy(restore.log_heads[i], FTL_BUF(i) + PGMAP_COMMIT_HEADS_OFFSET,
+                    NUM_BANKS * sizeof(UINT32));
+        }
+    }
     uart_printf("Epoch of pgmap 1 = %llu, pgmap 2 = %llu\n", epochs[0], epochs[1]);
     if (!epochs[0] && !epochs[1]) {
         uart_printf("No page map found.\n");
         return;
     }
-    if (epochs[0] > epochs[1]) {
+
+    /* candidates in the order they are tried, newest first */
+    UINT32 newer = epochs[0] > epochs[1] ? 0 : 1;
+    restore.idx_cand[restore.n_cand] = newer;
+    restore.epoch_cand[restore.n_cand++] = epochs[newer];
+    if (epochs[1 - newer]) {
+        restore.idx_cand[restore.n_cand] = 1 - newer;
+        restore.epoch_cand[restore.n_cand++] = epochs[1 - newer];
+    }
+    if (newer)
+        blkmgr_toggle_map_blk_idx();
+    issue_restore();
+}
+
+/**
+ * Wait for the segment reads issued by pgmap_restore_map_table() and verify
+ * them against the checksums in the commit page. If a segment does not match,
+ * the map was torn while being persisted, in which case the older copy is
+ * still intact and is restored instead, along with its epoch and log heads.
+ * Returns 1 in that case, as anything derived from them has to be redone.
+ * Calling it again is a no-op.
+ */
+UINT32 pgmap_wait_restore(void)
+{
+    UINT32 fallback = 0;
+
+    if (!restore.pending)
+        return 0;
+    flash_finish();
+    restore.pending = 0;
+    while (!verify_restore()) {
+        uart_printf("Page map with epoch %u is torn.\n", restore.epoch_cand[0]);
+        restore.n_cand--;
+        restore.idx_cand[0] = restore.idx_cand[1];
+        restore.epoch_cand[0] = restore.epoch_cand[1];
+        fallback = 1;
+        if (!restore.n_cand) {
+            uart_printf("No valid page map found.\n");
+            mem_set_dram(PAGE_MAP_ADDR, 0, PGMAP_BYTES);
+            g_epoch = 0;
+            set_log_heads(restore.log_heads_init);
+            return fallback;
+        }
         blkmgr_toggle_map_blk_idx();
-        g_epoch = epochs[0];
-    } else {
-        g_epoch = epochs[1];
+        issue_restore();
+        flash_finish();
+        restore.pending = 0;
     }
-    uart_printf("g_epoch set to %u.\n", g_epoch);
+    uart_printf("Restoring page map done.\n");
+    return fallback;
+}
 
+void pgmap_persist_map_table(void)
+{
+    uart_printf("Start persisting page map.\n");
     UINT32 bank;
     UINT32 blks[NUM_BANKS];
     UINT32 pg = 0;
     for (bank = 0; bank < NUM_BANKS; bank++)
         blks[bank] = blkmgr_get_map_blk(bank);
-    bank = 0;
+
+    while (1) {
+        bank = 0;
+        pg = 0;
+        UINT32 addr = PAGE_MAP_ADDR;
+        UINT32 addr_end = PAGE_MAP_ADDR + PGMAP_BYTES;
+        UINT32 size = BYTES_PER_PAGE;
+        while (addr != addr_end) {
+            if (addr + BYTES_PER_PAGE > addr_end)
+                size = addr_end - addr;
+            nand_page_ptprogram(bank, blks[bank], pg,
+                    0, size / BYTES_PER_SECTOR, addr);
+            addr += size;
+            bank = (bank + 1) % NUM_BANKS;
+            if (bank == 0)
+                pg++;
+        }
+        /**
+         * The commit page may complete before the segments in the other banks,
+         * which is why every segment is covered by a checksum.
+         */
+        record_pgmap_commit(blks[0]);
+        flash_finish();
+        /**
+         * Map blocks are never retired. A failed copy is written again, while
+         * the older copy stays intact.
+         */
+        if (!blkmgr_take_map_blk_fail())
+            break;
+        uart_printf("Retry persisting page map.\n");
+        blkmgr_erase_cur_map_blk();
+    }
+    blkmgr_toggle_map_blk_idx();
+    blkmgr_erase_cur_map_blk();
+    uart_printf("Persisting page map done.\n");
+}
+
+static UINT32 check_pgmap_commit(UINT32 const buf)
+{
+    UINT32 magic, n_segs;
+    magic = read_dram_32(buf);
+    n_segs = read_dram_32(buf + 8);
+    if (magic == 815 && n_segs == NUM_PGMAP_SEGS &&
+            read_dram_32(buf + PGMAP_COMMIT_CRC_OFFSET) == crc32c(buf, PGMAP_COMMIT_CRC_OFFSET)) {
+        UINT32 epoch;
+        mem_copy(&epoch, buf + 4, sizeof(UINT32));
+        return epoch;
+    }
+    return 0;
+}
+
+static void record_pgmap_commit(UINT32 const blk)
+{
+    UINT32 magic = 815;
+    UINT32 epoch_commit = g_epoch - 1;
+    UINT32 n_segs = NUM_PGMAP_SEGS;
     UINT32 addr = PAGE_MAP_ADDR;
-    UINT32 addr_end = PAGE_MAP_ADDR + PAGE_MAP_BYTES;
-    UINT32 size = BYTES_PER_PAGE;
-    while (addr != addr_end) {
+    UINT32 addr_end = PAGE_MAP_ADDR + PGMAP_BYTES;
+    mem_copy(FTL_BUF(0), &magic, sizeof(UINT32));
+    mem_copy(FTL_BUF(0) + 4, &epoch_commit, sizeof(UINT32));
+    mem_copy(FTL_BUF(0) + 8, &n_segs, sizeof(UINT32));
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        write_dram_32(FTL_BUF(0) + PGMAP_COMMIT_HEADS_OFFSET + bank * sizeof(UINT32),
+                blkmgr_get_log_head(bank));
+    for (UINT32 seg = 0; seg < NUM_PGMAP_SEGS; seg++) {
+        UINT32 size = BYTES_PER_PAGE;
         if (addr + BYTES_PER_PAGE > addr_end)
             size = addr_end - addr;
-        nand_page_ptread(bank, blks[bank], pg,
-                0, size / BYTES_PER_SECTOR, addr, RETURN_ON_ISSUE);
+        write_dram_32(FTL_BUF(0) + PGMAP_COMMIT_HDR_BYTES + seg * sizeof(UINT32),
+                crc32c(addr, size));
         addr += size;
-        bank = (bank + 1) % NUM_BANKS;
-        if (bank == 0)
-            pg++;
     }
-    flash_finish();
-    uart_printf("Restoring page map done.\n");
+    write_dram_32(FTL_BUF(0) + PGMAP_COMMIT_CRC_OFFSET,
+            crc32c(FTL_BUF(0), PGMAP_COMMIT_CRC_OFFSET));
+    nand_page_ptprogram(0, blk, PGMAP_COMMIT_PG, 0, PGMAP_COMMIT_SECTS, FTL_BUF(0));
 }
 
-void pgmap_persist_map_table(void)
+static void set_log_heads(UINT32 const *blks)
 {
-    uart_printf("Start persisting page map.\n");
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        blkmgr_set_log_head(bank, blks[bank]);
+}
+
+/* issue the segment reads of the first candidate; map_blk_idx must point to it */
+static void issue_restore(void)
+{
+    g_epoch = restore.epoch_cand[0];
+    uart_printf("g_epoch set to %u.\n", g_epoch);
+    set_log_heads(restore.log_heads[restore.idx_cand[0]]);
+
     UINT32 bank;
     UINT32 blks[NUM_BANKS];
     UINT32 pg = 0;
     for (bank = 0; bank < NUM_BANKS; bank++)
         blks[bank] = blkmgr_get_map_blk(bank);
-
     bank = 0;
     UINT32 addr = PAGE_MAP_ADDR;
-    UINT32 addr_end = PAGE_MAP_ADDR + PAGE_MAP_BYTES;
+    UINT32 addr_end = PAGE_MAP_ADDR + PGMAP_BYTES;
     UINT32 size = BYTES_PER_PAGE;
     while (addr != addr_end) {
         if (addr + BYTES_PER_PAGE > addr_end)
             size = addr_end - addr;
-        nand_page_ptprogram(bank, blks[bank], pg,
-                0, size / BYTES_PER_SECTOR, addr);
+        nand_page_ptread(bank, blks[bank], pg,
+                0, size / BYTES_PER_SECTOR, addr, RETURN_ON_ISSUE);
         addr += size;
         bank = (bank + 1) % NUM_BANKS;
         if (bank == 0)
             pg++;
     }
-    record_pgmap_commit(blks[0]);
-    flash_finish();
-    blkmgr_toggle_map_blk_idx();
-    blkmgr_erase_cur_map_blk();
-    uart_printf("Persisting page map done.\n");
+    restore.pending = 1;
 }
 
-static UINT32 check_pgmap_commit(UINT32 const blk)
+static UINT32 verify_restore(void)
 {
-    UINT32 magic;
-    nand_page_ptread(0, blk, PGMAP_COMMIT_PG, 0, 1,
-            FTL_BUF(0), RETURN_WHEN_DONE);
-    magic = read_dram_32(FTL_BUF(0));
-    if (magic == 815) {
-        UINT32 epoch;
-        mem_copy(&epoch, FTL_BUF(0) + 4, sizeof(UINT32));
-        return epoch;
+    UINT32 *csums = restore.csums[restore.idx_cand[0]];
+    UINT32 addr = PAGE_MAP_ADDR;
+    UINT32 addr_end = PAGE_MAP_ADDR + PGMAP_BYTES;
+    for (UINT32 seg = 0; seg < NUM_PGMAP_SEGS; seg++) {
+        UINT32 size = BYTES_PER_PAGE;
+        if (addr + BYTES_PER_PAGE > addr_end)
+            size = addr_end - addr;
+        if (crc32c(addr, size) != csums[seg]) {
+            uart_printf("Checksum mismatch in page map segment %u.\n", seg);
+            return 0;
+        }
+        addr += size;
     }
-    return 0;
+    return 1;
 }
 
-static void record_pgmap_commit(UINT32 const blk)
+/**
+ * Returns 0 if every slot is taken. The bad block then stays active and is
+ * closed like any full block, which blkmgr_handle_bad_blks() retires too.
+ */
+static UINT32 abandon_active_blk(UINT32 const bank, UINT32 const region)
 {
-    UINT32 magic = 815;
-    UINT32 epoch_commit = g_epoch - 1;
-    mem_copy(FTL_BUF(0), &magic, sizeof(UINT32));
-    mem_copy(FTL_BUF(0) + 4, &epoch_commit, sizeof(UINT32));
-    nand_page_ptprogram(0, blk, PGMAP_COMMIT_PG, 0, 1, FTL_BUF(0));
+    UINT32 ppn = pgmap[bank].active_ppns[region];
+    UINT32 idx = pgmap[bank].n_bad[region];
+    UINT32 blk_clean;
+
+    if (idx == NUM_BAD_ACTIVE_BLKS)
+        return 0;
+    pgmap[bank].blks_bad[region][idx] = ppn / PAGES_PER_VBLK;
+    pgmap[bank].n_pgs_bad[region][idx] = ppn % PAGES_PER_VBLK;
+    pgmap[bank].n_bad[region]++;
+    mem_copy(BAD_LPNS(bank, region, idx), LPNS(bank, region, 0),
+            sizeof(UINT32) * PAGES_PER_VBLK);
+    mem_set_dram(LPNS(bank, region, 0), 0, sizeof(UINT32) * PAGES_PER_VBLK);
+
+    blk_clean = get_and_inc_active_blk(bank, region);
+    pgmap[bank].active_ppns[region] = blk_clean * PAGES_PER_VBLK;
+    mem_copy(BLK_TIME(bank, blk_clean), &g_epoch, sizeof(UINT32));
+    return 1;
 }
@@ -15,10 +15,16 @@ void set_lpn(UINT32 const bank, UINT32 const region, UINT32 const page, UINT32 c
 UINT32 get_lpn(UINT32 const bank, UINT32 const region, UINT32 const page);
 UINT32 get_active_ppn(UINT32 const bank, UINT32 const region);
 UINT32 get_and_inc_active_ppn(UINT32 const bank, UINT32 const region);
-void pgmap_trim(UINT32 const lpn, UINT32 const n_pages);
+void pgmap_abandon_bad_blk(UINT32 const bank, UINT32 const region);
+UINT32 pgmap_take_bad_blk(UINT32 const bank, UINT32 const region,
+                          UINT32 *n_pgs, UINT32 const lpns);
+UINT32 pgmap_trim(UINT32 const lpn, UINT32 const n_pages);
 UINT32 get_log_ppn(UINT32 const bank);
 void revert_log_ppn(UINT32 const bank);
+UINT32 scan_log_ppn(UINT32 const bank);
+void rewind_log_scan(UINT32 const bank);
 void pgmap_restore_map_table(void);
+UINT32 pgmap_wait_restore(void);
 void pgmap_persist_map_table(void);
 
 #endif // PGMAP_H
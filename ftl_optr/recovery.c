@@ -6,6 +6,9 @@
 #include "ftl.h"
 #include "blkmgr.h"
 #include "pgmap.h"
+#include "log.h"
+#include "crc.h"
+#include "submap.h"
 
 static int find_last_commit(void);
 static void collect_recovery_entries(void);
@@ -20,6 +23,7 @@ static UINT32 reach_last_commit(UINT32 const bank, UINT32 const blk,
                                 UINT32 const page);
 static void process_mapent(UINT32 const bank, UINT32 const blk,
                            UINT32 const page);
+static UINT64 get_varint(UINT32 *pos);
 static void retrieve_page_entries(UINT32 const bank, UINT32 const ppn,
                                   UINT32 const mode);
 static void process_depent(UINT32 const bank, UINT32 const blk,
@@ -27,16 +31,22 @@ static void process_depent(UINT32 const bank, UINT32 const blk,
 static void build_depent_list(UINT32 const bank, UINT32 const blk,
                               UINT32 const page);
 static void add_recovery_ent(UINT32 const epoch, UINT16 const pg_span);
+static UINT32 after_commit(UINT32 const epoch);
+static void retrieve_pack_entries(UINT8 const *spare, UINT32 const ppn,
+                                  UINT32 const mode);
 static void add_depent(UINT32 const epoch_src, UINT32 const epoch_dst,
                        UINT32 const idx);
 
+/* a log page with a commit tag is typed as a commit; the tag is its last record */
 #define RECOVERY_COMMIT 1
-#define RECOVERY_MAPENT 2
-#define RECOVERY_DEPENT 3
+#define RECOVERY_LOG 2
 typedef struct {
     UINT32 epoch_commit;
     UINT32 epoch_max;
     UINT32 epoch_incomplete;
+    /* the last commit is located by position, as tags may repeat an epoch */
+    UINT32 bank_commit;
+    UINT32 ppn_commit;
     UINT32 n_depent;
     UINT32 active_ppns[NUM_BANKS][NUM_REGIONS];
 } recovery_t;
@@ -53,6 +63,13 @@ int analyze(void)
     uart_printf("Start analyze phase.\n");
     int done;
     done = find_last_commit();
+    /**
+     * The log scan above runs while the page map is still being read; the
+     * entries collected below are applied on top of it. If the map turns out
+     * to be torn, the older copy starts from another epoch and log head.
+     */
+    if (pgmap_wait_restore())
+        done = find_last_commit();
     if (done) {
         uart_printf("Only the full checkpoint presents; so the recovery ends here.\n");
         return 1;
@@ -86,13 +103,16 @@ static int find_last_commit(void)
     UINT32 bank = 0;
 
     uart_printf("g_epoch = %u.\n", g_epoch);
+    for (bank = 0; bank < NUM_BANKS; bank++)
+        rewind_log_scan(bank);
+    bank = 0;
     recovery.epoch_commit = g_epoch;
     recovery.epoch_max = recovery.epoch_commit;
     recovery.epoch_incomplete = recovery.epoch_commit + 1;
     UINT32 type;
     UINT32 found_at_least_one_commit = 0;
     do {
-        UINT32 ppn = get_log_ppn(bank);
+        UINT32 ppn = scan_log_ppn(bank);
         UINT32 blk = ppn / PAGES_PER_VBLK;
         UINT32 pg = ppn % PAGES_PER_VBLK;
         type = parse_log_pg_type(bank, blk, pg);
@@ -101,9 +121,7 @@ static int find_last_commit(void)
             found_at_least_one_commit = 1;
             process_commit(bank, blk, pg);
             break;
-        case RECOVERY_MAPENT:
-            break;
-        case RECOVERY_DEPENT:
+        case RECOVERY_LOG:
             break;
         }
         bank = (bank + 1) % NUM_BANKS;
@@ -126,26 +144,25 @@ static void collect_recovery_entries(void)
     UINT32 bank_log;
 
     for (bank_log = 0; bank_log < NUM_BANKS; bank_log++)
-        revert_log_ppn(bank_log);
+        rewind_log_scan(bank_log);
 
     /* retrieve page entries */
     bank_log = 0;
     UINT32 done = 0;
     UINT32 type;
     do {
-        UINT32 ppn = get_log_ppn(bank_log);
+        UINT32 ppn = scan_log_ppn(bank_log);
         UINT32 blk = ppn / PAGES_PER_VBLK;
         UINT32 pg = ppn % PAGES_PER_VBLK;
         type = parse_log_pg_type(bank_log, blk, pg);
         switch (type) {
         case RECOVERY_COMMIT:
+            process_mapent(bank_log, blk, pg);
             done = reach_last_commit(bank_log, blk, pg);
             break;
-        case RECOVERY_MAPENT:
+        case RECOVERY_LOG:
             process_mapent(bank_log, blk, pg);
             break;
-        case RECOVERY_DEPENT:
-            break;
         default:
             done = 1;
         }
@@ -160,23 +177,24 @@ static void collect_recovery_entries(void)
         #endif
     }
 
-    /* retrieve dependency entries */
+    /**
+     * retrieve dependency entries; mapents after the last commit are covered
+     * by the page entries retrieved above
+     */
     do {
-        UINT32 ppn = get_log_ppn(bank_log);
+        UINT32 ppn = scan_log_ppn(bank_log);
         UINT32 blk = ppn / PAGES_PER_VBLK;
         UINT32 pg = ppn % PAGES_PER_VBLK;
         type = parse_log_pg_type(bank_log, blk, pg);
         switch (type) {
         case RECOVERY_COMMIT:
             break;
-        case RECOVERY_MAPENT:
-            break;
-        case RECOVERY_DEPENT:
+        case RECOVERY_LOG:
             process_depent(bank_log, blk, pg);
             break;
         }
         bank_log = (bank_log + 1) % NUM_BANKS;
-    } while (type == RECOVERY_DEPENT);
+    } while (type);
 }
 
 static void find_first_incomplete_write(void)
@@ -201,13 +219,13 @@ static void pull_epoch_incomplete(void)
     UINT32 bank_log;
 
     for (bank_log = 0; bank_log < NUM_BANKS; bank_log++)
-        revert_log_ppn(bank_log);
+        rewind_log_scan(bank_log);
 
     bank_log = 0;
     UINT32 done = 0;
     UINT32 type;
     do {
-        UINT32 ppn = get_log_ppn(bank_log);
+        UINT32 ppn = scan_log_ppn(bank_log);
         UINT32 blk = ppn / PAGES_PER_VBLK;
         UINT32 pg = ppn % PAGES_PER_VBLK;
         type = parse_log_pg_type(bank_log, blk, pg);
@@ -215,9 +233,7 @@ static void pull_epoch_incomplete(void)
         case RECOVERY_COMMIT:
             done = reach_last_commit(bank_log, blk, pg);
             break;
-        case RECOVERY_MAPENT:
-            break;
-        case RECOVERY_DEPENT:
+        case RECOVERY_LOG:
             break;
         default:
             done = 1;
@@ -227,23 +243,21 @@ static void pull_epoch_incomplete(void)
 
     /* log page after last commit page */
     do {
-        UINT32 ppn = get_log_ppn(bank_log);
+        UINT32 ppn = scan_log_ppn(bank_log);
         UINT32 blk = ppn / PAGES_PER_VBLK;
         UINT32 pg = ppn % PAGES_PER_VBLK;
         type = parse_log_pg_type(bank_log, blk, pg);
         switch (type) {
         case RECOVERY_COMMIT:
             break;
-        case RECOVERY_MAPENT:
-            break;
-        case RECOVERY_DEPENT:
+        case RECOVERY_LOG:
             build_depent_list(bank_log, blk, pg);
             break;
         default:
             done = 1;
         }
         bank_log = (bank_log + 1) % NUM_BANKS;
-    } while (type == RECOVERY_DEPENT);
+    } while (type);
 
     /* insertion sort */
     for (UINT32 i = 1; i < recovery.n_depent; i++) {
@@ -304,14 +318,14 @@ static void remap_page_entries(void)
     UINT32 bank_log;
 
     for (bank_log = 0; bank_log < NUM_BANKS; bank_log++)
-        revert_log_ppn(bank_log);
+        rewind_log_scan(bank_log);
 
     /* retrieve page entries */
     bank_log = 0;
     UINT32 done = 0;
     UINT32 type;
     do {
-        UINT32 ppn = get_log_ppn(bank_log);
+        UINT32 ppn = scan_log_ppn(bank_log);
         UINT32 blk = ppn / PAGES_PER_VBLK;
         UINT32 pg = ppn % PAGES_PER_VBLK;
         type = parse_log_pg_type(bank_log, blk, pg);
@@ -319,9 +333,7 @@ static void remap_page_entries(void)
         case RECOVERY_COMMIT:
             done = reach_last_commit(bank_log, blk, pg);
             break;
-        case RECOVERY_MAPENT:
-            break;
-        case RECOVERY_DEPENT:
+        case RECOVERY_LOG:
             break;
         default:
             done = 1;
@@ -345,6 +357,7 @@ static UINT32 parse_log_pg_type(UINT32 const bank, UINT32 const blk,
     uart_printf("Parse log pg (%u, %u, %u)\n", bank, blk, page);
     #endif
     UINT32 magic;
+    UINT32 has_tag;
 
     nand_page_ptread(bank, blk, page, 0, SECTORS_PER_PAGE, FTL_BUF(bank), RETURN_WHEN_DONE);
     mem_copy(&magic, FTL_BUF(bank), sizeof(UINT32));
@@ -352,21 +365,23 @@ static UINT32 parse_log_pg_type(UINT32 const bank, UINT32 const blk,
     uart_printf("Magic: %u\n", magic);
     #endif
     switch (magic) {
-    case 100:
-        #if 0
-        uart_printf("Find commit tag page.\n");
-        #endif
-        return RECOVERY_COMMIT;
-    case 200:
-        #if 0
-        uart_printf("Find mapping entry page.\n");
-        #endif
-        return RECOVERY_MAPENT;
-    case 300:
+    case 400:
+        /* a torn page ends the log; nothing after it can be trusted */
+        if (read_dram_32(FTL_BUF(bank) + LOG_PG_CRC_OFFSET) != log_pg_crc(FTL_BUF(bank))) {
+            uart_printf("Torn log page at (%u, %u, %u).\n", bank, blk, page);
+            break;
+        }
+        mem_copy(&has_tag, FTL_BUF(bank) + 12, sizeof(UINT32));
+        if (has_tag) {
+            #if 0
+            uart_printf("Find commit tag page.\n");
+            #endif
+            return RECOVERY_COMMIT;
+        }
         #if 0
-        uart_printf("Find dependent entry page.\n");
+        uart_printf("Find log page.\n");
         #endif
-        return RECOVERY_DEPENT;
+        return RECOVERY_LOG;
     default:
         #if 0
         uart_printf("Unrecognized magic number.\n");
@@ -379,19 +394,21 @@ static UINT32 parse_log_pg_type(UINT32 const bank, UINT32 const blk,
 static void process_commit(UINT32 const bank, UINT32 const blk,
                            UINT32 const page)
 {
-    mem_copy(&recovery.epoch_commit, FTL_BUF(bank) + 4, sizeof(UINT32));
-    mem_copy(&recovery.active_ppns, FTL_BUF(bank) + 8, sizeof(recovery.active_ppns));
+    mem_copy(&recovery.epoch_commit, FTL_BUF(bank) + LOG_PG_TAG_OFFSET, sizeof(UINT32));
+    mem_copy(&recovery.active_ppns, FTL_BUF(bank) + LOG_PG_TAG_OFFSET + 4,
+            sizeof(recovery.active_ppns));
     recovery.epoch_max = recovery.epoch_commit;
     recovery.epoch_incomplete = recovery.epoch_commit + 1;
+    recovery.bank_commit = bank;
+    recovery.ppn_commit = blk * PAGES_PER_VBLK + page;
     //uart_printf("Commit @ %u\n", recovery.epoch_commit);
 }
 
 static UINT32 reach_last_commit(UINT32 const bank, UINT32 const blk,
                                 UINT32 const page)
 {
-    UINT32 epoch;
-    mem_copy(&epoch, FTL_BUF(bank) + 4, sizeof(UINT32));
-    if (epoch == recovery.epoch_commit) {
+    if (bank == recovery.bank_commit &&
+            blk * PAGES_PER_VBLK + page == recovery.ppn_commit) {
         #if 1
         uart_printf("Reach last commit.\n");
         #endif
@@ -407,22 +424,55 @@ static void process_mapent(UINT32 const bank, UINT32 const blk,
     mem_copy(&cnt, FTL_BUF(bank) + sizeof(UINT32), sizeof(UINT32));
     //uart_printf("# of mapents: %u\n", cnt);
 
-    UINT32 pos = FTL_BUF(bank) + sizeof(UINT32) + sizeof(UINT32);
-    UINT32 lpn, ppn;
-    for (UINT32 i = 0; i < cnt; i++) {
-        mem_copy(&lpn, pos, sizeof(UINT32));
-        mem_copy(&ppn, pos + 4, sizeof(UINT32));
-        //uart_printf("Map (%u, %u)\n", lpn, ppn);
-        set_ppn(lpn, ppn);
-        pos += 8;
+    /* decode the mapent stream, see log.h */
+    UINT32 pos = FTL_BUF(bank) + LOG_PG_BODY_OFFSET;
+    UINT32 pred_ppns[NUM_BANKS];
+    UINT32 lpn = 0, ppn;
+    UINT64 tok;
+    UINT32 n_run;
+    for (UINT32 b = 0; b < NUM_BANKS; b++)
+        pred_ppns[b] = GPPN(b, 0);
+    for (UINT32 i = 0; i < cnt; i += n_run) {
+        tok = get_varint(&pos);
+        if (tok & 1) {
+            n_run = (UINT32)(tok >> 1);
+            for (UINT32 j = 0; j < n_run; j++) {
+                lpn++;
+                ppn = pred_ppns[lpn % NUM_BANKS];
+                set_ppn(lpn, ppn);
+                pred_ppns[lpn % NUM_BANKS] = ppn + 1;
+            }
+        } else {
+            n_run = 1;
+            lpn += 1 + UNZIGZAG((UINT32)(tok >> 1));
+            tok = get_varint(&pos);
+            ppn = pred_ppns[lpn % NUM_BANKS] + UNZIGZAG(tok);
+            //uart_printf("Map (%u, %u)\n", lpn, ppn);
+            set_ppn(lpn, ppn);
+            pred_ppns[lpn % NUM_BANKS] = ppn + 1;
+        }
     }
 }
 
+static UINT64 get_varint(UINT32 *pos)
+{
+    UINT64 val = 0;
+    UINT32 shift = 0;
+    UINT8 byte;
+    do {
+        byte = read_dram_8(*pos);
+        (*pos)++;
+        val |= (UINT64)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return val;
+}
+
 static void retrieve_page_entries(UINT32 const bank, UINT32 const ppn,
                                   UINT32 const mode)
 {
     UINT32 done = 0;
-    UINT8 spare[64];
+    UINT8 spare[SUBMAP_SPARE_BYTES];
     UINT32 blk_cur = ppn / PAGES_PER_VBLK;
     UINT32 pg_cur = ppn % PAGES_PER_VBLK;
     UINT32 lpn;
@@ -434,43 +484,60 @@ static void retrieve_page_entries(UINT32 const bank, UINT32 const ppn,
             nand_page_ptread(bank, blk_cur, pg, 0, 1,
                     FTL_BUF(bank), RETURN_WHEN_DONE);
             #ifdef VST
-            get_spare(spare, 12);
+            get_spare(spare, SUBMAP_SPARE_BYTES);
             mem_copy(&lpn, spare, sizeof(UINT32));
             mem_copy(&pg_span, spare + 4, sizeof(UINT16));
             mem_copy(&epoch, spare + 8, sizeof(UINT32));
             #endif
             if (epoch == (UINT32)(-1))
                 break;
+            UINT32 gppn = GPPN(bank, blk_cur * PAGES_PER_VBLK + pg);
+            if (epoch == SUBMAP_PACK_TAG) {
+                retrieve_pack_entries(spare, gppn, mode);
+                continue;
+            }
             switch (mode) {
             case 0:
                 if (epoch == (UINT32)-2) {
-                    set_ppn(lpn, blk_cur * PAGES_PER_VBLK + pg);
+                    set_ppn(lpn, gppn);
+                }
+                else if (epoch == SUBMAP_MERGE_TAG) {
+                    set_ppn(lpn, gppn);
+                    submap_recover_merge(lpn);
                 }
-                else if (epoch > recovery.epoch_commit) {
+                else if (after_commit(epoch)) {
                     add_recovery_ent(epoch, pg_span);
                 }
                 break;
             case 1:
+                if (epoch == SUBMAP_MERGE_TAG)
+                    mem_copy(&epoch, spare + 12, sizeof(UINT32));
                 mem_copy(&epoch_prev, RECOVERY_PAGE_EPOCH(lpn), sizeof(UINT32));
-                if (epoch < recovery.epoch_incomplete && epoch > epoch_prev) {
-                    set_ppn(lpn, blk_cur * PAGES_PER_VBLK + pg);
+                if (epoch < recovery.epoch_incomplete &&
+                        (epoch > epoch_prev || !epoch_prev)) {
+                    set_ppn(lpn, gppn);
                     mem_copy(RECOVERY_PAGE_EPOCH(lpn), &epoch, sizeof(UINT32));
+                    submap_recover_page(lpn, epoch);
                 }
                 break;
             }
         }
 
-        UINT32 next_blk;
+        UINT32 next_blk, crc;
         nand_page_ptread(bank, blk_cur, PAGES_PER_VBLK - 1, 0,
-                ROUND_UP(sizeof(UINT32) * PAGES_PER_VBLK + sizeof(UINT32), BYTES_PER_SECTOR) /
+                ROUND_UP(sizeof(UINT32) * PAGES_PER_VBLK + 2 * sizeof(UINT32), BYTES_PER_SECTOR) /
                 BYTES_PER_SECTOR, FTL_BUF(bank), RETURN_WHEN_DONE);
         mem_copy(&next_blk, FTL_BUF(bank) + PAGES_PER_VBLK * sizeof(UINT32),
                 sizeof(UINT32));
+        mem_copy(&crc, FTL_BUF(bank) + (PAGES_PER_VBLK + 1) * sizeof(UINT32),
+                sizeof(UINT32));
         #if 0
         uart_printf("Bank %u next blk is: %u.\n", bank, next_blk);
         #endif
 
-        if (next_blk == (UINT32)(-1)) {
+        /* an erased or torn summary page ends the chain */
+        if (next_blk == (UINT32)(-1) ||
+                crc != crc32c(FTL_BUF(bank), (PAGES_PER_VBLK + 1) * sizeof(UINT32))) {
             done = 1;
         } else {
             blk_cur = next_blk;
@@ -479,14 +546,60 @@ static void retrieve_page_entries(UINT32 const bank, UINT32 const ppn,
     }
 }
 
+/**
+ * A pack page carries the updates packed into it (see submap.h). Each update
+ * counts as a page of its write, and its chunks are mapped like pages, unless
+ * the page has been written as a whole since.
+ */
+static void retrieve_pack_entries(UINT8 const *spare, UINT32 const ppn,
+                                  UINT32 const mode)
+{
+    UINT32 pack, lpn, epoch, epoch_prev;
+    UINT16 pg_span, idx;
+    UINT8 mask;
+    UINT32 slot = 0, mapped = 0;
+
+    mem_copy(&pack, spare, sizeof(UINT32));
+    for (UINT32 i = 0; i < PACK_MAX_ENTS; i++) {
+        UINT8 const *ent = spare + SUBMAP_SPARE_ENT(i);
+        mem_copy(&lpn, ent, sizeof(UINT32));
+        mem_copy(&epoch, ent + 4, sizeof(UINT32));
+        mem_copy(&pg_span, ent + 8, sizeof(UINT16));
+        mem_copy(&idx, ent + 10, sizeof(UINT16));
+        mem_copy(&mask, ent + 12, sizeof(UINT8));
+        if (!mask)
+            break;
+        if (mode == 0) {
+            if (after_commit(epoch))
+                add_recovery_ent(epoch, pg_span);
+            continue;
+        }
+        mem_copy(&epoch_prev, RECOVERY_PAGE_EPOCH(lpn), sizeof(UINT32));
+        for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++) {
+            if (!((mask >> c) & 1))
+                continue;
+            if (epoch < recovery.epoch_incomplete &&
+                    (epoch > epoch_prev || !epoch_prev))
+                mapped |= submap_recover_chunk(lpn, idx, c,
+                        (pack - PACK_LPN_BASE) * CHUNKS_PER_PAGE + slot + 1,
+                        epoch);
+            slot++;
+        }
+    }
+    /* a pack programmed after its chunks were overwritten is not mapped */
+    if (mapped)
+        set_ppn(pack, ppn);
+}
+
 static void process_depent(UINT32 const bank, UINT32 const blk,
                            UINT32 const page)
 {
     UINT32 cnt;
-    mem_copy(&cnt, FTL_BUF(bank) + sizeof(UINT32), sizeof(UINT32));
+    mem_copy(&cnt, FTL_BUF(bank) + 2 * sizeof(UINT32), sizeof(UINT32));
     //uart_printf("# of depents: %u\n", cnt);
 
-    UINT32 pos = FTL_BUF(bank) + sizeof(UINT32) + sizeof(UINT32);
+    /* depents are stored backward from the end of the page */
+    UINT32 pos = FTL_BUF(bank) + BYTES_PER_PAGE - LOG_DEPENT_BYTES;
     UINT32 src, dst;
     UINT16 pg_span;
     for (UINT32 i = 0; i < cnt; i++) {
@@ -496,14 +609,14 @@ static void process_depent(UINT32 const bank, UINT32 const blk,
         #if 0
         uart_printf("Dep (%llu, %llu, %u)\n", src, dst, pg_span);
         #endif
-        if (src > recovery.epoch_commit) {
+        if (after_commit(src)) {
             add_recovery_ent(src, pg_span);
         }
         else
             /* this should not happen */
             uart_printf("Find dependency entries less than committed epoch.\n");
 
-        pos += 12;
+        pos -= LOG_DEPENT_BYTES;
     }
 }
 
@@ -511,23 +624,33 @@ static void build_depent_list(UINT32 const bank, UINT32 const blk,
                               UINT32 const page)
 {
     UINT32 cnt;
-    mem_copy(&cnt, FTL_BUF(bank) + sizeof(UINT32), sizeof(UINT32));
+    mem_copy(&cnt, FTL_BUF(bank) + 2 * sizeof(UINT32), sizeof(UINT32));
     //uart_printf("# of depents: %u\n", cnt);
 
-    UINT32 pos = FTL_BUF(bank) + sizeof(UINT32) + sizeof(UINT32);
+    /* depents are stored backward from the end of the page */
+    UINT32 pos = FTL_BUF(bank) + BYTES_PER_PAGE - LOG_DEPENT_BYTES;
     UINT32 src, dst;
     for (UINT32 i = 0; i < cnt; i++) {
         mem_copy(&src, pos, sizeof(UINT32));
         mem_copy(&dst, pos + 4, sizeof(UINT32));
         add_depent(src, dst, recovery.n_depent);
-        pos += 12;
+        pos -= LOG_DEPENT_BYTES;
         recovery.n_depent++;
     }
 }
 
+/**
+ * The tag recorded at format commits epoch (UINT32)-1, before the first write,
+ * so epochs are ordered by their distance from the commit instead.
+ */
+static UINT32 after_commit(UINT32 const epoch)
+{
+    return epoch - recovery.epoch_commit - 1 < (UINT32)-1 / 2;
+}
+
 static void add_recovery_ent(UINT32 const epoch, UINT16 const pg_span)
 {
-    if (epoch > recovery.epoch_max)
+    if (epoch - recovery.epoch_commit > recovery.epoch_max - recovery.epoch_commit)
         recovery.epoch_max = epoch;
     UINT32 idx = epoch - recovery.epoch_commit;
     write_dram_32(RECOVERY_ADDR + idx * (2 * sizeof(UINT32)), pg_span);
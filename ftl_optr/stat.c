@@ -19,19 +19,45 @@ typedef struct {
     UINT32 n_update_side[NUM_BANKS];
     UINT32 n_update_center[NUM_BANKS];
     UINT32 n_merge_write[NUM_BANKS];
+    UINT32 qdepth[NUM_BANKS];
+    UINT32 n_qdepth[NUM_BANKS];
+    UINT32 n_redirect[NUM_BANKS];
+    UINT32 wm_hi[NUM_BANKS];
+    UINT32 wm_lo[NUM_BANKS];
+    UINT32 n_wm[NUM_BANKS];
+    UINT32 n_idle_drain[NUM_BANKS];
+    UINT32 n_early_flush;
+    UINT32 n_fill;
+    UINT32 n_fill_holes;
+    UINT32 n_pack;
+    UINT32 n_pack_chunks;
+    UINT32 n_pack_miss;
+    UINT32 n_pack_evict;
+    UINT32 pack_page;
+    UINT32 n_stream;
+    UINT32 seq_page;
     UINT32 total_merge;
     UINT32 total_write;
     UINT32 total_insert;
     UINT32 n_chkpt;
     UINT32 gc_degrade;
     UINT32 usec_gc[NUM_BANKS];
+    UINT32 n_gc_batch;
+    UINT32 usec_gc_batch;
+    UINT32 gc_moved;
     UINT32 gc_erase_sync;
     UINT32 gc_erase_async;
     UINT32 n_dep;
     UINT32 cnt_dep;
+    UINT32 cnt_mapent;
+    UINT32 bytes_mapent;
     UINT32 n_reclaim;
+    UINT32 n_wl;
+    UINT32 n_grown_bad;
     UINT32 sects_write;
     UINT32 sects_read;
+    UINT32 n_trim;
+    UINT32 pgs_trim;
     UINT32 size_write[15];
     UINT32 size_read[15];
     UINT32 n_dirty_rate;
@@ -102,6 +128,29 @@ void show_stat(void)
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
         uart_printf("%u ", stat.n_merge_write[bank]);
     uart_printf("\n");
+    uart_printf("Queue depth:\n");
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        uart_printf("%.2lf ", (double)stat.qdepth[bank] / stat.n_qdepth[bank]);
+    uart_printf("\n");
+    uart_printf("Redirected:\n");
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        uart_printf("%u ", stat.n_redirect[bank]);
+    uart_printf("\n");
+    uart_printf("Watermarks (hi/lo):\n");
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        uart_printf("%.1lf/%.1lf ", (double)stat.wm_hi[bank] / stat.n_wm[bank],
+                (double)stat.wm_lo[bank] / stat.n_wm[bank]);
+    uart_printf("\n");
+    uart_printf("Idle drained:\n");
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++)
+        uart_printf("%u ", stat.n_idle_drain[bank]);
+    uart_printf("\n");
+    uart_printf("Early periodic flushes: %u\n", stat.n_early_flush);
+    uart_printf("Deferred reads: %u Holes: %u\n", stat.n_fill, stat.n_fill_holes);
+    uart_printf("Packed: %u (%u chunks) in %u pgs No room: %u Merged back: %u\n",
+            stat.n_pack, stat.n_pack_chunks, stat.pack_page, stat.n_pack_miss,
+            stat.n_pack_evict);
+    uart_printf("Streams: %u Sequential: %u pgs\n", stat.n_stream, stat.seq_page);
     UINT32 total_gc = 0;
     uart_printf("GC:\n");
     for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
@@ -121,9 +170,21 @@ void show_stat(void)
     uart_printf("Privcount: %u Avg: %lf\n", stat.gc_privcount, (double)stat.gc_privcount / total_gc);
     uart_printf("Degrad.: %u\n", stat.gc_degrade);
     uart_printf("Erase sync: %u async: %u\n", stat.gc_erase_sync, stat.gc_erase_async);
+    uart_printf("GC batch: %u Moved: %u pgs BW: %lf pgs/s\n",
+            stat.n_gc_batch, stat.gc_moved,
+            stat.usec_gc_batch ? (double)stat.gc_moved * 1000000 / stat.usec_gc_batch : 0.0);
     uart_printf("# chkpt: %u\n", stat.n_chkpt);
     uart_printf("# dep: %u # depent: %u Avg: %lf\n", stat.n_dep, stat.cnt_dep, (double)stat.cnt_dep / stat.n_dep);
+    uart_printf("# mapent: %u Avg bytes: %lf\n", stat.cnt_mapent,
+            (double)stat.bytes_mapent / stat.cnt_mapent);
     uart_printf("# log reclaiming: %u\n", stat.n_reclaim);
+    uart_printf("# WL migrated blks: %u\n", stat.n_wl);
+    uart_printf("# grown bad blks: %u\n", stat.n_grown_bad);
+    uart_printf("# trim: %u Unmapped: %u pgs\n", stat.n_trim, stat.pgs_trim);
+    uart_printf("Log pages: %u (full %u flush %u tag %u) per flush: %lf\n",
+            stat.chkpt_page + stat.dep_page + stat.tag_page,
+            stat.chkpt_page, stat.dep_page, stat.tag_page,
+            (double)(stat.chkpt_page + stat.dep_page + stat.tag_page) / stat.n_flush);
     double tp_write = 0, tp_read = 0;
     #ifndef VST
     if (gtimer_counting) {
@@ -206,6 +267,14 @@ void stat_record_gc(UINT32 bank, UINT32 t)
     stat.n_gc[bank]++;
 }
 
+/* one call per GC batch, which moves pages of several banks in parallel */
+void stat_record_gc_batch(UINT32 n_moved, UINT32 t)
+{
+    stat.n_gc_batch++;
+    stat.gc_moved += n_moved;
+    stat.usec_gc_batch += t;
+}
+
 void stat_record_insert(UINT32 bank)
 {
     stat.n_insert[bank]++;
@@ -239,6 +308,41 @@ void stat_record_update_center(UINT32 bank)
     write_rate.total_write++;
 }
 
+/* one call per old page read to fill the holes of a partially written page */
+void stat_record_fill_holes(UINT32 n_holes)
+{
+    stat.n_fill++;
+    stat.n_fill_holes += n_holes;
+}
+
+/* one call per small update packed instead of merged with its page */
+void stat_record_pack(UINT32 n_chunks)
+{
+    stat.n_pack++;
+    stat.n_pack_chunks += n_chunks;
+}
+
+void stat_record_pack_miss(void)
+{
+    stat.n_pack_miss++;
+}
+
+void stat_record_pack_evict(void)
+{
+    stat.n_pack_evict++;
+}
+
+void stat_record_stream(void)
+{
+    stat.n_stream++;
+}
+
+/* one call per page programmed straight from the SATA write buffer */
+void stat_record_seq_page(void)
+{
+    stat.seq_page++;
+}
+
 void stat_record_merge_write(UINT32 bank)
 {
     stat.n_merge_write[bank]++;
@@ -248,6 +352,39 @@ void stat_record_merge_write(UINT32 bank)
     write_rate.total_write++;
 }
 
+/* dirty entries of the cache of a bank, sampled as each page is cached */
+void stat_record_queue_depth(UINT32 bank, UINT32 depth)
+{
+    stat.qdepth[bank] += depth;
+    stat.n_qdepth[bank]++;
+}
+
+/* a page of another bank was programmed to this bank */
+void stat_record_redirect(UINT32 bank)
+{
+    stat.n_redirect[bank]++;
+}
+
+/* write-back watermarks of a bank, sampled as they are set */
+void stat_record_watermarks(UINT32 bank, UINT32 hi, UINT32 lo)
+{
+    stat.wm_hi[bank] += hi;
+    stat.wm_lo[bank] += lo;
+    stat.n_wm[bank]++;
+}
+
+/* a page was drained from the cache of a bank in the idle loop */
+void stat_record_idle_drain(UINT32 bank)
+{
+    stat.n_idle_drain[bank]++;
+}
+
+/* the periodic flush ran before AUTO_FLUSH as the host went quiet */
+void stat_record_early_flush(void)
+{
+    stat.n_early_flush++;
+}
+
 void stat_record_chkpt(void)
 {
     stat.n_chkpt++;
@@ -284,11 +421,27 @@ void stat_record_dep(UINT32 cnt_dep)
     stat.cnt_dep += cnt_dep;
 }
 
+void stat_record_mapent(UINT32 cnt_mapent, UINT32 bytes)
+{
+    stat.cnt_mapent += cnt_mapent;
+    stat.bytes_mapent += bytes;
+}
+
 void stat_reclaim_log(void)
 {
     stat.n_reclaim++;
 }
 
+void stat_record_wl(UINT32 n_blks)
+{
+    stat.n_wl += n_blks;
+}
+
+void stat_grown_bad_blk(void)
+{
+    stat.n_grown_bad++;
+}
+
 void stat_host_write(UINT32 sects)
 {
     stat.sects_write += sects;
@@ -298,6 +451,12 @@ void stat_host_write(UINT32 sects)
     #endif
 }
 
+void stat_host_trim(UINT32 pgs)
+{
+    stat.n_trim++;
+    stat.pgs_trim += pgs;
+}
+
 void stat_host_read(UINT32 sects)
 {
     stat.sects_read += sects;
@@ -341,6 +500,11 @@ void stat_data_page(void)
     stat.data_page++;
 }
 
+void stat_pack_page(void)
+{
+    stat.pack_page++;
+}
+
 void stat_chkpt_flush_page(UINT32 n_pg)
 {
     stat.chkpt_flush_page += n_pg;
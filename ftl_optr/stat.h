@@ -11,11 +11,23 @@ void stat_record_flush(UINT32 t);
 void stat_record_para(UINT32 para);
 void stat_bank_busy(UINT32 bank);
 void stat_record_gc(UINT32 bank, UINT32 t);
+void stat_record_gc_batch(UINT32 n_moved, UINT32 t);
 void stat_record_insert(UINT32 bank);
 void stat_record_full_write(UINT32 bank);
 void stat_record_update_side(UINT32 bank);
 void stat_record_update_center(UINT32 bank);
+void stat_record_fill_holes(UINT32 n_holes);
+void stat_record_pack(UINT32 n_chunks);
+void stat_record_pack_miss(void);
+void stat_record_pack_evict(void);
+void stat_record_stream(void);
+void stat_record_seq_page(void);
 void stat_record_merge_write(UINT32 bank);
+void stat_record_queue_depth(UINT32 bank, UINT32 depth);
+void stat_record_redirect(UINT32 bank);
+void stat_record_watermarks(UINT32 bank, UINT32 hi, UINT32 lo);
+void stat_record_idle_drain(UINT32 bank);
+void stat_record_early_flush(void);
 void stat_record_chkpt(void);
 void stat_gc_vcount(UINT32 vcount);
 void stat_gc_privcount(UINT32 privcount);
@@ -23,15 +35,20 @@ void stat_record_gc_degrade(UINT32 degrade);
 void stat_gc_erase_sync(void);
 void stat_gc_erase_async(void);
 void stat_record_dep(UINT32 cnt_dep);
+void stat_record_mapent(UINT32 cnt_mapent, UINT32 bytes);
 void stat_reclaim_log(void);
+void stat_record_wl(UINT32 n_blks);
+void stat_grown_bad_blk(void);
 void stat_host_write(UINT32 sects);
 void stat_host_read(UINT32 sects);
+void stat_host_trim(UINT32 pgs);
 void stat_dirty_rate(UINT16 *n_dirty_bufs);
 void stat_update_distance(UINT32 distance);
 void stat_chkpt_page(void);
 void stat_tag_page(void);
 void stat_dep_page(void);
 void stat_data_page(void);
+void stat_pack_page(void);
 void stat_chkpt_flush_page(UINT32 n_pg);
 void stat_gc_flush_page(UINT32 n_pg);
 void stat_manual_flush_page(UINT32 n_pg);
@@ -0,0 +1,101 @@
+/**
+ * stream.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#include "ftl.h"
+#include "blkmgr.h"
+#include "pgmap.h"
+#include "cache.h"
+#include "log.h"
+#include "stat.h"
+#include "submap.h"
+
+/**
+ * Sequential write streams. Up to NUM_STREAMS streams are tracked by the lba
+ * their next write is expected at. A write that does not continue any of
+ * them starts a new stream in place of the one extended least recently.
+ * Once a stream has run STREAM_SEQ_SECTORS sectors, the full pages of its
+ * writes are programmed straight from the SATA write buffers, each to its
+ * own bank as the pages of a write are striped, and never enter the cache.
+ * Such a page is a page of its write like any other: its spare carries the
+ * epoch and pg_span of the write, so order-preserving recovery is unchanged.
+ */
+
+typedef struct {
+    UINT32 lba_next;
+    UINT32 n_sects;
+    UINT32 epoch;       /* of the last write that extended the stream */
+} stream_t;
+
+static stream_t streams[NUM_STREAMS];
+extern UINT32 g_epoch;
+extern UINT16 g_pg_span;
+
+void init_stream(void)
+{
+    for (UINT32 i = 0; i < NUM_STREAMS; i++) {
+        streams[i].lba_next = -1;
+        streams[i].n_sects = 0;
+        streams[i].epoch = 0;
+    }
+}
+
+/* whether the write belongs to a sequential stream */
+UINT32 stream_detect(UINT32 const lba, UINT32 const n_sect)
+{
+    UINT32 s;
+
+    for (s = 0; s < NUM_STREAMS && streams[s].lba_next != lba; s++)
+        ;
+    if (s == NUM_STREAMS) {
+        s = 0;
+        for (UINT32 i = 1; i < NUM_STREAMS; i++)
+            if (g_epoch - streams[i].epoch > g_epoch - streams[s].epoch)
+                s = i;
+        streams[s].n_sects = 0;
+        stat_record_stream();
+    }
+
+    stream_t *stream_p = &streams[s];
+    stream_p->lba_next = lba + n_sect;
+    if (stream_p->n_sects < STREAM_SEQ_SECTORS)
+        stream_p->n_sects += n_sect;
+    stream_p->epoch = g_epoch;
+    return OPTION_SEQ_STREAM && stream_p->n_sects >= STREAM_SEQ_SECTORS;
+}
+
+/**
+ * Program the full page in the current SATA write buffer as lpn, which
+ * consumes the buffer. A cached copy of the page is dropped.
+ */
+void stream_write_page(UINT32 const bank, UINT32 const lpn)
+{
+    UINT32 old_ppn = get_ppn(lpn);
+    UINT32 region = 1;
+
+    cache_drop(bank, lpn);
+    if (old_ppn != 0)
+        dec_vcount(GPPN_BANK(old_ppn), GPPN_PPN(old_ppn) / PAGES_PER_VBLK);
+
+    UINT32 new_ppn = get_and_inc_active_ppn(bank, region);
+    UINT32 blk = new_ppn / PAGES_PER_VBLK;
+    UINT32 page = new_ppn % PAGES_PER_VBLK;
+    set_lpn(bank, region, page, lpn);
+    set_ppn(lpn, GPPN(bank, new_ppn));
+    inc_vcount(bank, blk);
+    log_insert_mapent(lpn, GPPN(bank, new_ppn));
+    submap_release(lpn);
+
+    #ifdef VST
+    UINT8 spare[12];
+    mem_copy(spare, &lpn, sizeof(UINT32));
+    mem_copy(spare + 4, &g_pg_span, sizeof(UINT16));
+    mem_copy(spare + 8, &g_epoch, sizeof(UINT32));
+    set_spare(spare, 12);
+    #endif
+
+    stat_data_page();
+    stat_record_seq_page();
+    nand_page_program_from_host(bank, blk, page);
+}
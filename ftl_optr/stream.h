@@ -0,0 +1,13 @@
+/**
+ * stream.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+void init_stream(void);
+UINT32 stream_detect(UINT32 const lba, UINT32 const n_sect);
+void stream_write_page(UINT32 const bank, UINT32 const lpn);
+
+#endif // STREAM_H
@@ -0,0 +1,509 @@
+/**
+ * submap.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#include "ftl.h"
+#include "blkmgr.h"
+#include "pgmap.h"
+#include "log.h"
+#include "stat.h"
+#include "board.h"
+#include "submap.h"
+
+/**
+ * Sub-page mapping. The chunks of a small update are appended to the open
+ * pack of the bank, a flash page shared by the small updates of several
+ * pages, instead of being merged with the old page. The old page stays
+ * mapped as the base of the page, and an overlay picked set-associatively
+ * out of NUM_SUBMAP_ENTS maps each of its chunks to the latest copy in a
+ * pack. An update merged as a whole page drops the overlay. When a set has
+ * no free overlay, its least recently packed page is merged back after the
+ * next flush: every write is durable then, so the merged page holds nothing
+ * that recovery could roll back. Like a GC copy it carries no epoch, but it
+ * also drops the overlay recovered from the last commit, whose packs may be
+ * erased by then.
+ *
+ * A chunk entry holds (pack * CHUNKS_PER_PAGE + slot + 1), or 0 if the chunk
+ * is read from the base, and an owner entry holds (lpn + 1) of the page
+ * using the overlay. Pack p is only used by bank p % NUM_BANKS, so that GC
+ * finds a pack page valid as for any page of the bank.
+ *
+ * A pack is freed once none of its chunks is mapped, but is not reused
+ * before the next commit tag, since the map recovered from the last commit
+ * may still point at it.
+ */
+
+#define PACK_DEAD 0xff
+
+typedef struct {
+    UINT32 pack;        /* -1 if no pack is open */
+    UINT32 n_ents;
+    UINT32 n_chunks;
+    UINT32 cursor;      /* where the search for a free pack starts */
+    #ifdef VST
+    UINT8 spare[SUBMAP_SPARE_BYTES];
+    #endif
+} pack_t;
+
+static pack_t packs[NUM_BANKS];
+/* sets found full since the last flush */
+static UINT32 full_sets[SUBMAP_EVICT_MAX];
+static UINT32 n_full_sets;
+extern UINT32 g_epoch;
+
+static UINT32 take_free_way(UINT32 const lpn);
+static UINT32 open_pack(UINT32 const bank);
+static void program_pack(UINT32 const bank);
+static void map_chunk(UINT32 const idx, UINT32 const c, UINT32 const val);
+static void put_chunk(UINT32 const val);
+static void free_pack(UINT32 const pack);
+static void clear_overlay(UINT32 const idx);
+static void merge_back(UINT32 const idx);
+
+#define SUBMAP_SET(LPN)     ((LPN) % (NUM_SUBMAP_ENTS / SUBMAP_WAYS))
+
+void init_submap(void)
+{
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
+        packs[bank].pack = -1;
+        packs[bank].n_ents = 0;
+        packs[bank].n_chunks = 0;
+        packs[bank].cursor = bank;
+    }
+    n_full_sets = 0;
+    mem_set_dram(PACK_LIVE_ADDR, 0, PACK_LIVE_BYTES);
+}
+
+/* count the live chunks of each pack and date each overlay after recovery */
+void submap_rebuild(void)
+{
+    if (!OPTION_SUBPAGE_MAP)
+        return;
+    mem_set_dram(PACK_LIVE_ADDR, 0, PACK_LIVE_BYTES);
+    for (UINT32 clpn = CHUNK_LPN_BASE; clpn < OWNER_LPN_BASE; clpn++) {
+        UINT32 val = get_ppn(clpn);
+        if (val) {
+            UINT32 pack = (val - 1) / CHUNKS_PER_PAGE;
+            write_dram_8(PACK_LIVE(pack), read_dram_8(PACK_LIVE(pack)) + 1);
+        }
+    }
+    for (UINT32 pack = 0; pack < NUM_PACKS; pack++)
+        if (get_ppn(PACK_LPN(pack)) && !read_dram_8(PACK_LIVE(pack)))
+            write_dram_8(PACK_LIVE(pack), PACK_DEAD);
+    /* a merged page is dated by the stamp of its overlay */
+    for (UINT32 idx = 0; idx < NUM_SUBMAP_ENTS; idx++)
+        write_dram_32(SUBMAP_STAMP(idx),
+                read_dram_32(RECOVERY_PAGE_EPOCH(OWNER_LPN(idx))));
+}
+
+UINT32 submap_lookup(UINT32 const lpn)
+{
+    if (!OPTION_SUBPAGE_MAP)
+        return -1;
+    UINT32 idx = SUBMAP_SET(lpn) * SUBMAP_WAYS;
+    for (UINT32 way = 0; way < SUBMAP_WAYS; way++, idx++)
+        if (get_ppn(OWNER_LPN(idx)) == lpn + 1)
+            return idx;
+    return -1;
+}
+
+/**
+ * Pack the chunks in mask of the page in buf. The bank must be idle. When the
+ * update does not fit in the open pack, the pack is programmed and
+ * SUBMAP_BUSY is returned, so the update is packed on a later call. An
+ * update that cannot be packed is to be merged with its page.
+ */
+UINT32 submap_pack(UINT32 const bank, UINT32 const lpn, UINT32 const buf,
+                   UINT32 const mask, UINT32 const epoch, UINT16 const pg_span)
+{
+    pack_t *pack_p = &packs[bank];
+    UINT32 n_chunks = 0, n_overlaid = 0;
+    UINT32 idx = submap_lookup(lpn);
+
+    for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++) {
+        if ((mask >> c) & 1)
+            n_chunks++;
+        else if (idx != -1 && get_ppn(CHUNK_LPN(idx, c)))
+            n_overlaid++;
+    }
+    /* a page mostly read from packs is merged back */
+    if (n_chunks + n_overlaid > PACK_MAX_CHUNKS)
+        return SUBMAP_MERGE;
+    if (pack_p->pack != -1 && pack_p->n_chunks + n_chunks > CHUNKS_PER_PAGE) {
+        program_pack(bank);
+        return SUBMAP_BUSY;
+    }
+    if (pack_p->pack == -1 && open_pack(bank) == -1) {
+        stat_record_pack_miss();
+        return SUBMAP_MERGE;
+    }
+    if (idx == -1)
+        idx = take_free_way(lpn);
+    if (idx == -1) {
+        if (n_full_sets < SUBMAP_EVICT_MAX)
+            full_sets[n_full_sets++] = SUBMAP_SET(lpn);
+        stat_record_pack_miss();
+        return SUBMAP_MERGE;
+    }
+    write_dram_32(SUBMAP_STAMP(idx), epoch);
+
+    UINT32 slot = pack_p->n_chunks;
+    for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++) {
+        if (!((mask >> c) & 1))
+            continue;
+        mem_copy(PACK_BUF(bank) + slot * BYTES_PER_CHUNK,
+                buf + c * BYTES_PER_CHUNK, BYTES_PER_CHUNK);
+        map_chunk(idx, c, pack_p->pack * CHUNKS_PER_PAGE + slot + 1);
+        slot++;
+    }
+
+    #ifdef VST
+    UINT8 *ent = pack_p->spare + SUBMAP_SPARE_ENT(pack_p->n_ents);
+    UINT16 idx16 = idx;
+    UINT8 mask8 = mask;
+    mem_copy(ent, &lpn, sizeof(UINT32));
+    mem_copy(ent + 4, &epoch, sizeof(UINT32));
+    mem_copy(ent + 8, &pg_span, sizeof(UINT16));
+    mem_copy(ent + 10, &idx16, sizeof(UINT16));
+    mem_copy(ent + 12, &mask8, sizeof(UINT8));
+    #endif
+
+    pack_p->n_ents++;
+    pack_p->n_chunks = slot;
+    stat_record_pack(n_chunks);
+    if (pack_p->n_chunks == CHUNKS_PER_PAGE || pack_p->n_ents == PACK_MAX_ENTS)
+        program_pack(bank);
+    return SUBMAP_PACKED;
+}
+
+/* the page is merged as a whole, so its chunks in packs are dropped */
+void submap_release(UINT32 const lpn)
+{
+    UINT32 idx = submap_lookup(lpn);
+
+    if (idx == -1)
+        return;
+    for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++) {
+        UINT32 val = get_ppn(CHUNK_LPN(idx, c));
+        if (!val)
+            continue;
+        put_chunk(val);
+        set_ppn(CHUNK_LPN(idx, c), 0);
+        log_insert_mapent(CHUNK_LPN(idx, c), 0);
+    }
+    set_ppn(OWNER_LPN(idx), 0);
+    log_insert_mapent(OWNER_LPN(idx), 0);
+}
+
+/**
+ * Read sectors [sect, sect + n_sect) of the page through its overlay into buf,
+ * at their offsets in the page: the base page first, which may be on
+ * another bank, then the part of each chunk in range from its pack. The bank
+ * must be free.
+ */
+void submap_read_page(UINT32 const bank, UINT32 const lpn, UINT32 const idx,
+                      UINT32 const buf, UINT32 const sect, UINT32 const n_sect)
+{
+    UINT32 ppn = get_ppn(lpn);
+
+    if (ppn) {
+        nand_page_ptread(GPPN_BANK(ppn), GPPN_PPN(ppn) / PAGES_PER_VBLK,
+                GPPN_PPN(ppn) % PAGES_PER_VBLK, sect, n_sect, buf,
+                RETURN_WHEN_DONE);
+    } else {
+        #ifdef VST
+        omit_next_dram_op();
+        #endif
+        mem_set_dram(buf + sect * BYTES_PER_SECTOR, 0xffffffff,
+                n_sect * BYTES_PER_SECTOR);
+    }
+    for (UINT32 c = sect / SECTORS_PER_CHUNK;
+            c * SECTORS_PER_CHUNK < sect + n_sect; c++) {
+        UINT32 val = get_ppn(CHUNK_LPN(idx, c));
+        if (!val)
+            continue;
+        UINT32 pack = (val - 1) / CHUNKS_PER_PAGE;
+        UINT32 slot = (val - 1) % CHUNKS_PER_PAGE;
+        UINT32 src = PACK_BUF(bank);
+        /* the sectors of the chunk in range, and where they are in the pack */
+        UINT32 lo = MAX(sect, c * SECTORS_PER_CHUNK);
+        UINT32 hi = MIN(sect + n_sect, (c + 1) * SECTORS_PER_CHUNK);
+        UINT32 sect_pack = slot * SECTORS_PER_CHUNK + lo - c * SECTORS_PER_CHUNK;
+        ASSERT(pack % NUM_BANKS == bank);
+        if (pack != packs[bank].pack) {
+            UINT32 ppn_pack = GPPN_PPN(get_ppn(PACK_LPN(pack)));
+            nand_page_ptread(bank, ppn_pack / PAGES_PER_VBLK,
+                    ppn_pack % PAGES_PER_VBLK, sect_pack, hi - lo,
+                    PACK_RD_BUF(bank), RETURN_WHEN_DONE);
+            src = PACK_RD_BUF(bank);
+        }
+        mem_copy(buf + lo * BYTES_PER_SECTOR, src + sect_pack * BYTES_PER_SECTOR,
+                (hi - lo) * BYTES_PER_SECTOR);
+    }
+}
+
+/* open packs are programmed before a flush completes */
+void submap_flush(void)
+{
+    for (UINT32 bank = 0; bank < NUM_BANKS; bank++) {
+        if (packs[bank].pack == -1)
+            continue;
+        wait_bank_free(bank);
+        program_pack(bank);
+    }
+}
+
+/**
+ * Called once every write is durable: the least recently packed page of each
+ * set found full is merged back, which frees its overlay.
+ */
+void submap_evict(void)
+{
+    for (UINT32 i = 0; i < n_full_sets; i++) {
+        UINT32 idx = full_sets[i] * SUBMAP_WAYS;
+        UINT32 victim = -1;
+        UINT32 stamp_min = -1;
+        for (UINT32 way = 0; way < SUBMAP_WAYS; way++, idx++) {
+            UINT32 stamp = read_dram_32(SUBMAP_STAMP(idx));
+            if (!get_ppn(OWNER_LPN(idx))) {
+                victim = -1;
+                break;
+            }
+            if (victim == -1 || g_epoch - stamp > g_epoch - stamp_min) {
+                victim = idx;
+                stamp_min = stamp;
+            }
+        }
+        if (victim != -1)
+            merge_back(victim);
+    }
+    n_full_sets = 0;
+}
+
+/* packs freed before the commit tag just recorded can be reused */
+void submap_commit(void)
+{
+    if (!OPTION_SUBPAGE_MAP)
+        return;
+    for (UINT32 pack = 0; pack < NUM_PACKS; pack++)
+        if (read_dram_8(PACK_LIVE(pack)) == PACK_DEAD)
+            write_dram_8(PACK_LIVE(pack), 0);
+}
+
+/**
+ * Recovery. Pages and packs are met out of order, so each chunk and each
+ * overlay keeps the epoch it was recovered from (RECOVERY_PAGE_EPOCH of its
+ * entry): a page written as a whole or merged back drops the chunks it
+ * covers, and an overlay goes to the page that packed into it last.
+ */
+void submap_recover_page(UINT32 const lpn, UINT32 const epoch)
+{
+    UINT32 idx = submap_lookup(lpn);
+    UINT32 n_left = 0;
+
+    if (idx == -1)
+        return;
+    for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++) {
+        UINT32 clpn = CHUNK_LPN(idx, c);
+        if (!get_ppn(clpn))
+            continue;
+        if (read_dram_32(RECOVERY_PAGE_EPOCH(clpn)) <= epoch)
+            set_ppn(clpn, 0);
+        else
+            n_left++;
+    }
+    if (!n_left)
+        set_ppn(OWNER_LPN(idx), 0);
+}
+
+/* a merged-back page replaces every chunk recovered from the last commit */
+void submap_recover_merge(UINT32 const lpn)
+{
+    UINT32 idx = submap_lookup(lpn);
+
+    if (idx != -1)
+        clear_overlay(idx);
+}
+
+UINT32 submap_recover_chunk(UINT32 const lpn, UINT32 const idx, UINT32 const c,
+                            UINT32 const val, UINT32 const epoch)
+{
+    UINT32 clpn = CHUNK_LPN(idx, c);
+    UINT32 epoch_owner = read_dram_32(RECOVERY_PAGE_EPOCH(OWNER_LPN(idx)));
+
+    if (epoch < read_dram_32(RECOVERY_PAGE_EPOCH(clpn)))
+        return 0;
+    if (get_ppn(OWNER_LPN(idx)) != lpn + 1) {
+        /* the overlay was taken over after this chunk was packed */
+        if (epoch < epoch_owner)
+            return 0;
+        UINT32 idx_old = submap_lookup(lpn);
+        if (idx_old != -1) {
+            if (epoch < read_dram_32(RECOVERY_PAGE_EPOCH(OWNER_LPN(idx_old))))
+                return 0;
+            clear_overlay(idx_old);
+        }
+        clear_overlay(idx);
+        set_ppn(OWNER_LPN(idx), lpn + 1);
+    }
+    if (epoch > epoch_owner)
+        write_dram_32(RECOVERY_PAGE_EPOCH(OWNER_LPN(idx)), epoch);
+    set_ppn(clpn, val);
+    write_dram_32(RECOVERY_PAGE_EPOCH(clpn), epoch);
+    return 1;
+}
+
+static UINT32 take_free_way(UINT32 const lpn)
+{
+    UINT32 idx = SUBMAP_SET(lpn) * SUBMAP_WAYS;
+    for (UINT32 way = 0; way < SUBMAP_WAYS; way++, idx++) {
+        if (!get_ppn(OWNER_LPN(idx))) {
+            set_ppn(OWNER_LPN(idx), lpn + 1);
+            log_insert_mapent(OWNER_LPN(idx), lpn + 1);
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static UINT32 open_pack(UINT32 const bank)
+{
+    pack_t *pack_p = &packs[bank];
+    UINT32 pack = pack_p->cursor;
+
+    do {
+        if (!read_dram_8(PACK_LIVE(pack))) {
+            pack_p->pack = pack;
+            pack_p->n_ents = 0;
+            pack_p->n_chunks = 0;
+            pack_p->cursor = (pack + NUM_BANKS) % NUM_PACKS;
+            return pack;
+        }
+        pack = (pack + NUM_BANKS) % NUM_PACKS;
+    } while (pack != pack_p->cursor);
+    return -1;
+}
+
+static void program_pack(UINT32 const bank)
+{
+    pack_t *pack_p = &packs[bank];
+    UINT32 pack = pack_p->pack;
+    UINT32 lpn = PACK_LPN(pack);
+
+    pack_p->pack = -1;
+
+    UINT32 ppn = get_and_inc_active_ppn(bank, NUM_REGIONS - 1);
+    UINT32 blk = ppn / PAGES_PER_VBLK;
+    UINT32 page = ppn % PAGES_PER_VBLK;
+    set_lpn(bank, NUM_REGIONS - 1, page, lpn);
+    /**
+     * A pack whose chunks were all overwritten while it was open is still
+     * programmed, but not mapped: its updates are pages of their writes,
+     * which recovery may have to roll back to.
+     */
+    if (read_dram_8(PACK_LIVE(pack))) {
+        set_ppn(lpn, GPPN(bank, ppn));
+        inc_vcount(bank, blk);
+        log_insert_mapent(lpn, GPPN(bank, ppn));
+    } else {
+        write_dram_8(PACK_LIVE(pack), PACK_DEAD);
+    }
+
+    #ifdef VST
+    UINT16 pg_span = 0;
+    UINT32 tag = SUBMAP_PACK_TAG;
+    mem_copy(pack_p->spare, &lpn, sizeof(UINT32));
+    mem_copy(pack_p->spare + 4, &pg_span, sizeof(UINT16));
+    mem_copy(pack_p->spare + 8, &tag, sizeof(UINT32));
+    if (pack_p->n_ents < PACK_MAX_ENTS)
+        pack_p->spare[SUBMAP_SPARE_ENT(pack_p->n_ents) + 12] = 0;
+    set_spare(pack_p->spare, SUBMAP_SPARE_BYTES);
+    #endif
+
+    stat_data_page();
+    stat_pack_page();
+    nand_page_program(bank, blk, page, PACK_BUF(bank));
+}
+
+static void map_chunk(UINT32 const idx, UINT32 const c, UINT32 const val)
+{
+    UINT32 val_old = get_ppn(CHUNK_LPN(idx, c));
+    UINT32 pack = (val - 1) / CHUNKS_PER_PAGE;
+
+    write_dram_8(PACK_LIVE(pack), read_dram_8(PACK_LIVE(pack)) + 1);
+    if (val_old)
+        put_chunk(val_old);
+    set_ppn(CHUNK_LPN(idx, c), val);
+    log_insert_mapent(CHUNK_LPN(idx, c), val);
+}
+
+static void put_chunk(UINT32 const val)
+{
+    UINT32 pack = (val - 1) / CHUNKS_PER_PAGE;
+    UINT8 live = read_dram_8(PACK_LIVE(pack));
+
+    ASSERT(live != 0 && live != PACK_DEAD);
+    write_dram_8(PACK_LIVE(pack), live - 1);
+    /* an open pack is dealt with when it is programmed */
+    if (live == 1 && pack != packs[pack % NUM_BANKS].pack)
+        free_pack(pack);
+}
+
+static void free_pack(UINT32 const pack)
+{
+    UINT32 lpn = PACK_LPN(pack);
+    UINT32 ppn = get_ppn(lpn);
+
+    dec_vcount(GPPN_BANK(ppn), GPPN_PPN(ppn) / PAGES_PER_VBLK);
+    set_ppn(lpn, 0);
+    log_insert_mapent(lpn, 0);
+    write_dram_8(PACK_LIVE(pack), PACK_DEAD);
+}
+
+static void clear_overlay(UINT32 const idx)
+{
+    for (UINT32 c = 0; c < CHUNKS_PER_PAGE; c++)
+        set_ppn(CHUNK_LPN(idx, c), 0);
+    set_ppn(OWNER_LPN(idx), 0);
+}
+
+/**
+ * The merged page goes to the bank of its base, behind any GC copy of the
+ * base, as recovery applies such untimed copies in the order of their bank.
+ */
+static void merge_back(UINT32 const idx)
+{
+    UINT32 lpn = get_ppn(OWNER_LPN(idx)) - 1;
+    UINT32 epoch = read_dram_32(SUBMAP_STAMP(idx));
+    UINT32 bank = lpn % NUM_BANKS;
+    UINT32 ppn_old = get_ppn(lpn);
+    UINT32 bank_dst = ppn_old ? GPPN_BANK(ppn_old) : bank;
+
+    wait_bank_free(bank);
+    wait_bank_free(bank_dst);
+    submap_read_page(bank, lpn, idx, _COPY_BUF(bank_dst), 0, SECTORS_PER_PAGE);
+
+    UINT32 ppn = get_and_inc_active_ppn(bank_dst, NUM_REGIONS - 1);
+    UINT32 blk = ppn / PAGES_PER_VBLK;
+    UINT32 page = ppn % PAGES_PER_VBLK;
+    if (ppn_old)
+        dec_vcount(bank_dst, GPPN_PPN(ppn_old) / PAGES_PER_VBLK);
+    set_lpn(bank_dst, NUM_REGIONS - 1, page, lpn);
+    set_ppn(lpn, GPPN(bank_dst, ppn));
+    inc_vcount(bank_dst, blk);
+    log_insert_mapent(lpn, GPPN(bank_dst, ppn));
+    submap_release(lpn);
+
+    #ifdef VST
+    UINT8 spare[16];
+    UINT32 tag = SUBMAP_MERGE_TAG;
+    mem_copy(spare, &lpn, sizeof(UINT32));
+    mem_copy(spare + 8, &tag, sizeof(UINT32));
+    mem_copy(spare + 12, &epoch, sizeof(UINT32));
+    set_spare(spare, 16);
+    #endif
+
+    stat_record_pack_evict();
+    nand_page_program(bank_dst, blk, page, _COPY_BUF(bank_dst));
+}
@@ -0,0 +1,45 @@
+/**
+ * submap.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef SUBMAP_H
+#define SUBMAP_H
+
+/**
+ * In VST the spare of a pack page holds the pack as its lpn and
+ * SUBMAP_PACK_TAG as its epoch, followed by one record per update: lpn,
+ * epoch, pg_span, overlay index and the mask of its chunks, which take the
+ * slots of the pack in order. An empty mask ends the records.
+ */
+#define SUBMAP_PACK_TAG         ((UINT32)-3)
+/**
+ * The epoch in the spare of a page merged back from its overlay. The epoch of
+ * the last update packed to the overlay follows it, which dates the page.
+ */
+#define SUBMAP_MERGE_TAG        ((UINT32)-4)
+#define SUBMAP_SPARE_ENT(I)     (12 + (I) * 13)
+#define SUBMAP_SPARE_BYTES      SUBMAP_SPARE_ENT(PACK_MAX_ENTS)
+
+/* results of submap_pack() */
+#define SUBMAP_MERGE    0
+#define SUBMAP_PACKED   1
+#define SUBMAP_BUSY     2
+
+void init_submap(void);
+void submap_rebuild(void);
+UINT32 submap_lookup(UINT32 const lpn);
+UINT32 submap_pack(UINT32 const bank, UINT32 const lpn, UINT32 const buf,
+                   UINT32 const mask, UINT32 const epoch, UINT16 const pg_span);
+void submap_release(UINT32 const lpn);
+void submap_read_page(UINT32 const bank, UINT32 const lpn, UINT32 const idx,
+                      UINT32 const buf, UINT32 const sect, UINT32 const n_sect);
+void submap_flush(void);
+void submap_evict(void);
+void submap_commit(void);
+void submap_recover_page(UINT32 const lpn, UINT32 const epoch);
+void submap_recover_merge(UINT32 const lpn);
+UINT32 submap_recover_chunk(UINT32 const lpn, UINT32 const idx, UINT32 const c,
+                            UINT32 const val, UINT32 const epoch);
+
+#endif // SUBMAP_H
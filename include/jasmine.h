@@ -32,7 +32,7 @@
 #define OPTION_SLOW_SATA		0	// 1 = SATA 1.5Gbps, 0 = 3Gbps
 #define OPTION_SUPPORT_NCQ		0	// 1 = support SATA NCQ (=FPDMA) for AHCI hosts, 0 = support only DMA mode
 #define OPTION_REDUCED_CAPACITY	0	// reduce the number of blocks per bank for testing purpose
-#define OPTION_SUPPORT_TRIM     0
+#define OPTION_SUPPORT_TRIM     1
 #define OPTION_TEST_NAND_BLK    0
 
 #define CHN_WIDTH			2 	// 2 = 16bit IO
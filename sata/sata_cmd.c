@@ -348,9 +348,7 @@ void pio_sector_transfer(UINT32 const dram_addr, UINT32 const protocol)
 #if OPTION_SUPPORT_TRIM
 void ata_dsm(UINT32 lba, UINT32 sector_count)
 {
-    SETREG(SATA_XFER_BYTES, sector_count * BYTES_PER_SECTOR);
-    SETREG(SATA_SECT_OFFSET, 0);
-    SETREG(SATA_CTRL_2, DMA_WRITE | COMPLETE);
+    /* the transfer of the range entries was started by the ISR */
     ftl_trim(lba, sector_count);
     send_status_to_host(0);
 }
@@ -224,17 +224,19 @@ static __inline void handle_got_cfis(void)
 			SETREG(SATA_CTRL_2, action_flags);
 		}
 	}
-    /*
+    #if OPTION_SUPPORT_TRIM
     else if (cmd_code == ATA_DATA_SET_MANAGEMENT)
     {
+        /* the range entries are received into the write buffers while the command waits */
         SETREG(SATA_XFER_BYTES, sector_count * BYTES_PER_SECTOR);
+        SETREG(SATA_SECT_OFFSET, 0);
         SETREG(SATA_CTRL_2, DMA_WRITE | COMPLETE);
         g_sata_context.slow_cmd.status = SLOW_CMD_STATUS_PENDING;
         g_sata_context.slow_cmd.code = cmd_code;
         g_sata_context.slow_cmd.lba = lba;
         g_sata_context.slow_cmd.sector_count = sector_count;
     }
-    */
+    #endif
 	else
 	{
 		g_sata_context.slow_cmd.status = SLOW_CMD_STATUS_PENDING;
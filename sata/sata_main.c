@@ -112,7 +112,7 @@ void Main(void)
 		else
 		{
 			// idle time operations
-			pool_write_buf();
+			ftl_background();
 		}
 	}
 }
@@ -92,7 +92,7 @@ __irq void irq_handler(void)
 		g_timer_interrupt_count++;
 
         if (intr_stat & INTR_TIMER_2) {
-            schedule_flush_depent();
+            cache_flush_tick();
         }
 		CLEAR_TIMER_INTR(TIMER_CH1);
 		CLEAR_TIMER_INTR(TIMER_CH2);
@@ -23,6 +23,13 @@
 
 #define VST_MAX_LBA (NUM_LSECTORS - 1)
 
+/* a DSM TRIM payload sector holds 64 range entries of up to 65535 sectors */
+#define VST_TRIM_RANGES_PER_SECTOR (VST_BYTES_PER_SECTOR / 8)
+#define VST_TRIM_SECTS_PER_RANGE 65535
+#define VST_TRIM_PAYLOAD_SECTS(N_SECT) \
+        ((((N_SECT) + VST_TRIM_SECTS_PER_RANGE - 1) / VST_TRIM_SECTS_PER_RANGE + \
+        VST_TRIM_RANGES_PER_SECTOR - 1) / VST_TRIM_RANGES_PER_SECTOR)
+
 #define VST_DRAM_BASE DRAM_BASE
 #define VST_DRAM_SIZE DRAM_SIZE
 
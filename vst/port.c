@@ -3,8 +3,13 @@
  * Authors: Yun-Sheng Chang
  */
 
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ftl.h"
+#include "blkmgr.h"
 #include "vst-api.h"
 
 /* VST tags */
@@ -15,15 +20,78 @@ static UINT8 spare[64];
 extern UINT32 g_ftl_read_buf_id;
 extern UINT32 g_ftl_write_buf_id;
 
+/* tuning knobs settable through FTL_CONFIG, with their bounds */
+static struct {
+    const char *name;
+    UINT32 *val;
+    UINT32 min;
+    UINT32 max;
+} knobs[] = {
+    {"gc_threshold", &ftl_cfg.gc_threshold, 1, VBLKS_PER_BANK / 4},
+    {"batch_gc_threshold", &ftl_cfg.batch_gc_threshold, 0, VBLKS_PER_BANK / 4},
+    {"hot_region_blks", &ftl_cfg.hot_region_blks, 2, VBLKS_PER_BANK / 2},
+    {"auto_flush", &ftl_cfg.auto_flush, 1, 3600},
+    {"cache_bufs_per_bank", &ftl_cfg.cache_bufs_per_bank, 4, NUM_CACHE_BUFFERS_PER_BANK},
+    {"log_blks_per_bank", &ftl_cfg.log_blks_per_bank, 1, MAX_LOG_BLKS_PER_BANK},
+};
+
+static void load_config(void);
+
 /* VST tag operations */
 void omit_next_dram_op(void)
 {
     omit = 1;
 }
 
+/**
+ * FTL_CONFIG is a comma-separated list of knob=value, e.g.
+ * FTL_CONFIG=gc_threshold=60,cache_bufs_per_bank=16. Knobs not listed keep
+ * their defaults in ftl.h. A bad entry aborts the run rather than being
+ * swept silently at the default.
+ */
+static void load_config(void)
+{
+    char *env = getenv("FTL_CONFIG");
+    char *buf, *tok, *save, *end;
+    UINT32 i;
+
+    if (env == NULL || env[0] == '\0')
+        return;
+    buf = strdup(env);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        unsigned long val;
+
+        if (eq == NULL)
+            goto bad;
+        *eq = '\0';
+        for (i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++)
+            if (!strcmp(tok, knobs[i].name))
+                break;
+        if (i == sizeof(knobs) / sizeof(knobs[0]))
+            goto bad;
+        val = strtoul(eq + 1, &end, 0);
+        if (eq[1] == '\0' || *end != '\0' ||
+                val < knobs[i].min || val > knobs[i].max) {
+            fprintf(stderr, "FTL_CONFIG: %s must be in [%u, %u]\n",
+                    knobs[i].name, knobs[i].min, knobs[i].max);
+            exit(1);
+        }
+        *knobs[i].val = val;
+    }
+    free(buf);
+    return;
+
+bad:
+    fprintf(stderr, "FTL_CONFIG: unknown entry '%s'\n", tok);
+    exit(1);
+}
+
 /* host operations */
 void vst_open_ftl(void)
 {
+    load_config();
     ftl_open();
 }
 
@@ -42,6 +110,11 @@ void vst_write_sector(uint32_t lba, uint32_t n_sect)
     ftl_write(lba, n_sect);
 }
 
+void vst_trim_sector(uint32_t lba, uint32_t n_sect)
+{
+    ftl_trim(0, VST_TRIM_PAYLOAD_SECTS(n_sect));
+}
+
 void vst_flush_cache(void)
 {
     ftl_flush();
@@ -75,6 +148,11 @@ uint32_t vst_get_epoch(void)
     return ftl_get_epoch();
 }
 
+uint32_t vst_gc_triggered(void)
+{
+    return blkmgr_first_gc_triggered();
+}
+
 /* flash wrappers */
 void nand_page_read(UINT32 const bank, UINT32 const vblock, 
                     UINT32 const page_num, UINT32 const buf_addr)
@@ -112,31 +190,36 @@ void nand_page_ptread_to_host(UINT32 const bank, UINT32 const vblock,
 void nand_page_program(UINT32 const bank, UINT32 const vblock, 
                        UINT32 const page_num, UINT32 const buf_addr)
 {
-    vst_write_page(bank, vblock, page_num, 0, SECTORS_PER_PAGE,
-                   (UINT64)buf_addr, spare);
+    if (vst_write_page(bank, vblock, page_num, 0, SECTORS_PER_PAGE,
+                       (UINT64)buf_addr, spare))
+        blkmgr_report_prog_fail(bank, vblock, page_num, buf_addr);
 }
 
 void nand_page_ptprogram(UINT32 const bank, UINT32 const vblock, 
                          UINT32 const page_num, UINT32 const sect_offset, 
                          UINT32 const num_sectors, UINT32 const buf_addr)
 {
-    vst_write_page(bank, vblock, page_num, sect_offset, num_sectors,
-                   (UINT64)buf_addr, spare);
+    if (vst_write_page(bank, vblock, page_num, sect_offset, num_sectors,
+                       (UINT64)buf_addr, spare))
+        blkmgr_report_prog_fail(bank, vblock, page_num, buf_addr);
 }
 
 void nand_page_ptprogram_sync(UINT32 const bank, UINT32 const vblock, 
                          UINT32 const page_num, UINT32 const sect_offset, 
                          UINT32 const num_sectors, UINT32 const buf_addr)
 {
-    vst_write_page(bank, vblock, page_num, sect_offset, num_sectors,
-                   (UINT64)buf_addr, spare);
+    if (vst_write_page(bank, vblock, page_num, sect_offset, num_sectors,
+                       (UINT64)buf_addr, spare))
+        blkmgr_report_prog_fail(bank, vblock, page_num, buf_addr);
 }
 
 void nand_page_program_from_host(UINT32 const bank, UINT32 const vblock, 
                                  UINT32 const page_num)
 {
-    vst_write_page(bank, vblock, page_num, 0, SECTORS_PER_PAGE,
-                   (UINT64)WR_BUF_PTR(g_ftl_write_buf_id), spare); 
+    if (vst_write_page(bank, vblock, page_num, 0, SECTORS_PER_PAGE,
+                       (UINT64)WR_BUF_PTR(g_ftl_write_buf_id), spare))
+        blkmgr_report_prog_fail(bank, vblock, page_num,
+                WR_BUF_PTR(g_ftl_write_buf_id));
     g_ftl_write_buf_id = (g_ftl_write_buf_id + 1) % NUM_WR_BUFFERS;
 }
 
@@ -145,8 +228,10 @@ void nand_page_ptprogram_from_host(UINT32 const bank, UINT32 const vblock,
                                    UINT32 const sect_offset, 
                                    UINT32 const num_sectors)
 {
-    vst_write_page(bank, vblock, page_num, sect_offset, num_sectors,
-                   (UINT64)WR_BUF_PTR(g_ftl_write_buf_id), spare);
+    if (vst_write_page(bank, vblock, page_num, sect_offset, num_sectors,
+                       (UINT64)WR_BUF_PTR(g_ftl_write_buf_id), spare))
+        blkmgr_report_prog_fail(bank, vblock, page_num,
+                WR_BUF_PTR(g_ftl_write_buf_id));
     g_ftl_write_buf_id = (g_ftl_write_buf_id + 1) % NUM_WR_BUFFERS;
 }
 
@@ -154,18 +239,21 @@ void nand_page_copyback(UINT32 const bank,
                         UINT32 const src_vblock, UINT32 const src_page,
                         UINT32 const dst_vblock, UINT32 const dst_page)
 {
-    vst_copyback_page(bank, src_vblock, src_page, 
-                      dst_vblock, dst_page, spare);
+    if (vst_copyback_page(bank, src_vblock, src_page, 
+                          dst_vblock, dst_page, spare))
+        blkmgr_report_cb_fail(bank, src_vblock, src_page, dst_vblock, dst_page);
 }
 
 void nand_block_erase(UINT32 const bank, UINT32 const vblock)
 {
-    vst_erase_block(bank, vblock);
+    if (vst_erase_block(bank, vblock))
+        blkmgr_report_erase_fail(bank, vblock);
 }
 
 void nand_block_erase_sync(UINT32 const bank, UINT32 const vblock)
 {
-    vst_erase_block(bank, vblock);
+    if (vst_erase_block(bank, vblock))
+        blkmgr_report_erase_fail(bank, vblock);
 }
 
 void set_spare(void *spare_src, UINT32 const size)
@@ -271,6 +359,7 @@ BOOL32 _tst_bit_dram(UINT64 const base_addr, UINT32 const bit_offset)
 /* dummy functions */
 UINT32 disable_irq(void)
 {
+    return 0;
 }
 
 void enable_irq(void)
@@ -301,13 +390,20 @@ void led_blink(void)
 {
 }
 
+/* wall time of the simulation, so that the timed stats are not all zero */
+static struct timespec ptimer_begin;
+
 void ptimer_start(void)
 {
+    clock_gettime(CLOCK_MONOTONIC, &ptimer_begin);
 }
 
 UINT32 ptimer_stop(void)
 {
-    return 0;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - ptimer_begin.tv_sec) * 1000000 +
+            (end.tv_nsec - ptimer_begin.tv_nsec) / 1000;
 }
 
 #include <stdarg.h>
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Simulator throughput with logging compiled out, to text and to the ring.
+# Run from vst/ after building ftl.so; vst-jasmine is rebuilt per setting
+# and left built with the default masks. Extra make arguments are taken from
+# MAKEARGS, e.g. MAKEARGS='VST_LDFLAGS=-pthread -ldl -T ld_script -no-pie'.
+
+if [ "$#" -lt 2 ]; then
+    echo "usage: $0 <trace> <ftl.so> [vst-jasmine options]"
+    exit 1
+fi
+
+TRACE=$1
+OBJ=$2
+shift 2
+OPTS="$@"
+N_OPS=$(wc -l < ${TRACE})
+ALL=0x3f
+MK=(make vst-jasmine)
+[ -n "${MAKEARGS}" ] && MK+=("${MAKEARGS}")
+
+bench() {
+    rm -f vst-jasmine
+    "${MK[@]}" LOG_CFLAGS="$2" > /dev/null 2>&1 || exit 1
+    start=$(date +%s.%N)
+    ./vst-jasmine ${TRACE} ${OBJ} -c ${OPTS} > /dev/null 2>&1
+    end=$(date +%s.%N)
+    echo "$1" ${N_OPS} ${start} ${end} | \
+        awk '{ t = $4 - $3; printf "%-8s %8.2f s %12.0f ops/s\n", $1, t, $2 / t }'
+}
+
+bench off  "-DLOG_MASK=0"
+bench text "-DLOG_MASK=${ALL}"
+bench ring "-DLOG_MASK=${ALL} -DLOG_RING_MASK=${ALL}"
+rm -f vst-jasmine
+"${MK[@]}" > /dev/null 2>&1
@@ -0,0 +1,130 @@
+/**
+ * bench-mu.c
+ * Authors: Yun-Sheng Chang
+ */
+
+/*
+ * Check the vectorized memory utility searches against the scalar ones and
+ * time both over buffers of the engine's largest size (MU_MAX_BYTES).
+ * Build with `make bench-mu` from vst/, or MU_CFLAGS=-mavx2 for AVX2.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "vmu.h"
+
+#define MU_MAX_BYTES    32768
+#define N_CHECK         200000
+#define N_ROUND         20000
+
+typedef uint32_t (*search_t)(const void *, uint32_t, uint32_t, uint32_t);
+
+static uint8_t buf[MU_MAX_BYTES] __attribute__((aligned(64)));
+static volatile uint32_t sink;
+
+static uint32_t rnd(void)
+{
+    static uint64_t seed = 88172645463325252ULL;
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static void fill(uint32_t unit, uint32_t size, uint32_t range)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t v = range ? rnd() % range : rnd();
+        memcpy(&buf[i * unit], &v, unit);
+    }
+}
+
+static uint32_t min_(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    return vmu_search_min(p, unit, size);
+}
+
+static uint32_t min_scalar(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    return vmu_search_min_scalar(p, unit, size);
+}
+
+static uint32_t max_(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    return vmu_search_max(p, unit, size);
+}
+
+static uint32_t max_scalar(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    return vmu_search_max_scalar(p, unit, size);
+}
+
+static int check(void)
+{
+    for (int t = 0; t < N_CHECK; t++) {
+        uint32_t unit = 1 << (rnd() % 3);
+        uint32_t size = 1 + rnd() % (rnd() % 2 ? 100 : MU_MAX_BYTES / unit);
+        /* small ranges give repeated values and zeros */
+        uint32_t range = rnd() % 2 ? 1 + rnd() % 8 : 0;
+        uint32_t val = rnd() % 2 ? rnd() % 8 : rnd();
+        uint32_t off = rnd() % 4 * unit;
+
+        if (off + size * unit > MU_MAX_BYTES)
+            size = (MU_MAX_BYTES - off) / unit;
+        fill(unit, MU_MAX_BYTES / unit, range);
+        if (vmu_search_equ(buf + off, unit, size, val) !=
+                vmu_search_equ_scalar(buf + off, unit, size, val) ||
+            vmu_search_min(buf + off, unit, size) !=
+                vmu_search_min_scalar(buf + off, unit, size) ||
+            vmu_search_max(buf + off, unit, size) !=
+                vmu_search_max_scalar(buf + off, unit, size)) {
+            printf("Mismatch: unit %u size %u off %u val %u\n",
+                    unit, size, off, val);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static double bench(search_t f, uint32_t unit)
+{
+    struct timespec begin, end;
+    uint32_t size = MU_MAX_BYTES / unit;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int r = 0; r < N_ROUND; r++)
+        sink += f(buf, unit, size, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - begin.tv_sec) * 1e9 +
+            (end.tv_nsec - begin.tv_nsec)) / N_ROUND;
+}
+
+int main(void)
+{
+    static const char *names[] = {"equ", "min", "max"};
+    search_t vec[] = {vmu_search_equ, min_, max_};
+    search_t scalar[] = {vmu_search_equ_scalar, min_scalar, max_scalar};
+
+    if (check())
+        return 1;
+    printf("Results match the scalar searches (%d cases).\n", N_CHECK);
+    printf("ISA: %s, %d B per search (ns per search)\n", vmu_isa(), MU_MAX_BYTES);
+    printf("%-4s %4s %10s %10s %8s\n", "op", "unit", "scalar", "vector", "speedup");
+    for (uint32_t unit = 1; unit <= 4; unit <<= 1) {
+        /* no zero and no match, so every search scans the whole buffer */
+        for (uint32_t i = 0; i < MU_MAX_BYTES / unit; i++) {
+            uint32_t v = 1 + rnd() % ((unit == 1 ? 0xff : 0xffff) - 1);
+            memcpy(&buf[i * unit], &v, unit);
+        }
+        for (int k = 0; k < 3; k++) {
+            double ts = bench(scalar[k], unit);
+            double tv = bench(vec[k], unit);
+            printf("%-4s %4u %10.0f %10.0f %7.1fx\n", names[k], unit, ts, tv, ts / tv);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# Decode the binary log ring dumped by vst-jasmine (vst.log.bin) to the text
+# format of vst.log. See src/logger.c for the layout.
+
+import re
+import struct
+import sys
+
+PREFIX = ['[General] ', '[IO] ', '[Flash] ', '[RAM] ', '[Misc] ', '[Recovery] ']
+N_ARGS = 7
+ENT = struct.Struct('<BB6xQ%dQ' % N_ARGS)
+CONV = re.compile(r'%([-+ #0-9.]*)(hh|h|ll|l|z)?([diouxXcfegsp%])')
+
+def convert(spec, mod, conv, word):
+    if conv in 'feg':
+        return ('%' + spec + conv) % struct.unpack('<d', struct.pack('<Q', word))[0]
+    if conv == 's':
+        return '<str@0x%x>' % word
+    if conv == 'p':
+        return '0x%x' % word
+    if not mod:
+        word &= 0xffffffff
+    if conv in 'di':
+        bits = 32 if not mod else 64
+        if word >> (bits - 1):
+            word -= 1 << bits
+        conv = 'd'
+    elif conv == 'u':
+        conv = 'd'
+    return ('%' + spec + conv) % word
+
+def format_ent(fmt, args):
+    it = iter(args)
+    def sub(m):
+        if m.group(3) == '%':
+            return '%'
+        return convert(m.group(1), m.group(2), m.group(3), next(it, 0))
+    return CONV.sub(sub, fmt)
+
+def decode(fname, out):
+    with open(fname, 'rb') as f:
+        if f.read(8) != b'VSTLOGR1':
+            sys.exit('%s: not a VST log ring dump' % fname)
+        n_fmts, n_ents = struct.unpack('<IQ', f.read(12))
+        fmts = {}
+        for _ in range(n_fmts):
+            addr, length = struct.unpack('<QI', f.read(12))
+            fmts[addr] = f.read(length).decode('latin-1')
+        for _ in range(n_ents):
+            ent = ENT.unpack(f.read(ENT.size))
+            typ, n, addr, args = ent[0], ent[1], ent[2], ent[3:]
+            prefix = PREFIX[typ] if typ < len(PREFIX) else ''
+            out.write(prefix + format_ent(fmts[addr], args[:n]))
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print('usage: %s <vst.log.bin>' % sys.argv[0])
+        sys.exit(1)
+    decode(sys.argv[1], sys.stdout)
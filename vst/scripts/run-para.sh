@@ -1,23 +1,30 @@
 #!/bin/bash
 
-if [ "$#" -ne 2 ]; then
-    echo "usage: $0 <FTL> <# jobs>"
+if [ "$#" -lt 2 ]; then
+    echo "usage: $0 <FTL> <# jobs> [<FTL> ...]"
+    echo "Further FTLs, e.g. builds of other parameters, run in the same"
+    echo "vst-jasmine process as the first one, which loads each trace once."
     exit 1
 fi
 
 FTL=$1
 JOB=$2
-OBJ="./ftl_${FTL}/ftl.so"
+shift 2
+FTLS="${FTL} $@"
+OBJS=""
+for f in ${FTLS}
+do
+    OBJ="./ftl_${f}/ftl.so"
+    if [ ! -f ${OBJ} ]; then
+        echo "FTL object not exists: ${OBJ}"
+        exit 1
+    fi
+    OBJS="${OBJS} ${OBJ}"
+done
 
-if [ ! -f ${OBJ} ]; then
-    echo "FTL object not exists"
-    exit 1
-fi
-
-OPFILE=./output/${FTL}-para-j${JOB}.out
+OPFILE=./output/${FTLS// /-}-para-j${JOB}.out
 # 1 TB write
 STRESS=1099511627776
 
 rm ${OPFILE}
-parallel --no-notice -j${JOB} "./vst-jasmine {} ${OBJ} -b ${STRESS}" ::: ../traces/*.trace 2>&1 | tee -a ${OPFILE}
-
+parallel --no-notice -j${JOB} "./vst-jasmine {} ${OBJS} -b ${STRESS}" ::: ../traces/*.trace 2>&1 | tee -a ${OPFILE}
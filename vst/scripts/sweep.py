@@ -0,0 +1,112 @@
+#!/usr/bin/python3
+
+# Sweep the FTL tuning knobs over a grid of values and traces, and write one
+# CSV row per point. Knobs are passed through FTL_CONFIG (see port.c), so a
+# single ftl.so serves the whole grid, and parallel runs of a trace share its
+# cache (<trace>.r*w*.vtr). Run from vst/, e.g.
+#   scripts/sweep.py -j 8 -k gc_threshold=60,120 -k cache_bufs_per_bank=16,32 \
+#       ../traces/*.trace > output/sweep.csv
+# Latency percentiles are modeled (see src/stat.c) and are lower bounds of
+# histogram buckets, within about 3%.
+
+import argparse
+import csv
+import itertools
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+STATS = [
+    ('host_read_mb', r'^Total read \(MB\): (\d+)'),
+    ('host_write_mb', r'^Total write \(MB\): (\d+)'),
+    ('flash_read', r'^Total flash read \(pages\): (\d+)'),
+    ('flash_write', r'^Total flash write \(pages\): (\d+)'),
+    ('flash_copyback', r'^Total flash copyback \(pages\): (\d+)'),
+    ('flash_erase', r'^Total flash erase \(blocks\): (\d+)'),
+    ('erase_max', r'^Block erase count: max (\d+)'),
+    ('waf', r'^Write amplification: ([\d.]+)'),
+]
+LAT = re.compile(r'^Modeled (\w+) latency \(us\): p50 (\d+) p99 (\d+) p99\.9 (\d+) max (\d+)')
+LAT_COLS = ['%s_%s_us' % (t, p) for t in ('read', 'write')
+            for p in ('p50', 'p99', 'p999', 'max')]
+
+def parse_knob(spec):
+    name, sep, vals = spec.partition('=')
+    if not sep or not vals:
+        raise argparse.ArgumentTypeError('expected knob=v1,v2,...: ' + spec)
+    return name, vals.split(',')
+
+def parse_output(out):
+    row = {}
+    for l in out.splitlines():
+        for col, pat in STATS:
+            m = re.match(pat, l)
+            if m:
+                row[col] = m.group(1)
+        m = LAT.match(l)
+        if m and m.group(1) in ('read', 'write'):
+            for p, v in zip(('p50', 'p99', 'p999', 'max'), m.groups()[1:]):
+                row['%s_%s_us' % (m.group(1), p)] = v
+    return row
+
+def run_point(args, trace, knobs):
+    env = dict(os.environ)
+    env['FTL_CONFIG'] = ','.join('%s=%s' % kv for kv in knobs)
+    # vst.log is written to the working directory, so each run gets its own
+    wd = tempfile.mkdtemp(prefix='sweep-')
+    cmd = [args.vst, trace, args.ftl, '-b', str(args.bytes)] + args.opts.split()
+    start = time.time()
+    try:
+        p = subprocess.run(cmd, cwd=wd, env=env, stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT, universal_newlines=True)
+    finally:
+        shutil.rmtree(wd, ignore_errors=True)
+    row = parse_output(p.stdout)
+    row['time_s'] = '%.1f' % (time.time() - start)
+    if p.returncode != 0:
+        err = [l for l in p.stdout.splitlines() if l.startswith('FTL_CONFIG')]
+        row['status'] = err[0] if err else 'exit %d' % p.returncode
+    elif 'Pass functional correctness test.' not in p.stdout:
+        row['status'] = 'fail'
+    else:
+        row['status'] = 'ok'
+    return row
+
+def main():
+    ap = argparse.ArgumentParser(description='Sweep FTL knobs over traces.')
+    ap.add_argument('traces', nargs='+')
+    ap.add_argument('-k', dest='knobs', action='append', default=[],
+                    type=parse_knob, help='knob=v1,v2,... (repeatable)')
+    ap.add_argument('-j', dest='jobs', type=int, default=os.cpu_count())
+    # 1 TB write, as run-para.sh
+    ap.add_argument('-b', dest='bytes', type=int, default=1099511627776)
+    ap.add_argument('-f', dest='ftl', default='./ftl.so')
+    ap.add_argument('-x', dest='opts', default='',
+                    help='further vst-jasmine options, e.g. "-f 1000"')
+    ap.add_argument('--vst', default='./vst-jasmine')
+    args = ap.parse_args()
+    args.vst = os.path.abspath(args.vst)
+    args.ftl = os.path.abspath(args.ftl)
+    traces = [os.path.abspath(t) for t in args.traces]
+
+    names = [k for k, _ in args.knobs]
+    grid = list(itertools.product(*[v for _, v in args.knobs]))
+    points = [(t, list(zip(names, vals))) for t in traces for vals in grid]
+
+    wr = csv.writer(sys.stdout)
+    cols = [c for c, _ in STATS] + LAT_COLS + ['time_s', 'status']
+    wr.writerow(['trace'] + names + cols)
+    with ThreadPoolExecutor(max_workers=args.jobs) as ex:
+        rows = ex.map(lambda pt: run_point(args, *pt), points)
+        for (trace, knobs), row in zip(points, rows):
+            wr.writerow([os.path.basename(trace)] + [v for _, v in knobs] +
+                        [row.get(c, '') for c in cols])
+            sys.stdout.flush()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,189 @@
+/**
+ * ftlstate.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include "ftlstate.h"
+
+typedef struct {
+    uint8_t *addr;
+    uint64_t size;
+    /* offsets of the pointers relocated at load time */
+    uint64_t *relocs;
+    uint32_t n_relocs;
+} region_t;
+
+/* .data and .bss */
+#define N_REGIONS 2
+
+static int find_regions(void *handle, region_t *regs);
+static int find_relocs(const Elf64_Shdr *shdrs, int n_shdrs, FILE *fp,
+                       uint64_t vaddr, region_t *reg);
+static void free_regions(region_t *regs);
+
+/**
+ * Locate .data and .bss of the object from its section headers, with the
+ * pointers in them that the loader relocates (e.g., __dso_handle or a table
+ * of pointers to globals). Those point into the object as loaded in this
+ * process, so they are kept as they are on restore.
+ */
+static int find_regions(void *handle, region_t *regs)
+{
+    struct link_map *lm;
+    Elf64_Ehdr ehdr;
+    Elf64_Shdr *shdrs = NULL;
+    char *names = NULL;
+    FILE *fp;
+    int n_found = 0;
+    int ret = 1;
+
+    memset(regs, 0, N_REGIONS * sizeof(region_t));
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &lm)) {
+        fprintf(stderr, "Fail locating the FTL object: %s\n", dlerror());
+        return 1;
+    }
+    fp = fopen(lm->l_name, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Fail opening the FTL object: %s\n", lm->l_name);
+        return 1;
+    }
+    if (fread(&ehdr, sizeof(ehdr), 1, fp) != 1 ||
+            memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+            ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+            ehdr.e_shentsize != sizeof(Elf64_Shdr))
+        goto out;
+
+    shdrs = calloc(ehdr.e_shnum, sizeof(Elf64_Shdr));
+    if (shdrs == NULL || fseek(fp, ehdr.e_shoff, SEEK_SET) ||
+            fread(shdrs, sizeof(Elf64_Shdr), ehdr.e_shnum, fp) != ehdr.e_shnum)
+        goto out;
+    names = malloc(shdrs[ehdr.e_shstrndx].sh_size);
+    if (names == NULL ||
+            fseek(fp, shdrs[ehdr.e_shstrndx].sh_offset, SEEK_SET) ||
+            fread(names, 1, shdrs[ehdr.e_shstrndx].sh_size, fp) !=
+            shdrs[ehdr.e_shstrndx].sh_size)
+        goto out;
+
+    for (int i = 0; i < ehdr.e_shnum; i++) {
+        const char *name = names + shdrs[i].sh_name;
+        int r;
+
+        if (!strcmp(name, ".data"))
+            r = 0;
+        else if (!strcmp(name, ".bss"))
+            r = 1;
+        else
+            continue;
+        regs[r].addr = (uint8_t *)(lm->l_addr + shdrs[i].sh_addr);
+        regs[r].size = shdrs[i].sh_size;
+        if (find_relocs(shdrs, ehdr.e_shnum, fp, shdrs[i].sh_addr, &regs[r]))
+            goto out;
+        n_found++;
+    }
+    if (n_found == N_REGIONS)
+        ret = 0;
+
+out:
+    if (ret) {
+        fprintf(stderr, "Fail reading the sections of the FTL object.\n");
+        free_regions(regs);
+    }
+    free(names);
+    free(shdrs);
+    fclose(fp);
+    return ret;
+}
+
+static int find_relocs(const Elf64_Shdr *shdrs, int n_shdrs, FILE *fp,
+                       uint64_t vaddr, region_t *reg)
+{
+    Elf64_Rela rela;
+    uint64_t *p;
+
+    for (int i = 0; i < n_shdrs; i++) {
+        if (shdrs[i].sh_type != SHT_RELA || !(shdrs[i].sh_flags & SHF_ALLOC))
+            continue;
+        if (fseek(fp, shdrs[i].sh_offset, SEEK_SET))
+            return 1;
+        for (uint64_t j = 0; j < shdrs[i].sh_size / sizeof(rela); j++) {
+            if (fread(&rela, sizeof(rela), 1, fp) != 1)
+                return 1;
+            if (rela.r_offset < vaddr ||
+                    rela.r_offset + sizeof(uint64_t) > vaddr + reg->size)
+                continue;
+            p = realloc(reg->relocs, (reg->n_relocs + 1) * sizeof(uint64_t));
+            if (p == NULL)
+                return 1;
+            reg->relocs = p;
+            reg->relocs[reg->n_relocs++] = rela.r_offset - vaddr;
+        }
+    }
+    return 0;
+}
+
+static void free_regions(region_t *regs)
+{
+    for (int i = 0; i < N_REGIONS; i++) {
+        free(regs[i].relocs);
+        regs[i].relocs = NULL;
+        regs[i].n_relocs = 0;
+    }
+}
+
+int save_ftl_state(void *handle, FILE *fp)
+{
+    region_t regs[N_REGIONS];
+
+    if (find_regions(handle, regs))
+        return 1;
+    for (int i = 0; i < N_REGIONS; i++) {
+        fwrite(&regs[i].size, sizeof(uint64_t), 1, fp);
+        fwrite(regs[i].addr, 1, regs[i].size, fp);
+    }
+    free_regions(regs);
+    return 0;
+}
+
+int load_ftl_state(void *handle, FILE *fp)
+{
+    region_t regs[N_REGIONS];
+    uint64_t size;
+    uint64_t *ptrs;
+    int ret = 1;
+
+    if (find_regions(handle, regs))
+        return 1;
+    for (int i = 0; i < N_REGIONS; i++) {
+        if (fread(&size, sizeof(uint64_t), 1, fp) != 1)
+            goto out;
+        if (size != regs[i].size) {
+            fprintf(stderr, "The snapshot is of another FTL object.\n");
+            goto out;
+        }
+        ptrs = calloc(regs[i].n_relocs + 1, sizeof(uint64_t));
+        if (ptrs == NULL)
+            goto out;
+        for (uint32_t j = 0; j < regs[i].n_relocs; j++)
+            memcpy(&ptrs[j], regs[i].addr + regs[i].relocs[j], sizeof(uint64_t));
+        if (fread(regs[i].addr, 1, size, fp) != size) {
+            free(ptrs);
+            goto out;
+        }
+        for (uint32_t j = 0; j < regs[i].n_relocs; j++)
+            memcpy(regs[i].addr + regs[i].relocs[j], &ptrs[j], sizeof(uint64_t));
+        free(ptrs);
+    }
+    ret = 0;
+
+out:
+    free_regions(regs);
+    return ret;
+}
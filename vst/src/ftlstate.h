@@ -0,0 +1,21 @@
+/**
+ * ftlstate.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef FTLSTATE_H
+#define FTLSTATE_H
+
+#include <stdio.h>
+
+/**
+ * The globals of a loaded FTL object, i.e., its .data and .bss, which
+ * together with the emulated DRAM and flash are the whole state of the FTL.
+ * They are saved and restored as bytes, so the FTL must not set pointers at
+ * run time; those relocated at load time are kept. Both return 1 on failure,
+ * e.g., if the object is not the one the state was saved from.
+ */
+int save_ftl_state(void *handle, FILE *fp);
+int load_ftl_state(void *handle, FILE *fp);
+
+#endif // FTLSTATE_H
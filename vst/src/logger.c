@@ -3,44 +3,71 @@
  * Authors: Yun-Sheng Chang
  */
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/types.h>
 #include "logger.h"
 
+static void dump_ring(void);
+
+/**
+ * A ring record holds the format string by address and its arguments as
+ * 64-bit words, strings by address too. The dump carries the text of every
+ * format string met, so the records are formatted offline.
+ */
+typedef struct {
+    uint8_t type;
+    uint8_t n_args;
+    uint16_t pad[3];
+    uint64_t fmt;
+    uint64_t args[LOG_RING_ARGS];
+} log_ent_t;
+
+#define LOG_RING_MAGIC "VSTLOGR1"
+
 static FILE *fp_log;
-static int loggable[LOG_MAX];
+static const char *fname_log;
+static pid_t pid_log;
+static log_ent_t *ring;
+static uint64_t ring_head;
 
-int open_logger(char *fname)
+int open_logger(const char *fname)
 {
     if (fname != NULL) {
         fp_log = fopen(fname, "w");
         if (fp_log == NULL)
             return 1;
+        fname_log = fname;
     }
+    pid_log = getpid();
 
-    loggable[LOG_GENERAL] = ENABLE_LOG_GENERAL;
-    loggable[LOG_IO] = ENABLE_LOG_IO;
-    loggable[LOG_FLASH] = ENABLE_LOG_FLASH;
-    loggable[LOG_RAM] = ENABLE_LOG_RAM;
-    loggable[LOG_MISC] = ENABLE_LOG_MISC;
-    loggable[LOG_RECOVERY] = ENABLE_LOG_RECOVERY;
-    for (int i = LOG_RECOVERY + 1; i < LOG_MAX; i++)
-        loggable[i] = 0;
-
+    if (LOG_RING_MASK & LOG_MASK) {
+        ring = calloc(LOG_RING_SIZE, sizeof(log_ent_t));
+        if (ring == NULL)
+            return 1;
+        ring_head = 0;
+    }
     return 0;
 }
 
 void close_logger(void)
 {
+    /* forked crash checkers leave the ring to the simulator */
+    if (ring != NULL && getpid() == pid_log)
+        dump_ring();
     if (fp_log != NULL)
         fclose(fp_log);
 }
 
 __attribute__((format(printf, 2, 3)))
-void record(int type, const char *fmt, ...)
+void record_text(int type, const char *fmt, ...)
 {
-    /* TODO: this degrades performance by ~4% */
-    if (!fp_log || !loggable[type])
+    if (!fp_log)
         return;
 
     switch (type) {
@@ -64,8 +91,116 @@ void record(int type, const char *fmt, ...)
         break;
     }
 
-    va_list ap; 
+    va_list ap;
     va_start(ap, fmt);
     vfprintf(fp_log, fmt, ap);
     va_end(ap);
 }
+
+/**
+ * Claim a slot with an atomic increment, so records can be taken from any
+ * thread without a lock, and copy the arguments by the conversions of fmt.
+ */
+__attribute__((format(printf, 2, 3)))
+void record_ring(int type, const char *fmt, ...)
+{
+    if (ring == NULL)
+        return;
+
+    uint64_t pos = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    log_ent_t *ent = &ring[pos & (LOG_RING_SIZE - 1)];
+    int n = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    for (const char *p = fmt; *p != '\0' && n < LOG_RING_ARGS; p++) {
+        if (*p != '%')
+            continue;
+        p++;
+        if (*p == '%')
+            continue;
+        int n_long = 0;
+        while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL)
+            p++;
+        while (*p == 'l' || *p == 'h' || *p == 'z') {
+            if (*p != 'h')
+                n_long++;
+            p++;
+        }
+        switch (*p) {
+        case 'f':
+        case 'e':
+        case 'g': {
+            double d = va_arg(ap, double);
+            memcpy(&ent->args[n++], &d, sizeof(double));
+            break;
+        }
+        case 's':
+        case 'p':
+            ent->args[n++] = (uint64_t)(uintptr_t)va_arg(ap, void *);
+            break;
+        case '\0':
+            p--;
+            break;
+        default:
+            if (n_long)
+                ent->args[n++] = va_arg(ap, unsigned long);
+            else
+                ent->args[n++] = va_arg(ap, unsigned int);
+            break;
+        }
+    }
+    va_end(ap);
+
+    ent->type = type;
+    ent->n_args = n;
+    ent->fmt = (uint64_t)(uintptr_t)fmt;
+}
+
+/**
+ * <log>.bin: the magic, the number of format strings and of records, each
+ * format string as its address, length and text, and then the records from
+ * the oldest on.
+ */
+static void dump_ring(void)
+{
+    char fname[256];
+    uint64_t n_ents, first;
+    uint64_t *fmts;
+    uint32_t n_fmts = 0;
+
+    snprintf(fname, sizeof(fname), "%s.bin",
+            fname_log != NULL ? fname_log : "./vst.log");
+    FILE *fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Fail opening log ring dump: %s\n", fname);
+        return;
+    }
+
+    n_ents = ring_head < LOG_RING_SIZE ? ring_head : LOG_RING_SIZE;
+    first = ring_head - n_ents;
+    fmts = malloc(n_ents * sizeof(uint64_t) + 1);
+    for (uint64_t i = 0; i < n_ents; i++) {
+        uint64_t fmt = ring[(first + i) & (LOG_RING_SIZE - 1)].fmt;
+        uint32_t j;
+        for (j = 0; j < n_fmts && fmts[j] != fmt; j++)
+            ;
+        if (j == n_fmts)
+            fmts[n_fmts++] = fmt;
+    }
+
+    fwrite(LOG_RING_MAGIC, 1, 8, fp);
+    fwrite(&n_fmts, sizeof(uint32_t), 1, fp);
+    fwrite(&n_ents, sizeof(uint64_t), 1, fp);
+    for (uint32_t j = 0; j < n_fmts; j++) {
+        const char *s = (const char *)(uintptr_t)fmts[j];
+        uint32_t len = strlen(s);
+        fwrite(&fmts[j], sizeof(uint64_t), 1, fp);
+        fwrite(&len, sizeof(uint32_t), 1, fp);
+        fwrite(s, 1, len, fp);
+    }
+    for (uint64_t i = 0; i < n_ents; i++)
+        fwrite(&ring[(first + i) & (LOG_RING_SIZE - 1)], sizeof(log_ent_t), 1, fp);
+    fclose(fp);
+    free(fmts);
+}
@@ -21,9 +21,49 @@
 #define ENABLE_LOG_MISC 0
 #define ENABLE_LOG_RECOVERY 1
 
-int open_logger(char *fname);
+/**
+ * Categories are selected at compile time, so a record() of a disabled
+ * category compiles away together with its arguments. Both masks can be
+ * overridden from the command line, e.g. make LOG_CFLAGS="-DLOG_MASK=0x2f".
+ * Categories in LOG_RING_MASK go to an in-memory ring of binary records
+ * instead of the text log; the ring is written to <log>.bin on close and
+ * decoded offline by scripts/decode-log.py.
+ */
+#ifndef LOG_MASK
+#define LOG_MASK ((ENABLE_LOG_GENERAL << LOG_GENERAL) | \
+                  (ENABLE_LOG_IO << LOG_IO) | \
+                  (ENABLE_LOG_FLASH << LOG_FLASH) | \
+                  (ENABLE_LOG_RAM << LOG_RAM) | \
+                  (ENABLE_LOG_MISC << LOG_MISC) | \
+                  (ENABLE_LOG_RECOVERY << LOG_RECOVERY))
+#endif
+#ifndef LOG_RING_MASK
+#define LOG_RING_MASK 0
+#endif
+/* records kept by the ring, a power of 2; the oldest are overwritten */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE (1 << 20)
+#endif
+#define LOG_RING_ARGS 7
+
+#define LOG_ON(TYPE)        ((LOG_MASK >> (TYPE)) & 1)
+#define LOG_IN_RING(TYPE)   ((LOG_RING_MASK >> (TYPE)) & 1)
+
+#define record(TYPE, ...)                       \
+    do {                                        \
+        if (LOG_ON(TYPE)) {                     \
+            if (LOG_IN_RING(TYPE))              \
+                record_ring(TYPE, __VA_ARGS__); \
+            else                                \
+                record_text(TYPE, __VA_ARGS__); \
+        }                                       \
+    } while (0)
+
+int open_logger(const char *fname);
 void close_logger(void);
 __attribute__((format(printf, 2, 3)))
-void record(int type, const char *fmt, ...);
+void record_text(int type, const char *fmt, ...);
+__attribute__((format(printf, 2, 3)))
+void record_ring(int type, const char *fmt, ...);
 
 #endif // LOGGER_H
@@ -5,10 +5,40 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
+#include "config.h"
+#include "stat.h"
+
+/**
+ * VST has no timing model, so request latencies are modeled: a request
+ * takes as long as its busiest bank, which runs the flash operations the
+ * request issued back to back at the nominal times below. Transfers and
+ * queueing behind earlier requests are ignored, so the percentiles are
+ * for comparing configurations only.
+ */
+#define T_READ_US   60
+#define T_PROG_US   1300
+#define T_ERASE_US  1500
+
+/* log-linear histogram of 2^LAT_SUB_BITS buckets per power of two */
+#define LAT_SUB_BITS    5
+#define LAT_BUCKETS     ((32 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+#define N_REQ_TYPES     4
 
 extern int pass;
 static uint64_t byte_read, byte_write;
 static uint64_t cnt_flash_read, cnt_flash_write, cnt_flash_cb, cnt_flash_erase;
+static uint64_t cnt_flash_fail;
+static uint32_t cnt_blk_erase[VST_NUM_BLOCKS];
+static uint32_t busy[VST_NUM_BANKS], busy_max;
+static uint64_t lat_hist[N_REQ_TYPES][LAT_BUCKETS];
+static uint64_t cnt_req[N_REQ_TYPES];
+static uint32_t lat_max[N_REQ_TYPES];
+
+static uint32_t lat_bucket(uint32_t us);
+static uint32_t lat_value(uint32_t idx);
+static uint32_t lat_percentile(uint32_t type, double p);
+static void print_latency(const char *name, uint32_t type);
 
 void inc_byte_read(uint64_t n_byte)
 {
@@ -20,24 +50,60 @@ void inc_byte_write(uint64_t n_byte)
     byte_write += n_byte;
 }
 
-void inc_flash_read(uint64_t n_page)
+void inc_flash_read(uint32_t bank)
+{
+    cnt_flash_read++;
+    inc_busy(bank, T_READ_US);
+}
+
+void inc_flash_write(uint32_t bank)
+{
+    cnt_flash_write++;
+    inc_busy(bank, T_PROG_US);
+}
+
+void inc_flash_cb(uint32_t bank)
+{
+    cnt_flash_cb++;
+    inc_busy(bank, T_READ_US + T_PROG_US);
+}
+
+void inc_flash_erase(uint32_t bank)
+{
+    cnt_flash_erase++;
+    inc_busy(bank, T_ERASE_US);
+}
+
+void inc_flash_fail(uint64_t n_op)
+{
+    cnt_flash_fail += n_op;
+}
+
+void inc_blk_erase(uint32_t bank, uint32_t blk)
 {
-    cnt_flash_read += n_page;
+    cnt_blk_erase[bank * VST_BLOCKS_PER_BANK + blk]++;
 }
 
-void inc_flash_write(uint64_t n_page)
+void inc_busy(uint32_t bank, uint32_t us)
 {
-    cnt_flash_write += n_page;
+    busy[bank] += us;
+    if (busy[bank] > busy_max)
+        busy_max = busy[bank];
 }
 
-void inc_flash_cb(uint64_t n_page)
+void begin_request(void)
 {
-    cnt_flash_cb += n_page;
+    memset(busy, 0, sizeof(busy));
+    busy_max = 0;
 }
 
-void inc_flash_erase(uint64_t n_blk)
+/* type is the rw field of the trace: 0 write, 1 read, 2 trim, 3 flush */
+void end_request(uint32_t type)
 {
-    cnt_flash_erase += n_blk;
+    lat_hist[type][lat_bucket(busy_max)]++;
+    cnt_req[type]++;
+    if (busy_max > lat_max[type])
+        lat_max[type] = busy_max;
 }
 
 uint64_t get_byte_write(void)
@@ -53,11 +119,22 @@ int open_stat(void)
     cnt_flash_write = 0;
     cnt_flash_cb = 0;
     cnt_flash_erase = 0;
+    cnt_flash_fail = 0;
+    memset(cnt_blk_erase, 0, sizeof(cnt_blk_erase));
+    memset(lat_hist, 0, sizeof(lat_hist));
+    memset(cnt_req, 0, sizeof(cnt_req));
+    memset(lat_max, 0, sizeof(lat_max));
+    begin_request();
     return 0;
 }
 
 void close_stat(void)
 {
+    uint32_t erase_max = 0;
+    for (uint32_t i = 0; i < VST_NUM_BLOCKS; i++)
+        if (cnt_blk_erase[i] > erase_max)
+            erase_max = cnt_blk_erase[i];
+
     printf("----------Statistic Results----------\n");
     printf("Total read (MB): %" PRIu64 "\n", byte_read / (1024 * 1024));
     printf("Total write (MB): %" PRIu64 "\n", byte_write / (1024 * 1024));
@@ -65,5 +142,60 @@ void close_stat(void)
     printf("Total flash write (pages): %" PRIu64 "\n", cnt_flash_write);
     printf("Total flash copyback (pages): %" PRIu64 "\n", cnt_flash_cb);
     printf("Total flash erase (blocks): %" PRIu64 "\n", cnt_flash_erase);
+    if (cnt_flash_fail)
+        printf("Injected flash failures: %" PRIu64 "\n", cnt_flash_fail);
+    printf("Block erase count: max %u mean %lf\n", erase_max,
+            (double)cnt_flash_erase / VST_NUM_BLOCKS);
+    if (byte_write)
+        printf("Write amplification: %.3lf\n",
+                (double)(cnt_flash_write + cnt_flash_cb) * VST_BYTES_PER_PAGE /
+                byte_write);
+    print_latency("read", 1);
+    print_latency("write", 0);
+    print_latency("trim", 2);
+    print_latency("flush", 3);
     printf("----------Statistic Results----------\n");
 }
+
+static uint32_t lat_bucket(uint32_t us)
+{
+    uint32_t s;
+
+    if (us < (2u << LAT_SUB_BITS))
+        return us;
+    s = 31 - __builtin_clz(us) - LAT_SUB_BITS;
+    return ((s + 1) << LAT_SUB_BITS) + (us >> s) - (1u << LAT_SUB_BITS);
+}
+
+/* the lower bound of a bucket */
+static uint32_t lat_value(uint32_t idx)
+{
+    uint32_t s;
+
+    if (idx < (2u << LAT_SUB_BITS))
+        return idx;
+    s = (idx >> LAT_SUB_BITS) - 1;
+    return ((idx & ((1u << LAT_SUB_BITS) - 1)) + (1u << LAT_SUB_BITS)) << s;
+}
+
+static uint32_t lat_percentile(uint32_t type, double p)
+{
+    uint64_t rank = (uint64_t)(p * cnt_req[type] + 0.999999);
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i < LAT_BUCKETS; i++) {
+        sum += lat_hist[type][i];
+        if (sum >= rank && sum != 0)
+            return lat_value(i);
+    }
+    return lat_max[type];
+}
+
+static void print_latency(const char *name, uint32_t type)
+{
+    if (!cnt_req[type])
+        return;
+    printf("Modeled %s latency (us): p50 %u p99 %u p99.9 %u max %u\n", name,
+            lat_percentile(type, 0.5), lat_percentile(type, 0.99),
+            lat_percentile(type, 0.999), lat_max[type]);
+}
@@ -8,10 +8,15 @@
 
 void inc_byte_read(uint64_t n_byte);
 void inc_byte_write(uint64_t n_byte);
-void inc_flash_read(uint64_t n_page);
-void inc_flash_write(uint64_t n_page);
-void inc_flash_cb(uint64_t n_page);
-void inc_flash_erase(uint64_t n_blk);
+void inc_flash_read(uint32_t bank);
+void inc_flash_write(uint32_t bank);
+void inc_flash_cb(uint32_t bank);
+void inc_flash_erase(uint32_t bank);
+void inc_flash_fail(uint64_t n_op);
+void inc_blk_erase(uint32_t bank, uint32_t blk);
+void inc_busy(uint32_t bank, uint32_t us);
+void begin_request(void);
+void end_request(uint32_t type);
 uint64_t get_byte_write(void);
 int open_stat(void);
 void close_stat(void);
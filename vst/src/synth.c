@@ -0,0 +1,443 @@
+/**
+ * synth.c
+ * Authors: Yun-Sheng Chang
+ */
+
+/*
+ * Keys of a workload. Sizes are in bytes with an optional k, m or g suffix
+ * and must be multiples of the sector size.
+ *   pattern    seq, uniform, zipf, hotcold or seqmix (default uniform)
+ *   read       percentage of reads (default 0)
+ *   size       request size: a size, a range lo-hi drawn uniformly in
+ *              multiples of lo, or a weighted mix of them such as
+ *              16k:90/64k-1m:10 (default one page)
+ *   footprint  bytes addressed from LBA 0 (default the whole device)
+ *   theta      zipf: skew in (0, 1) (default 0.99)
+ *   hot        hotcold: percentage of the footprint that is hot (default 20)
+ *   hotio      hotcold: percentage of the requests to the hot part (default 80)
+ *   seq        seqmix: percentage of the requests continuing the previous
+ *              one, the rest starting at a random page (default 50)
+ *   fsync      a flush every this many writes, 0 for none (default 0)
+ *   n          requests per pass (default as many as cover the footprint)
+ *   seed       seed of the generator (default 1)
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include "config.h"
+#include "synth.h"
+
+#define MAX_SIZE_CLASSES 8
+
+enum {
+    PAT_SEQ,
+    PAT_UNIFORM,
+    PAT_ZIPF,
+    PAT_HOTCOLD,
+    PAT_SEQMIX,
+    N_PATTERNS
+};
+
+static const char *names_pattern[N_PATTERNS] = {
+    "seq", "uniform", "zipf", "hotcold", "seqmix"
+};
+
+typedef struct {
+    uint32_t lo, hi;            /* sectors */
+    uint32_t weight;
+} size_class_t;
+
+struct synth {
+    char *spec;
+    int pattern;
+    uint32_t pct_read, pct_hot, pct_hotio, pct_seq;
+    size_class_t sizes[MAX_SIZE_CLASSES];
+    uint32_t n_sizes, sum_weight;
+    uint64_t n_pages;           /* footprint */
+    uint32_t fsync;
+    uint64_t n_req, seed;
+    /* zipf over the pages, its ranks scattered over the footprint */
+    double theta, zetan, zeta_half, alpha, eta;
+    uint64_t scatter;
+    /* generator state */
+    uint64_t rng, idx_req, cursor;
+    uint32_t n_write;
+    struct trace_ent rest;      /* what is left of a request cut to the buffers */
+    uint32_t rsize, wsize;
+};
+
+static int parse_key(synth_t *s, const char *key, const char *val);
+static int parse_bytes(const char *str, char **end, uint32_t *n_sect);
+static int parse_sizes(synth_t *s, const char *val);
+static void init_zipf(synth_t *s);
+static uint64_t rnd(synth_t *s);
+static uint64_t rnd_below(synth_t *s, uint64_t n);
+static uint64_t pick_page(synth_t *s);
+static uint32_t pick_size(synth_t *s);
+static uint64_t pick_lba(synth_t *s, uint32_t n_sect);
+static uint64_t gcd(uint64_t a, uint64_t b);
+
+synth_t *open_synth(const char *spec, uint32_t rsize, uint32_t wsize)
+{
+    synth_t *s;
+    char *buf, *tok, *save, *eq;
+    uint64_t n_sects, mean;
+
+    s = calloc(1, sizeof(synth_t));
+    if (s == NULL)
+        return NULL;
+    s->spec = strdup(spec);
+    s->pattern = PAT_UNIFORM;
+    s->pct_hot = 20;
+    s->pct_hotio = 80;
+    s->pct_seq = 50;
+    s->theta = 0.99;
+    s->seed = 1;
+    s->n_pages = (VST_MAX_LBA + 1) / VST_SECTORS_PER_PAGE;
+    s->sizes[0].lo = VST_SECTORS_PER_PAGE;
+    s->sizes[0].hi = VST_SECTORS_PER_PAGE;
+    s->sizes[0].weight = 1;
+    s->n_sizes = 1;
+    s->rsize = rsize;
+    s->wsize = wsize;
+
+    buf = strdup(spec);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save)) {
+        eq = strchr(tok, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "Workload: expected key=value: %s\n", tok);
+            goto fail;
+        }
+        *eq = '\0';
+        if (parse_key(s, tok, eq + 1))
+            goto fail;
+    }
+    free(buf);
+
+    n_sects = s->n_pages * VST_SECTORS_PER_PAGE;
+    mean = 0;
+    s->sum_weight = 0;
+    for (uint32_t i = 0; i < s->n_sizes; i++) {
+        if (s->sizes[i].hi > n_sects) {
+            fprintf(stderr, "Workload: request size exceeds the footprint\n");
+            goto fail_parsed;
+        }
+        mean += (uint64_t)(s->sizes[i].lo + s->sizes[i].hi) / 2 * s->sizes[i].weight;
+        s->sum_weight += s->sizes[i].weight;
+    }
+    if (s->sum_weight == 0) {
+        fprintf(stderr, "Workload: size weights sum to 0\n");
+        goto fail_parsed;
+    }
+    if (s->n_req == 0)
+        s->n_req = (n_sects * s->sum_weight + mean - 1) / mean;
+    if (s->pattern == PAT_ZIPF)
+        init_zipf(s);
+    s->rng = s->seed * 0x9e3779b97f4a7c15ULL + 1;
+    return s;
+
+fail:
+    free(buf);
+fail_parsed:
+    close_synth(s);
+    return NULL;
+}
+
+void close_synth(synth_t *s)
+{
+    if (s == NULL)
+        return;
+    free(s->spec);
+    free(s);
+}
+
+int synth_next(synth_t *s, struct trace_ent *ent)
+{
+    uint32_t size_buf;
+
+    if (s->rest.sec_num == 0) {
+        if (s->fsync && s->n_write == s->fsync) {
+            s->n_write = 0;
+            ent->lba = 0;
+            ent->sec_num = 0;
+            ent->rw = SYNTH_RW_FLUSH;
+            return 1;
+        }
+        if (s->idx_req == s->n_req) {
+            s->idx_req = 0;
+            return 0;
+        }
+        s->idx_req++;
+        s->rest.rw = rnd_below(s, 100) < s->pct_read;
+        s->rest.sec_num = pick_size(s);
+        s->rest.lba = pick_lba(s, s->rest.sec_num);
+        if (s->rest.rw == 0)
+            s->n_write++;
+    }
+
+    size_buf = s->rest.rw == 0 ? s->wsize : s->rsize;
+    *ent = s->rest;
+    if (ent->sec_num > size_buf)
+        ent->sec_num = size_buf;
+    s->rest.lba += ent->sec_num;
+    s->rest.sec_num -= ent->sec_num;
+    return 1;
+}
+
+void print_synth(const synth_t *s)
+{
+    printf("Workload: %s\n", s->spec);
+    printf("Pattern %s, %u%% reads, footprint %" PRIu64 " pages, "
+            "%" PRIu64 " requests per pass\n", names_pattern[s->pattern],
+            s->pct_read, s->n_pages, s->n_req);
+}
+
+static int parse_key(synth_t *s, const char *key, const char *val)
+{
+    char *end;
+    uint32_t n_sect;
+    unsigned long long n;
+
+    if (!strcmp(key, "pattern")) {
+        for (s->pattern = 0; s->pattern < N_PATTERNS; s->pattern++)
+            if (!strcmp(val, names_pattern[s->pattern]))
+                return 0;
+        fprintf(stderr, "Workload: unknown pattern: %s\n", val);
+        return 1;
+    }
+    if (!strcmp(key, "size"))
+        return parse_sizes(s, val);
+    if (!strcmp(key, "footprint")) {
+        if (parse_bytes(val, &end, &n_sect) || *end != '\0' ||
+                n_sect < 2 * VST_SECTORS_PER_PAGE || n_sect > VST_MAX_LBA + 1) {
+            fprintf(stderr, "Workload: footprint must be 2 pages to the device size\n");
+            return 1;
+        }
+        s->n_pages = n_sect / VST_SECTORS_PER_PAGE;
+        return 0;
+    }
+    if (!strcmp(key, "theta")) {
+        s->theta = strtod(val, &end);
+        if (*end != '\0' || !(s->theta > 0 && s->theta < 1)) {
+            fprintf(stderr, "Workload: theta must be in (0, 1)\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    n = strtoull(val, &end, 0);
+    if (val[0] == '\0' || *end != '\0') {
+        fprintf(stderr, "Workload: bad value of %s: %s\n", key, val);
+        return 1;
+    }
+    if (!strcmp(key, "n")) {
+        s->n_req = n;
+    } else if (!strcmp(key, "seed")) {
+        s->seed = n;
+    } else if (!strcmp(key, "fsync")) {
+        s->fsync = n;
+    } else if (!strcmp(key, "read") || !strcmp(key, "hot") ||
+               !strcmp(key, "hotio") || !strcmp(key, "seq")) {
+        if (n > 100) {
+            fprintf(stderr, "Workload: %s is a percentage\n", key);
+            return 1;
+        }
+        if (!strcmp(key, "read"))
+            s->pct_read = n;
+        else if (!strcmp(key, "hot"))
+            s->pct_hot = n;
+        else if (!strcmp(key, "hotio"))
+            s->pct_hotio = n;
+        else
+            s->pct_seq = n;
+    } else {
+        fprintf(stderr, "Workload: unknown key: %s\n", key);
+        return 1;
+    }
+    return 0;
+}
+
+static int parse_bytes(const char *str, char **end, uint32_t *n_sect)
+{
+    unsigned long long n = strtoull(str, end, 10);
+
+    if (*end == str)
+        return 1;
+    switch (**end) {
+    case 'k': case 'K':
+        n <<= 10;
+        (*end)++;
+        break;
+    case 'm': case 'M':
+        n <<= 20;
+        (*end)++;
+        break;
+    case 'g': case 'G':
+        n <<= 30;
+        (*end)++;
+        break;
+    }
+    if (n == 0 || n % VST_BYTES_PER_SECTOR ||
+            n / VST_BYTES_PER_SECTOR > UINT32_MAX)
+        return 1;
+    *n_sect = n / VST_BYTES_PER_SECTOR;
+    return 0;
+}
+
+static int parse_sizes(synth_t *s, const char *val)
+{
+    const char *p = val;
+    char *end;
+    size_class_t *c;
+
+    s->n_sizes = 0;
+    while (1) {
+        if (s->n_sizes == MAX_SIZE_CLASSES)
+            goto bad;
+        c = &s->sizes[s->n_sizes++];
+        if (parse_bytes(p, &end, &c->lo))
+            goto bad;
+        c->hi = c->lo;
+        if (*end == '-' && (parse_bytes(end + 1, &end, &c->hi) || c->hi < c->lo))
+            goto bad;
+        c->weight = 1;
+        if (*end == ':') {
+            p = end + 1;
+            c->weight = strtoul(p, &end, 10);
+            if (end == p)
+                goto bad;
+        }
+        if (*end == '\0')
+            return 0;
+        if (*end != '/')
+            goto bad;
+        p = end + 1;
+    }
+
+bad:
+    fprintf(stderr, "Workload: bad size: %s\n", val);
+    return 1;
+}
+
+/**
+ * Zipf by the method of Gray et al., "Quickly generating billion-record
+ * synthetic databases", which costs one pass over the footprint to set up
+ * and O(1) a request. Rank r goes to page r * scatter mod n_pages, a
+ * bijection, so the hot pages are not all at the start of the footprint.
+ */
+static void init_zipf(synth_t *s)
+{
+    double zeta2 = 1 + pow(0.5, s->theta);
+
+    s->zetan = 0;
+    for (uint64_t i = 1; i <= s->n_pages; i++)
+        s->zetan += pow((double)i, -s->theta);
+    s->zeta_half = zeta2;
+    s->alpha = 1 / (1 - s->theta);
+    s->eta = (1 - pow(2.0 / s->n_pages, 1 - s->theta)) / (1 - zeta2 / s->zetan);
+    s->scatter = 2654435761ULL % s->n_pages;
+    while (gcd(s->scatter, s->n_pages) != 1)
+        s->scatter++;
+}
+
+/* xorshift64* */
+static uint64_t rnd(synth_t *s)
+{
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 2685821657736338717ULL;
+}
+
+static uint64_t rnd_below(synth_t *s, uint64_t n)
+{
+    return rnd(s) % n;
+}
+
+static uint64_t pick_page(synth_t *s)
+{
+    uint64_t n_hot, r;
+    double u, uz;
+
+    switch (s->pattern) {
+    case PAT_ZIPF:
+        u = (rnd(s) >> 11) * (1.0 / 9007199254740992.0);
+        uz = u * s->zetan;
+        if (uz < 1)
+            r = 0;
+        else if (uz < s->zeta_half)
+            r = 1;
+        else
+            r = (uint64_t)(s->n_pages * pow(s->eta * u - s->eta + 1, s->alpha));
+        if (r >= s->n_pages)
+            r = s->n_pages - 1;
+        return r * s->scatter % s->n_pages;
+    case PAT_HOTCOLD:
+        n_hot = s->n_pages * s->pct_hot / 100;
+        if (n_hot == 0)
+            n_hot = 1;
+        if (n_hot == s->n_pages || rnd_below(s, 100) < s->pct_hotio)
+            return rnd_below(s, n_hot);
+        return n_hot + rnd_below(s, s->n_pages - n_hot);
+    default:
+        return rnd_below(s, s->n_pages);
+    }
+}
+
+static uint32_t pick_size(synth_t *s)
+{
+    uint64_t w = rnd_below(s, s->sum_weight);
+    size_class_t *c = s->sizes;
+
+    while (w >= c->weight) {
+        w -= c->weight;
+        c++;
+    }
+    if (c->lo == c->hi)
+        return c->lo;
+    return c->lo + rnd_below(s, (c->hi - c->lo) / c->lo + 1) * c->lo;
+}
+
+/**
+ * A random request starts at a page, or within it at a multiple of its
+ * size if smaller, and is aligned to its size if larger. Sequential
+ * requests wrap around at the end of the footprint.
+ */
+static uint64_t pick_lba(synth_t *s, uint32_t n_sect)
+{
+    uint64_t n_sects = s->n_pages * VST_SECTORS_PER_PAGE;
+    uint64_t lba;
+
+    if (s->pattern == PAT_SEQ ||
+            (s->pattern == PAT_SEQMIX && rnd_below(s, 100) < s->pct_seq)) {
+        lba = s->cursor;
+        if (lba + n_sect > n_sects)
+            lba = 0;
+    } else {
+        lba = pick_page(s) * VST_SECTORS_PER_PAGE;
+        if (n_sect < VST_SECTORS_PER_PAGE)
+            lba += rnd_below(s, VST_SECTORS_PER_PAGE / n_sect) * n_sect;
+        else
+            lba = lba / n_sect * n_sect;
+        if (lba + n_sect > n_sects)
+            lba = n_sects - n_sect;
+    }
+    s->cursor = lba + n_sect;
+    return lba;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
@@ -0,0 +1,29 @@
+/**
+ * synth.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+#include "vst.h"
+
+/* a flush request in the stream of a workload */
+#define SYNTH_RW_FLUSH 3
+
+typedef struct synth synth_t;
+
+/**
+ * Workload generator. A workload is given as a comma-separated list of
+ * key=value, e.g. "pattern=zipf,theta=0.9,read=30,size=4k:90/1m:10,fsync=64"
+ * (see synth.c for the keys), and its requests are generated one at a time
+ * from a seed, cut to the read and write buffer sizes like a trace.
+ */
+synth_t *open_synth(const char *spec, uint32_t rsize, uint32_t wsize);
+void close_synth(synth_t *s);
+/* the next request of this pass, or 0 once the pass is done */
+int synth_next(synth_t *s, struct trace_ent *ent);
+void print_synth(const synth_t *s);
+
+#endif // SYNTH_H
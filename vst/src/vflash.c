@@ -25,11 +25,29 @@ static flash_t *flash_p;
 static int sim_crash;
 static int n_write_erase_ops;
 static int p_write_erase_ops = 100000;
+/* one in rate_fail program/erase operations fails on average, if non-zero */
+static uint32_t rate_fail;
+static uint64_t seed_fail = 1;
 
 /* macro functions */
 #define get_page(bank, blk, page) \
         (flash_p->banks[(bank)].blocks[(blk)].pages[(page)])
 
+/**
+ * The first two blocks hold the bad block tables and are assumed to never
+ * fail. The failures are deterministic across runs.
+ */
+static int inject_fail(uint32_t blk)
+{
+    if (!rate_fail || blk < 2)
+        return 0;
+    seed_fail = seed_fail * 6364136223846793005ULL + 1442695040888963407ULL;
+    if ((seed_fail >> 33) % rate_fail)
+        return 0;
+    inc_flash_fail(1);
+    return 1;
+}
+
 /* public interfaces */
 /* flash memory APIs */
 void vst_read_page(uint32_t bank, uint32_t blk, uint32_t page,
@@ -38,13 +56,13 @@ void vst_read_page(uint32_t bank, uint32_t blk, uint32_t page,
 {
     record(LOG_FLASH, "R: flash(%u, %u, %u, %u, %u) -> mem[0x%lx] + sec[%u]\n",
             bank, blk, page, sect, n_sect, dram_addr, sect);
-    inc_flash_read(1);
 
     assert(bank < VST_NUM_BANKS);
     assert(blk < VST_BLOCKS_PER_BANK);
     assert(page < VST_PAGES_PER_BLOCK);
     /* hardware requirement */
     assert(!(dram_addr % VST_BYTES_PER_SECTOR));
+    inc_flash_read(bank);
 
     flash_page_t *pp = &get_page(bank, blk, page);
 
@@ -53,19 +71,21 @@ void vst_read_page(uint32_t bank, uint32_t blk, uint32_t page,
         memcpy(spare, pp->spare, SPARE_SIZE);
 }
 
-void vst_write_page(uint32_t bank, uint32_t blk, uint32_t page,
-                    uint32_t sect, uint32_t n_sect, uint64_t dram_addr,
-                    uint8_t *spare)
+int vst_write_page(uint32_t bank, uint32_t blk, uint32_t page,
+                   uint32_t sect, uint32_t n_sect, uint64_t dram_addr,
+                   uint8_t *spare)
 {
+    int failed;
+
     record(LOG_FLASH, "W: mem[0x%lx] + sec[%u] -> flash(%u, %u, %u, %u, %u)\n",
             dram_addr, sect, bank, blk, page, sect, n_sect);
-    inc_flash_write(1);
 
     assert(bank < VST_NUM_BANKS);
     assert(blk < VST_BLOCKS_PER_BANK);
     assert(page < VST_PAGES_PER_BLOCK);
     /* hardware requirement */
     assert(!(dram_addr % VST_BYTES_PER_SECTOR));
+    inc_flash_write(bank);
 
     chk_non_seq_write(flash_p, bank, blk, page);
 
@@ -73,29 +93,40 @@ void vst_write_page(uint32_t bank, uint32_t blk, uint32_t page,
 
     flash_page_t *pp = &get_page(bank, blk, page);
     pp->is_erased = 0;
-    vpage_copy(&pp->vpage, vram_vpage_map(dram_addr), sect, n_sect);
-    if (spare != NULL)
-        memcpy(pp->spare, spare, SPARE_SIZE);
+    /* a failed page is programmed with garbage */
+    failed = inject_fail(blk);
+    if (failed) {
+        record(LOG_FLASH, "W failed: flash(%u, %u, %u)\n", bank, blk, page);
+        vpage_free(&pp->vpage);
+        memset(pp->spare, 0xff, SPARE_SIZE);
+    } else {
+        vpage_copy(&pp->vpage, vram_vpage_map(dram_addr), sect, n_sect);
+        if (spare != NULL)
+            memcpy(pp->spare, spare, SPARE_SIZE);
+    }
     n_write_erase_ops++;
     if (sim_crash && n_write_erase_ops == p_write_erase_ops) {
         simulate_crash();
         n_write_erase_ops = 0;
     }
+    return failed;
 }
 
-void vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
-                       uint32_t blk_dst, uint32_t page_dst, uint8_t *spare)
+int vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
+                      uint32_t blk_dst, uint32_t page_dst, uint8_t *spare)
 {
+    int failed;
+
     record(LOG_FLASH, "CB: flash(%u, %u, %u) -> flash(%u, %u, %u)\n",
             bank, blk_src, page_src,
             bank, blk_dst, page_dst);
-    inc_flash_cb(1);
 
     assert(bank < VST_NUM_BANKS);
     assert(blk_src < VST_BLOCKS_PER_BANK);
     assert(page_src < VST_PAGES_PER_BLOCK);
     assert(blk_dst < VST_BLOCKS_PER_BANK);
     assert(page_dst < VST_PAGES_PER_BLOCK);
+    inc_flash_cb(bank);
 
     chk_overwrite(flash_p, bank, blk_dst, page_dst);
 
@@ -103,20 +134,35 @@ void vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
     pp_dst = &get_page(bank, blk_dst, page_dst);
     pp_src = &get_page(bank, blk_src, page_src);
     pp_dst->is_erased = 0;
-    vpage_copy(&pp_dst->vpage, &pp_src->vpage, 0, VST_SECTORS_PER_PAGE);
-    if (spare != NULL)
-        memcpy(pp_dst->spare, spare, SPARE_SIZE);
+    failed = inject_fail(blk_dst);
+    if (failed) {
+        record(LOG_FLASH, "CB failed: flash(%u, %u, %u)\n", bank, blk_dst, page_dst);
+        vpage_free(&pp_dst->vpage);
+        memset(pp_dst->spare, 0xff, SPARE_SIZE);
+    } else {
+        vpage_copy(&pp_dst->vpage, &pp_src->vpage, 0, VST_SECTORS_PER_PAGE);
+        if (spare != NULL)
+            memcpy(pp_dst->spare, spare, SPARE_SIZE);
+    }
     n_write_erase_ops++;
     if (sim_crash && n_write_erase_ops == p_write_erase_ops) {
         simulate_crash();
         n_write_erase_ops = 0;
     }
+    return failed;
 }
 
-void vst_erase_block(uint32_t bank, uint32_t blk)
+/**
+ * A failed erase still erases the block, so that a block the FTL cannot
+ * retire keeps working.
+ */
+int vst_erase_block(uint32_t bank, uint32_t blk)
 {
+    int failed;
+
     record(LOG_FLASH, "E: flash(%u, %u)\n", bank, blk);
-    inc_flash_erase(1);
+    inc_flash_erase(bank);
+    inc_blk_erase(bank, blk);
 
     for (uint32_t i = 0; i < VST_PAGES_PER_BLOCK; i++) {
         flash_page_t *pp;
@@ -125,14 +171,18 @@ void vst_erase_block(uint32_t bank, uint32_t blk)
         vpage_free(&pp->vpage);
         memset(pp->spare, 0xff, SPARE_SIZE);
     }
+    failed = inject_fail(blk);
+    if (failed)
+        record(LOG_FLASH, "E failed: flash(%u, %u)\n", bank, blk);
     n_write_erase_ops++;
     if (sim_crash && n_write_erase_ops == p_write_erase_ops) {
         simulate_crash();
         n_write_erase_ops = 0;
     }
+    return failed;
 }
 
-int open_flash(int crash)
+int open_flash(int crash, uint32_t fail)
 {
     uint32_t i, j, k;
 
@@ -152,6 +202,7 @@ int open_flash(int crash)
         }
     }
     sim_crash = crash;
+    rate_fail = fail;
     record(LOG_FLASH, "Virtual flash initialized\n");
     return 0;
 }
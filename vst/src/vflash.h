@@ -33,14 +33,14 @@ typedef struct {
 void vst_read_page(uint32_t bank, uint32_t blk, uint32_t page, uint32_t sect,
                    uint32_t n_sect, uint64_t dram_addr,
                    uint8_t *spare);
-void vst_write_page(uint32_t bank, uint32_t blk, uint32_t page,
-                    uint32_t sect, uint32_t n_sect, uint64_t dram_addr,
-                    uint8_t *spare);
-void vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
-                       uint32_t blk_dst, uint32_t page_dst, uint8_t *spare);
-void vst_erase_block(uint32_t bank, uint32_t blk);
-
-int open_flash(int crash);
+int vst_write_page(uint32_t bank, uint32_t blk, uint32_t page,
+                   uint32_t sect, uint32_t n_sect, uint64_t dram_addr,
+                   uint8_t *spare);
+int vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
+                      uint32_t blk_dst, uint32_t page_dst, uint8_t *spare);
+int vst_erase_block(uint32_t bank, uint32_t blk);
+
+int open_flash(int crash, uint32_t fail);
 void close_flash(void);
 void serialize_flash(FILE *fp);
 void deserialize_flash(FILE *fp);
@@ -0,0 +1,250 @@
+/**
+ * vmu.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#include <stdint.h>
+#include "vmu.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VMU_VEC     32
+#define VMU_ISA     "avx2"
+typedef __m256i vec_t;
+#define vload(p)    _mm256_loadu_si256((const __m256i *)(p))
+#define vset8(x)    _mm256_set1_epi8((char)(x))
+#define vset16(x)   _mm256_set1_epi16((short)(x))
+#define vset32(x)   _mm256_set1_epi32((int)(x))
+#define veq8        _mm256_cmpeq_epi8
+#define veq16       _mm256_cmpeq_epi16
+#define veq32       _mm256_cmpeq_epi32
+#define vmask(x)    ((uint32_t)_mm256_movemask_epi8(x))
+#define vmin8       _mm256_min_epu8
+#define vmin16      _mm256_min_epu16
+#define vmin32      _mm256_min_epu32
+#define vmax8       _mm256_max_epu8
+#define vmax16      _mm256_max_epu16
+#define vmax32      _mm256_max_epu32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VMU_VEC     16
+#define VMU_ISA     "sse2"
+typedef __m128i vec_t;
+#define vload(p)    _mm_loadu_si128((const __m128i *)(p))
+#define vset8(x)    _mm_set1_epi8((char)(x))
+#define vset16(x)   _mm_set1_epi16((short)(x))
+#define vset32(x)   _mm_set1_epi32((int)(x))
+#define veq8        _mm_cmpeq_epi8
+#define veq16       _mm_cmpeq_epi16
+#define veq32       _mm_cmpeq_epi32
+#define vmask(x)    ((uint32_t)_mm_movemask_epi8(x))
+#define vmin8       _mm_min_epu8
+#define vmax8       _mm_max_epu8
+
+/* SSE2 compares 16 and 32-bit lanes as signed only, so flip the sign bits */
+static inline vec_t vmin16(vec_t a, vec_t b)
+{
+    vec_t bias = _mm_set1_epi16((short)0x8000);
+    return _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(a, bias),
+                                       _mm_xor_si128(b, bias)), bias);
+}
+
+static inline vec_t vmax16(vec_t a, vec_t b)
+{
+    vec_t bias = _mm_set1_epi16((short)0x8000);
+    return _mm_xor_si128(_mm_max_epi16(_mm_xor_si128(a, bias),
+                                       _mm_xor_si128(b, bias)), bias);
+}
+
+static inline vec_t vmin32(vec_t a, vec_t b)
+{
+    vec_t bias = _mm_set1_epi32((int)0x80000000);
+    vec_t gt = _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+    return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
+
+static inline vec_t vmax32(vec_t a, vec_t b)
+{
+    vec_t bias = _mm_set1_epi32((int)0x80000000);
+    vec_t gt = _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+    return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+#else
+#define VMU_ISA     "scalar"
+#endif
+
+#define ITEM(p, unit, i)                            \
+    ((unit) == 1 ? ((const uint8_t *)(p))[i] :      \
+     (unit) == 2 ? ((const uint16_t *)(p))[i] :     \
+                   ((const uint32_t *)(p))[i])
+
+/* the engine compares the low unit bytes of val only */
+#define UNIT_MASK(unit) ((unit) == 4 ? 0xffffffffu : (1u << ((unit) * 8)) - 1)
+
+uint32_t vmu_search_equ_scalar(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    uint32_t i;
+
+    val &= UNIT_MASK(unit);
+    for (i = 0; i < size; i++)
+        if (ITEM(p, unit, i) == val)
+            break;
+    return i;
+}
+
+uint32_t vmu_search_min_scalar(const void *p, uint32_t unit, uint32_t size)
+{
+    uint32_t idx = 0;
+    uint32_t min = ITEM(p, unit, 0);
+
+    for (uint32_t i = 1; i < size && min != 0; i++) {
+        if (ITEM(p, unit, i) < min) {
+            min = ITEM(p, unit, i);
+            idx = i;
+        }
+    }
+    return idx;
+}
+
+uint32_t vmu_search_max_scalar(const void *p, uint32_t unit, uint32_t size)
+{
+    uint32_t idx = 0;
+    uint32_t max = ITEM(p, unit, 0);
+
+    for (uint32_t i = 1; i < size; i++) {
+        if (ITEM(p, unit, i) > max) {
+            max = ITEM(p, unit, i);
+            idx = i;
+        }
+    }
+    return idx;
+}
+
+#ifdef VMU_VEC
+typedef union {
+    vec_t v;
+    uint8_t u8[VMU_VEC];
+    uint16_t u16[VMU_VEC / 2];
+    uint32_t u32[VMU_VEC / 4];
+} lanes_t;
+
+/*
+ * The helpers below are inlined with a constant unit, so the unit checks
+ * fold away and every loop compares a vector of items at a time.
+ */
+static inline __attribute__((always_inline))
+uint32_t vec_equ(const uint8_t *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    uint32_t n = size * unit;
+    uint32_t off, m;
+    vec_t v, x, eq;
+
+    v = unit == 1 ? vset8(val) : unit == 2 ? vset16(val) : vset32(val);
+    for (off = 0; off + VMU_VEC <= n; off += VMU_VEC) {
+        x = vload(p + off);
+        eq = unit == 1 ? veq8(x, v) : unit == 2 ? veq16(x, v) : veq32(x, v);
+        m = vmask(eq);
+        if (m != 0)
+            return (off + __builtin_ctz(m)) / unit;
+    }
+    return off / unit +
+           vmu_search_equ_scalar(p + off, unit, size - off / unit, val);
+}
+
+/* find the minimum or maximum value first, then its first index */
+static inline __attribute__((always_inline))
+uint32_t vec_extreme(const uint8_t *p, uint32_t unit, uint32_t size, int is_max)
+{
+    uint32_t n = size * unit;
+    uint32_t off, ext, x;
+    vec_t acc, y;
+    lanes_t l;
+
+    if (n < VMU_VEC)
+        return is_max ? vmu_search_max_scalar(p, unit, size) :
+                        vmu_search_min_scalar(p, unit, size);
+
+    acc = vload(p);
+    for (off = VMU_VEC; off + VMU_VEC <= n; off += VMU_VEC) {
+        y = vload(p + off);
+        if (is_max)
+            acc = unit == 1 ? vmax8(acc, y) :
+                  unit == 2 ? vmax16(acc, y) : vmax32(acc, y);
+        else
+            acc = unit == 1 ? vmin8(acc, y) :
+                  unit == 2 ? vmin16(acc, y) : vmin32(acc, y);
+    }
+
+    /* fold the lanes and the items past the last vector */
+    l.v = acc;
+    ext = unit == 1 ? l.u8[0] : unit == 2 ? l.u16[0] : l.u32[0];
+    for (uint32_t i = 1; i < VMU_VEC / unit; i++) {
+        x = unit == 1 ? l.u8[i] : unit == 2 ? l.u16[i] : l.u32[i];
+        if (is_max ? x > ext : x < ext)
+            ext = x;
+    }
+    for (uint32_t i = off / unit; i < size; i++) {
+        x = ITEM(p, unit, i);
+        if (is_max ? x > ext : x < ext)
+            ext = x;
+    }
+    return vec_equ(p, unit, size, ext);
+}
+
+uint32_t vmu_search_equ(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    val &= UNIT_MASK(unit);
+    switch (unit) {
+    case 1:
+        return vec_equ(p, 1, size, val);
+    case 2:
+        return vec_equ(p, 2, size, val);
+    default:
+        return vec_equ(p, 4, size, val);
+    }
+}
+
+uint32_t vmu_search_min(const void *p, uint32_t unit, uint32_t size)
+{
+    switch (unit) {
+    case 1:
+        return vec_extreme(p, 1, size, 0);
+    case 2:
+        return vec_extreme(p, 2, size, 0);
+    default:
+        return vec_extreme(p, 4, size, 0);
+    }
+}
+
+uint32_t vmu_search_max(const void *p, uint32_t unit, uint32_t size)
+{
+    switch (unit) {
+    case 1:
+        return vec_extreme(p, 1, size, 1);
+    case 2:
+        return vec_extreme(p, 2, size, 1);
+    default:
+        return vec_extreme(p, 4, size, 1);
+    }
+}
+#else
+uint32_t vmu_search_equ(const void *p, uint32_t unit, uint32_t size, uint32_t val)
+{
+    return vmu_search_equ_scalar(p, unit, size, val);
+}
+
+uint32_t vmu_search_min(const void *p, uint32_t unit, uint32_t size)
+{
+    return vmu_search_min_scalar(p, unit, size);
+}
+
+uint32_t vmu_search_max(const void *p, uint32_t unit, uint32_t size)
+{
+    return vmu_search_max_scalar(p, unit, size);
+}
+#endif // VMU_VEC
+
+const char *vmu_isa(void)
+{
+    return VMU_ISA;
+}
@@ -0,0 +1,25 @@
+/**
+ * vmu.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef VMU_H
+#define VMU_H
+
+#include <stdint.h>
+
+/**
+ * Search engines of the memory utility. Each returns the index of the
+ * first item of unit bytes equal to val, or of the first minimum or
+ * maximum; the equality search returns size if no item matches. The
+ * vectorized versions use AVX2 or SSE2 when built for them.
+ */
+uint32_t vmu_search_equ(const void *p, uint32_t unit, uint32_t size, uint32_t val);
+uint32_t vmu_search_min(const void *p, uint32_t unit, uint32_t size);
+uint32_t vmu_search_max(const void *p, uint32_t unit, uint32_t size);
+uint32_t vmu_search_equ_scalar(const void *p, uint32_t unit, uint32_t size, uint32_t val);
+uint32_t vmu_search_min_scalar(const void *p, uint32_t unit, uint32_t size);
+uint32_t vmu_search_max_scalar(const void *p, uint32_t unit, uint32_t size);
+const char *vmu_isa(void);
+
+#endif // VMU_H
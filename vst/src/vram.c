@@ -12,10 +12,32 @@
 #include "logger.h"
 #include "vram.h"
 #include "vpage.h"
+#include "vmu.h"
 #include "checker.h"
 
-static void replay_to_commit(struct trace_ent *traces, int size_trace,
+static void replay_to_commit(const struct trace_ent *traces, int size_trace,
                              uint32_t epoch_incomplete);
+static void trim_vers(uint32_t lba, uint32_t n_sect);
+static void push_undo(uint32_t lba, uint32_t n_sect, uint32_t *old);
+static int undo_to(uint32_t epoch);
+static void tag_vpage(vpage_t *pp);
+static void untag_at(uint64_t addr);
+static void untag_range(uint64_t addr, uint32_t len);
+static void copy_sects(uint64_t dst, uint64_t src, uint32_t n_sect);
+
+/**
+ * Undo records of the writes and trims since the last flush, so that the
+ * golden versions at a crash are rolled back to the recovered epoch instead
+ * of replaying the trace from the start. A trim keeps the versions it
+ * zeroed; a write is undone by decrementing its sectors.
+ */
+#define UNDO_RING_SIZE  (1 << 20)
+
+typedef struct {
+    uint32_t lba;
+    uint32_t n_sect;
+    uint32_t *old;
+} undo_ent_t;
 
 typedef struct {
     vpage_t *pages;
@@ -23,8 +45,16 @@ typedef struct {
     uint32_t ptr;
 } rw_buf_t;
 
+#define VRAM_PAGES      (VST_DRAM_SIZE / VST_BYTES_PER_PAGE)
+#define VRAM_PAGE(addr) (((addr) - VST_DRAM_BASE) / VST_BYTES_PER_PAGE)
+
+/**
+ * A page whose bit in may_tag is clear is untagged, so untagging a range
+ * only visits the pages of the set bits, 64 pages per word.
+ */
 typedef struct {
-    vpage_t pages[VST_DRAM_SIZE / VST_BYTES_PER_PAGE];
+    vpage_t pages[VRAM_PAGES];
+    uint64_t may_tag[(VRAM_PAGES + 63) / 64];
 } ram_t;
 
 /* emulated DRAM */
@@ -33,6 +63,10 @@ static ram_t vram;
 static rw_buf_t rbuf, wbuf;
 static uint32_t *vers;
 static uint32_t *vers_rec;
+static undo_ent_t *undo;
+/* epochs applied to vers, of which the last n_undo can be undone */
+static uint32_t epoch_vers;
+static uint32_t n_undo;
 
 /* RAM APIs */
 uint8_t vst_read_dram_8(uint64_t addr)
@@ -56,8 +90,7 @@ uint32_t vst_read_dram_32(uint64_t addr)
 
 void vst_write_dram_8(uint64_t addr, uint8_t val)
 {
-    vpage_t *pp = vram_vpage_map(addr);
-    untag_page(pp);
+    untag_at(addr);
     *(uint8_t *)addr = val;
 }
 
@@ -65,8 +98,7 @@ void vst_write_dram_16(uint64_t addr, uint16_t val)
 {
     assert(!(addr & 1));
 
-    vpage_t *pp = vram_vpage_map(addr);
-    untag_page(pp);
+    untag_at(addr);
     *(uint16_t *)addr = val;
 }
 
@@ -74,8 +106,7 @@ void vst_write_dram_32(uint64_t addr, uint32_t val)
 {
     assert(!(addr & 3));
 
-    vpage_t *pp = vram_vpage_map(addr);
-    untag_page(pp);
+    untag_at(addr);
     *(uint32_t *)addr = val;
 }
 
@@ -84,8 +115,7 @@ void vst_set_bit_dram(uint64_t base_addr, uint32_t bit_offset)
     uint64_t addr = base_addr + bit_offset / 8;
     uint32_t offset = bit_offset % 8;
 
-    vpage_t *pp = vram_vpage_map(base_addr);
-    untag_page(pp);
+    untag_at(base_addr);
     *(uint8_t *)addr = *(uint8_t *)addr | (1 << offset);
 }
 
@@ -94,8 +124,7 @@ void vst_clr_bit_dram(uint64_t base_addr, uint32_t bit_offset)
     uint64_t addr = base_addr + bit_offset / 8;
     uint32_t offset = bit_offset % 8;
 
-    vpage_t *pp = vram_vpage_map(base_addr);
-    untag_page(pp);
+    untag_at(base_addr);
     *(uint8_t *)addr = *(uint8_t *)addr & ~(1 << offset);
 }
 
@@ -116,13 +145,9 @@ void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
     pp_src = vram_vpage_map(src);
     if (pp_src == NULL) {
         /* sram -> sram/dram */
-        if (pp_dst != NULL) {
+        if (pp_dst != NULL)
             /* sram -> dram */
-            vpage_t *pp_dst_end;
-            pp_dst_end = vram_vpage_map(dst + len);
-            for (vpage_t *pp = pp_dst; pp <= pp_dst_end; pp++)
-                untag_page(pp);
-        }
+            untag_range(dst, len);
         memcpy((void *)dst, (void *)src, len);
     } else {
         /* dram -> sram/dram */
@@ -135,15 +160,10 @@ void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
                 record(LOG_RAM, "Try to move tagged DRAM data to SRAM\n");
         } else {
             /* dram -> dram */
-            vpage_t *pp_dst_end;
-            pp_dst_end = vram_vpage_map(dst + len);
             if (!pp_src->tagged) {
-                for (vpage_t *pp = pp_dst; pp <= pp_dst_end; pp++)
-                    untag_page(pp);
+                untag_range(dst, len);
                 memcpy((void *)dst, (void *)src, len);
             } else {
-                for (vpage_t *pp = pp_dst; pp <= pp_dst_end; pp++)
-                    tag_page(pp);
                 record(LOG_RAM, "Tagged data movement\n");
                 /* only support sector-aligned tagged data copy */
                 if (dst % VST_BYTES_PER_SECTOR != 0 ||
@@ -151,25 +171,7 @@ void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
                         len % VST_BYTES_PER_SECTOR != 0) {
                     abort();
                 }
-                int x, y, n_sect;
-                x = dst % VST_BYTES_PER_PAGE / VST_BYTES_PER_SECTOR;
-                y = src % VST_BYTES_PER_PAGE / VST_BYTES_PER_SECTOR;
-                n_sect = len / VST_BYTES_PER_SECTOR;
-                for (int i = 0; i < n_sect; i++) {
-                    record(LOG_RAM, "\tmem[%p] + sec[%d] -> mem[%p] + sec[%d], lba = %u\n",
-                            pp_src->data, y, pp_dst->data, x, pp_src->sects[y].lba);
-                    pp_dst->sects[x] = pp_src->sects[y];
-                    x++;
-                    y++;
-                    if (x == VST_SECTORS_PER_PAGE) {
-                        x = 0;
-                        pp_dst++;
-                    }
-                    if (y == VST_SECTORS_PER_PAGE) {
-                        y = 0;
-                        pp_src++;
-                    }
-                }
+                copy_sects(dst, src, len / VST_BYTES_PER_SECTOR);
             }
         }
     }
@@ -179,113 +181,41 @@ void vst_memset(uint64_t addr, uint32_t val, uint32_t len)
 {
     record(LOG_RAM, "memset: mem[0x%lx] of len %u\n", addr, len);
 
-    vpage_t *pp_tgt;
-    pp_tgt = vram_vpage_map(addr);
-    if (pp_tgt != NULL) {
-        vpage_t *pp_tgt_end;
-        pp_tgt_end = vram_vpage_map(addr + len);
-        assert(pp_tgt_end);
-        for (vpage_t *pp = pp_tgt; pp <= pp_tgt_end; pp++)
-            untag_page(pp);
-    }
+    if (vram_vpage_map(addr) != NULL)
+        untag_range(addr, len);
     memset((void *)addr, val, len);
 }
 
+/* the memory utility search engines, as in target_spw/mem_util.c */
 uint32_t vst_mem_search_min(uint64_t addr, uint32_t unit, uint32_t size)
 {
     assert(unit == 1 || unit == 2 || unit == 4);
     assert(!(addr % unit));
     assert(size != 0);
 
-    uint32_t i;
-    uint32_t idx = 0;
-    if (unit == 1) {
-        uint8_t *vals = (uint8_t *)addr;
-        uint8_t min = vals[0];
-        if (min == 0)
-            return idx;
-        for (i = 1; i < size; i++) {
-            if (vals[i] < min) {
-                min = vals[i];
-                idx = i;
-                if (min == 0)
-                    return idx;
-            }
-        }
-    } else if (unit == 2) {
-        uint16_t *vals = (uint16_t *)addr;
-        uint16_t min = vals[0];
-        if (min == 0)
-            return idx;
-        for (i = 1; i < size; i++) {
-            if (vals[i] < min) {
-                min = vals[i];
-                idx = i;
-                if (min == 0)
-                    return idx;
-            }
-        }
-    } else {
-        uint32_t *vals = (uint32_t *)addr;
-        uint32_t min = vals[0];
-        if (min == 0)
-            return idx;
-        for (i = 1; i < size; i++) {
-            if (vals[i] < min) {
-                min = vals[i];
-                idx = i;
-                if (min == 0)
-                    return idx;
-            }
-        }
-    }
-    return idx;
+    return vmu_search_min((const void *)addr, unit, size);
 }
 
 uint32_t vst_mem_search_max(uint64_t addr, uint32_t unit, uint32_t size)
 {
-    assert(!(addr % size));
     assert(unit == 1 || unit == 2 || unit == 4);
+    assert(!(addr % unit));
     assert(size != 0);
 
-    uint32_t i;
-    uint32_t idx = 0;
-    if (unit == 1) {
-        uint8_t *vals = (uint8_t *)addr;
-        uint8_t max = vals[0];
-        for (i = 1; i < size; i++) {
-            if (vals[i] > max) {
-                max = vals[i];
-                idx = i;
-            }
-        }
-    } else if (unit == 2) {
-        uint16_t *vals = (uint16_t *)addr;
-        uint16_t max = vals[0];
-        for (i = 1; i < size; i++) {
-            if (vals[i] > max) {
-                max = vals[i];
-                idx = i;
-            }
-        }
-    } else {
-        uint32_t *vals = (uint32_t *)addr;
-        uint32_t max = vals[0];
-        for (i = 1; i < size; i++) {
-            if (vals[i] > max) {
-                max = vals[i];
-                idx = i;
-            }
-        }
-    }
-    return idx;
+    return vmu_search_max((const void *)addr, unit, size);
 }
 
+/* the index of the first item equal to val, or size if none is */
 uint32_t vst_mem_search_equ(uint64_t addr, uint32_t unit,
                             uint32_t size, uint32_t val)
 {
-    //TODO
-    return 0;
+    assert(unit == 1 || unit == 2 || unit == 4);
+    assert(!(addr % unit));
+
+    /* the engine reports 1 on an empty search */
+    if (size == 0)
+        return 1;
+    return vmu_search_equ((const void *)addr, unit, size, val);
 }
 
 uint32_t vst_get_rbuf_ptr(void)
@@ -302,7 +232,8 @@ int open_ram(uint64_t raddr, uint32_t rsize, uint64_t waddr, uint32_t wsize)
 {
     memset(dram, 0, VST_DRAM_SIZE);
 
-    for (int i = 0; i < VST_DRAM_SIZE / VST_BYTES_PER_PAGE; i++) {
+    memset(vram.may_tag, 0, sizeof(vram.may_tag));
+    for (int i = 0; i < VRAM_PAGES; i++) {
         vram.pages[i].tagged = 0;
         vram.pages[i].data =
                 (uint8_t *)(uint64_t)(VST_DRAM_BASE + i * VST_BYTES_PER_PAGE);
@@ -323,12 +254,15 @@ int open_ram(uint64_t raddr, uint32_t rsize, uint64_t waddr, uint32_t wsize)
     wbuf.ptr = 0;
     record(LOG_RAM, "Write buffer @ %lx of size %u\n", waddr, wsize);
 
-    vers = calloc(VST_MAX_LBA, sizeof(uint32_t));
-    vers_rec = calloc(VST_MAX_LBA, sizeof(uint32_t));
-    if (vers == NULL || vers_rec == NULL) {
+    vers = calloc(VST_MAX_LBA + 1, sizeof(uint32_t));
+    vers_rec = calloc(VST_MAX_LBA + 1, sizeof(uint32_t));
+    undo = calloc(UNDO_RING_SIZE, sizeof(undo_ent_t));
+    if (vers == NULL || vers_rec == NULL || undo == NULL) {
         fprintf(stderr, "Fail allocating memory for vers and vers_rec.\n");
         return 1;
     }
+    epoch_vers = 0;
+    n_undo = 0;
 
     record(LOG_RAM, "Virtual RAM initialized\n");
     return 0;
@@ -336,6 +270,7 @@ int open_ram(uint64_t raddr, uint32_t rsize, uint64_t waddr, uint32_t wsize)
 
 void close_ram(void)
 {
+    commit_versions();
 }
 
 void reset_rwbuf_ptr(void)
@@ -349,6 +284,7 @@ void send_to_wbuf(uint32_t lba, uint32_t n_sect)
 {
     uint32_t l, r, m, s;
 
+    push_undo(lba, n_sect, NULL);
     l = lba;
     r = n_sect;
     s = lba % VST_SECTORS_PER_PAGE;
@@ -358,7 +294,7 @@ void send_to_wbuf(uint32_t lba, uint32_t n_sect)
         else
             m = VST_SECTORS_PER_PAGE - s;
 
-        tag_page(&wbuf.pages[wbuf.ptr]);
+        tag_vpage(&wbuf.pages[wbuf.ptr]);
         for (uint32_t i = 0; i < m; i++) {
             /* fill in lba */
             vers[l + i]++;
@@ -373,6 +309,57 @@ void send_to_wbuf(uint32_t lba, uint32_t n_sect)
     }
 }
 
+/**
+ * Put the DSM TRIM payload for [lba, lba + n_sect) in the write buffer, from
+ * which the FTL reads it like the data of a write.
+ */
+void send_trim_to_wbuf(uint32_t lba, uint32_t n_sect)
+{
+    uint32_t n_pages, ents_per_page, l, r, m;
+
+    n_pages = (VST_TRIM_PAYLOAD_SECTS(n_sect) + VST_SECTORS_PER_PAGE - 1) /
+            VST_SECTORS_PER_PAGE;
+    ents_per_page = VST_TRIM_RANGES_PER_SECTOR * VST_SECTORS_PER_PAGE;
+    for (uint32_t i = 0; i < n_pages; i++) {
+        vpage_t *pp = &wbuf.pages[(wbuf.ptr + i) % wbuf.size];
+        untag_page(pp);
+        memset(pp->data, 0, VST_BYTES_PER_PAGE);
+    }
+
+    l = lba;
+    r = n_sect;
+    for (uint32_t i = 0; r > 0; i++) {
+        vpage_t *pp = &wbuf.pages[(wbuf.ptr + i / ents_per_page) % wbuf.size];
+        uint32_t *ent = (uint32_t *)(pp->data + (i % ents_per_page) * 8);
+        m = MIN(r, VST_TRIM_SECTS_PER_RANGE);
+        ent[0] = l;
+        ent[1] = m << 16;
+        l += m;
+        r -= m;
+    }
+    wbuf.ptr = (wbuf.ptr + n_pages) % wbuf.size;
+
+    l = (lba + VST_SECTORS_PER_PAGE - 1) / VST_SECTORS_PER_PAGE * VST_SECTORS_PER_PAGE;
+    r = MIN((lba + n_sect) / VST_SECTORS_PER_PAGE * VST_SECTORS_PER_PAGE,
+            VST_MAX_LBA + 1);
+    if (l < r) {
+        uint32_t *old = malloc((r - l) * sizeof(uint32_t));
+        assert(old != NULL);
+        memcpy(old, &vers[l], (r - l) * sizeof(uint32_t));
+        push_undo(l, r - l, old);
+    } else {
+        push_undo(l, 0, NULL);
+    }
+    trim_vers(lba, n_sect);
+}
+
+/* the versions so far are durable and need not be undone any more */
+void commit_versions(void)
+{
+    for (; n_undo > 0; n_undo--)
+        free(undo[(epoch_vers - n_undo) % UNDO_RING_SIZE].old);
+}
+
 void recv_from_rbuf(uint32_t lba, uint32_t n_sect)
 {
     uint32_t l, r, m, s;
@@ -396,24 +383,35 @@ void recv_from_rbuf(uint32_t lba, uint32_t n_sect)
     }
 }
 
-void keep_version(uint32_t lba)
+/* keep the versions of n_sect sectors read back within one page */
+void keep_version(uint32_t lba, uint32_t n_sect)
 {
     uint32_t lba_rec, ver_rec;
-    lba_rec = rbuf.pages[rbuf.ptr].sects[lba % VST_SECTORS_PER_PAGE].lba;
-    ver_rec = rbuf.pages[rbuf.ptr].sects[lba % VST_SECTORS_PER_PAGE].ver;
-    if (!rbuf.pages[rbuf.ptr].tagged || lba != lba_rec)
-        ver_rec = 0;
-    vers_rec[lba] = ver_rec;
+    vpage_t *pp = &rbuf.pages[rbuf.ptr];
+
+    assert(lba % VST_SECTORS_PER_PAGE + n_sect <= VST_SECTORS_PER_PAGE);
+    for (uint32_t i = 0; i < n_sect; i++, lba++) {
+        lba_rec = pp->sects[lba % VST_SECTORS_PER_PAGE].lba;
+        ver_rec = pp->sects[lba % VST_SECTORS_PER_PAGE].ver;
+        if (!pp->tagged || lba != lba_rec)
+            ver_rec = 0;
+        vers_rec[lba] = ver_rec;
+    }
     rbuf.ptr = (rbuf.ptr + 1) % rbuf.size;
 }
 
-int check_prefix(struct trace_ent *traces, int size_trace, uint32_t epoch_incomplete)
+int check_prefix(const struct trace_ent *traces, int size_trace, uint32_t epoch_incomplete)
 {
     record(LOG_RECOVERY, "Start checking prefix semantics.\n");
-    replay_to_commit(traces, size_trace, epoch_incomplete);
+    if (undo_to(epoch_incomplete))
+        replay_to_commit(traces, size_trace, epoch_incomplete);
 
     int ret = 0;
-    for (int i = 0; i < VST_MAX_LBA; i++) {
+    if (!memcmp(vers_rec, vers, (VST_MAX_LBA + 1) * sizeof(uint32_t))) {
+        record(LOG_RECOVERY, "Done checking prefix semantics.\n");
+        return 0;
+    }
+    for (int i = 0; i <= VST_MAX_LBA; i++) {
         if (vers_rec[i] != vers[i]) {
             record(LOG_RECOVERY, "[recovery = %u, golden = %u] @ lba %d.\n",
                     vers_rec[i], vers[i], i);
@@ -442,37 +440,146 @@ void serialize_version(char *fname)
         fprintf(stderr, "Fail opening version file: %s\n", fname);
         return;
     }
-    for (uint32_t lba = 0; lba < VST_MAX_LBA; lba++)
+    for (uint32_t lba = 0; lba <= VST_MAX_LBA; lba++)
         fprintf(fp, "%u\n", vers[lba]);
     fclose(fp);
 }
 
+/**
+ * The DRAM of a snapshot, with the tags of its pages, the buffer pointers
+ * and the versions, in binary. The data pointers of the pages are fixed, so
+ * only the tags and sectors are kept.
+ */
+void save_ram(FILE *fp)
+{
+    fwrite(dram, 1, VST_DRAM_SIZE, fp);
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        fwrite(&vram.pages[i].tagged, sizeof(int), 1, fp);
+        fwrite(vram.pages[i].sects, sizeof(vsector_t), VST_SECTORS_PER_PAGE, fp);
+    }
+    fwrite(vram.may_tag, sizeof(vram.may_tag), 1, fp);
+    fwrite(&rbuf.ptr, sizeof(uint32_t), 1, fp);
+    fwrite(&wbuf.ptr, sizeof(uint32_t), 1, fp);
+    fwrite(vers, sizeof(uint32_t), VST_MAX_LBA + 1, fp);
+}
+
+int load_ram(FILE *fp)
+{
+    if (fread(dram, 1, VST_DRAM_SIZE, fp) != VST_DRAM_SIZE)
+        return 1;
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        if (fread(&vram.pages[i].tagged, sizeof(int), 1, fp) != 1 ||
+                fread(vram.pages[i].sects, sizeof(vsector_t),
+                      VST_SECTORS_PER_PAGE, fp) != VST_SECTORS_PER_PAGE)
+            return 1;
+    }
+    if (fread(vram.may_tag, sizeof(vram.may_tag), 1, fp) != 1 ||
+            fread(&rbuf.ptr, sizeof(uint32_t), 1, fp) != 1 ||
+            fread(&wbuf.ptr, sizeof(uint32_t), 1, fp) != 1)
+        return 1;
+    return fread(vers, sizeof(uint32_t), VST_MAX_LBA + 1, fp) != VST_MAX_LBA + 1;
+}
+
+/* the caller may tag the page, so it is marked as possibly tagged */
 vpage_t *vram_vpage_map(uint64_t dram_addr)
 {
     if (dram_addr >= VST_DRAM_BASE &&
         dram_addr < VST_DRAM_BASE + VST_DRAM_SIZE) {
-        return &vram.pages[(dram_addr - VST_DRAM_BASE) / VST_BYTES_PER_PAGE];
+        uint32_t i = VRAM_PAGE(dram_addr);
+        vram.may_tag[i / 64] |= 1ULL << (i % 64);
+        return &vram.pages[i];
     }
     return NULL;
 }
 
-static void replay_to_commit(struct trace_ent *traces, int size_trace,
+static void tag_vpage(vpage_t *pp)
+{
+    uint32_t i = pp - vram.pages;
+
+    tag_page(pp);
+    vram.may_tag[i / 64] |= 1ULL << (i % 64);
+}
+
+static void untag_at(uint64_t addr)
+{
+    uint32_t i = VRAM_PAGE(addr);
+
+    vram.pages[i].tagged = 0;
+    vram.may_tag[i / 64] &= ~(1ULL << (i % 64));
+}
+
+/* untag the pages overlapping [addr, addr + len) */
+static void untag_range(uint64_t addr, uint32_t len)
+{
+    uint32_t first, last;
+    uint64_t mask, bits;
+
+    if (len == 0)
+        return;
+    assert(addr + len <= VST_DRAM_BASE + VST_DRAM_SIZE);
+    first = VRAM_PAGE(addr);
+    last = VRAM_PAGE(addr + len - 1);
+    for (uint32_t w = first / 64; w <= last / 64; w++) {
+        mask = ~0ULL;
+        if (w == first / 64)
+            mask &= ~0ULL << (first % 64);
+        if (w == last / 64)
+            mask &= ~0ULL >> (63 - last % 64);
+        bits = vram.may_tag[w] & mask;
+        vram.may_tag[w] &= ~mask;
+        for (; bits != 0; bits &= bits - 1)
+            vram.pages[w * 64 + __builtin_ctzll(bits)].tagged = 0;
+    }
+}
+
+/* move the sector tags of a tagged copy a run within a page at a time */
+static void copy_sects(uint64_t dst, uint64_t src, uint32_t n_sect)
+{
+    vpage_t *pp_dst, *pp_src;
+    uint32_t x, y, m;
+
+    pp_dst = &vram.pages[VRAM_PAGE(dst)];
+    pp_src = &vram.pages[VRAM_PAGE(src)];
+    x = dst % VST_BYTES_PER_PAGE / VST_BYTES_PER_SECTOR;
+    y = src % VST_BYTES_PER_PAGE / VST_BYTES_PER_SECTOR;
+    while (n_sect > 0) {
+        m = MIN(n_sect, VST_SECTORS_PER_PAGE - MAX(x, y));
+        record(LOG_RAM, "\tmem[%p] + sec[%u] -> mem[%p] + sec[%u] of %u sectors, lba = %u\n",
+                pp_src->data, y, pp_dst->data, x, m, pp_src->sects[y].lba);
+        /* a page copied whole needs no reset of its other sectors */
+        if (m == VST_SECTORS_PER_PAGE)
+            pp_dst->tagged = 1;
+        tag_vpage(pp_dst);
+        memmove(&pp_dst->sects[x], &pp_src->sects[y], m * sizeof(vsector_t));
+        x += m;
+        y += m;
+        n_sect -= m;
+        if (x == VST_SECTORS_PER_PAGE) {
+            x = 0;
+            pp_dst++;
+        }
+        if (y == VST_SECTORS_PER_PAGE) {
+            y = 0;
+            pp_src++;
+        }
+    }
+}
+
+static void replay_to_commit(const struct trace_ent *traces, int size_trace,
                              uint32_t epoch_incomplete)
 {
     uint32_t lba, sec_num, rw;
     uint32_t epoch = 0;
     int trace_cnt = 0;
-    memset(vers, 0, VST_MAX_LBA * sizeof(uint32_t));
+    memset(vers, 0, (VST_MAX_LBA + 1) * sizeof(uint32_t));
     while (1) {
         for (int i = 0; i < size_trace; i++) {
             lba = traces[i].lba;
             sec_num = traces[i].sec_num;
             rw = traces[i].rw;
             lba += (trace_cnt * 1024); // offset
-            if (lba > VST_MAX_LBA) {
+            if (lba > VST_MAX_LBA)
                 lba %= (VST_MAX_LBA + 1);
-                traces[i].lba = lba;
-            }
             if (lba + sec_num > VST_MAX_LBA + 1)
                 sec_num = VST_MAX_LBA + 1 - lba;
             if (rw == 0) {
@@ -481,8 +588,68 @@ static void replay_to_commit(struct trace_ent *traces, int size_trace,
                 epoch++;
                 if (epoch == epoch_incomplete)
                     return;
+            } else if (rw == 2) {
+                /* a trim takes an epoch like a write */
+                trim_vers(lba, sec_num);
+                epoch++;
+                if (epoch == epoch_incomplete)
+                    return;
             }
         }
         trace_cnt++;
     }
 }
+
+/* only whole pages are unmapped, and they read as never written */
+static void trim_vers(uint32_t lba, uint32_t n_sect)
+{
+    uint32_t l, l_end;
+
+    l = (lba + VST_SECTORS_PER_PAGE - 1) / VST_SECTORS_PER_PAGE * VST_SECTORS_PER_PAGE;
+    l_end = MIN((lba + n_sect) / VST_SECTORS_PER_PAGE * VST_SECTORS_PER_PAGE,
+            VST_MAX_LBA + 1);
+    for (; l < l_end; l++)
+        vers[l] = 0;
+}
+
+static void push_undo(uint32_t lba, uint32_t n_sect, uint32_t *old)
+{
+    undo_ent_t *ent = &undo[epoch_vers % UNDO_RING_SIZE];
+
+    /* the oldest record is dropped when the ring is full */
+    if (n_undo == UNDO_RING_SIZE) {
+        free(ent->old);
+        n_undo--;
+    }
+    ent->lba = lba;
+    ent->n_sect = n_sect;
+    ent->old = old;
+    epoch_vers++;
+    n_undo++;
+}
+
+/**
+ * Roll the versions back to just before the write of the given epoch.
+ * Returns nonzero if the epoch is out of reach of the undo records, in
+ * which case the versions are left as they were.
+ */
+static int undo_to(uint32_t epoch)
+{
+    if (epoch > epoch_vers || epoch < epoch_vers - n_undo)
+        return 1;
+
+    while (epoch_vers > epoch) {
+        epoch_vers--;
+        n_undo--;
+        undo_ent_t *ent = &undo[epoch_vers % UNDO_RING_SIZE];
+        if (ent->old != NULL) {
+            memcpy(&vers[ent->lba], ent->old, ent->n_sect * sizeof(uint32_t));
+            free(ent->old);
+            ent->old = NULL;
+        } else if (ent->n_sect != 0) {
+            for (uint32_t i = 0; i < ent->n_sect; i++)
+                vers[ent->lba + i]--;
+        }
+    }
+    return 0;
+}
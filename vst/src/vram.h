@@ -34,11 +34,15 @@ int open_ram(uint64_t raddr, uint32_t rsize, uint64_t waddr, uint32_t wsize);
 void close_ram(void);
 void reset_rwbuf_ptr(void);
 void send_to_wbuf(uint32_t lba, uint32_t n_sect);
+void send_trim_to_wbuf(uint32_t lba, uint32_t n_sect);
 void recv_from_rbuf(uint32_t lba, uint32_t n_sect);
-void keep_version(uint32_t lba);
-int check_prefix(struct trace_ent *traces, int size_trace, uint32_t epoch_incomplete);
+void keep_version(uint32_t lba, uint32_t n_sect);
+void commit_versions(void);
+int check_prefix(const struct trace_ent *traces, int size_trace, uint32_t epoch_incomplete);
 void dump_version(uint32_t lba, FILE *fp);
 void serialize_version(char *fname);
+void save_ram(FILE *fp);
+int load_ram(FILE *fp);
 vpage_t *vram_vpage_map(uint64_t dram_addr);
 
 #endif // VRAM_H
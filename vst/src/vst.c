@@ -7,13 +7,18 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include "vst.h"
 #include "config.h"
 #include "vflash.h"
@@ -21,14 +26,56 @@
 #include "stat.h"
 #include "logger.h"
 #include "checker.h"
+#include "synth.h"
+#include "ftlstate.h"
 
 #define N_CRASH 200
 
+/* random writes after the first GC of preconditioning, as in ftl_idle() */
+#define PRECOND_EXTRA_BYTES (4ULL * 1024 * 1024 * 1024)
+
+/* header of a trace cache, followed by its entries */
+#define TRACE_MAGIC "VSTTRC01"
+typedef struct {
+    char magic[8];
+    uint32_t n_ents;
+    uint32_t n_lines;
+    uint32_t rsize;
+    uint32_t wsize;
+    uint8_t pad[40];
+} trace_hdr_t;
+
+/**
+ * header of a snapshot, followed by the flash image, the DRAM and the
+ * globals of the FTL; cfg is the FTL_CONFIG it was preconditioned with
+ */
+#define SNAP_MAGIC "VSTSNAP1"
+typedef struct {
+    char magic[8];
+    uint32_t n_banks;
+    uint32_t blks_per_bank;
+    uint32_t pages_per_blk;
+    uint32_t sects_per_page;
+    uint32_t max_lba;
+    uint32_t wid;
+    char cfg[232];
+} snap_hdr_t;
+
 static void print_ssd_config(void);
-static int load_trace(FILE *fp_trace, struct trace_ent *traces);
-static int synthesize_trace(struct trace_ent *traces, int pattern);
-static void init(void);
+static int load_ftl(vst_ftl_t *ftl, const char *fname, int need_epoch);
+static int run_ftl(const char *fname_ftl, const char *fname_log);
+static int run_ftls(char **fnames_ftl, int n_ftls);
+static int map_trace(const char *fname, const struct trace_ent **traces);
+static int load_trace(FILE *fp_trace, FILE *fp_out);
+static int next_ent(int i, struct trace_ent *ent);
+static void precondition(void);
+static void precond_write(uint32_t lba, uint32_t n_sect);
+static void fill_snap_hdr(snap_hdr_t *hdr);
+static int save_snapshot(const char *fname);
+static void load_snapshot(const char *fname);
+static void init(const char *fname_log);
 static void cleanup(void);
+static void read_all_versions(void);
 
 /* time spent */
 time_t begin, end;
@@ -43,11 +90,13 @@ int trace_cnt;
 static uint64_t raddr, waddr;
 static uint32_t rsize, wsize;
 static char *fname_img = NULL;
+static char *fname_snap = NULL;
 static char *dir_output = NULL;
 static int idx_crash = 0;
 static int n_success, n_fail;
 static int n_jobs;
 static int freq_flush = 0;
+static uint32_t rate_fail;
 static uint32_t wid_vst;
 static uint32_t wid_latest_flush;
 
@@ -55,18 +104,22 @@ static uint32_t wid_latest_flush;
 extern char *optarg;
 extern int optind;
 
+/* options */
+static int one_pass;
+static int run_check_prefix;
+static char *spec_synth;
+static int precond;
+static uint64_t bound;
+static int call_standby;
+static char *fname_trace;
+
 static int sim_crash;
 static int allow_sim_crash;
-static struct trace_ent *traces;
+static const struct trace_ent *traces;
+static synth_t *workload;
 static int size_trace;
-static void (*vst_open_ftl)(void);
-static void (*vst_close_ftl)(void);
-static void (*vst_read_sector)(uint32_t, uint32_t);
-static void (*vst_write_sector)(uint32_t, uint32_t);
-static void (*vst_flush_cache)(void);
-static void (*vst_standby)(void);
-static uint32_t (*vst_get_epoch_incomplete)(void);
-static void (*vst_rwbuf_config)(uint64_t *, uint32_t *, uint64_t *, uint32_t *);
+static int n_lines_trace;
+static vst_ftl_t ftl;
 
 void simulate_crash(void)
 {
@@ -120,14 +173,11 @@ void simulate_crash(void)
             }
         }
         reset_rwbuf_ptr();
-        vst_open_ftl();
+        ftl.open_ftl();
 
         fprintf(stderr, "[VST] Read all sectors.\n");
-        for (uint32_t lba = 0; lba < VST_MAX_LBA; lba++) {
-            vst_read_sector(lba, 1);
-            keep_version(lba);
-        }
-        uint32_t epoch_incomplete = vst_get_epoch_incomplete();
+        read_all_versions();
+        uint32_t epoch_incomplete = ftl.get_epoch_incomplete();
 
         int failed_validation = 0;
         fprintf(stderr, "[VST] epoch_incomplete = %u. "
@@ -168,31 +218,21 @@ void simulate_crash(void)
 
 int main(int argc, char *argv[])
 {
-    FILE *fp_trace;
-    void *handle;
-    char *dl_err;
     int opt;
-    int one_pass;
-    int run_check_prefix;
-    int synth_trace;
-    uint64_t bound;
-    uint32_t lba, sec_num, rw;
-    int done;
-    char *fname_trace;
-    FILE *fp_img;
-    int n_wr_between_two_flushes = 0;
-    int call_standby;
+    int n_ftls;
 
     begin = clock();
 
     one_pass = 0;
     run_check_prefix = 0;
     sim_crash = 0;
-    synth_trace = 0;
+    spec_synth = NULL;
+    precond = 0;
     bound = 1;
     n_jobs = 1;
     call_standby = 0;
-    while ((opt = getopt(argc, argv, "ab:cd:f:i:j:pstv")) != -1) {
+    rate_fail = 0;
+    while ((opt = getopt(argc, argv, "ab:cd:e:f:i:j:pst:vP:S:")) != -1) {
         switch (opt) {
         case 'a':
             bound = 1099511627776;
@@ -206,6 +246,9 @@ int main(int argc, char *argv[])
         case 'd':
             dir_output = optarg;
             break;
+        case 'e':
+            rate_fail = atoi(optarg);
+            break;
         case 'f':
             freq_flush = atoi(optarg);
             break;
@@ -222,103 +265,192 @@ int main(int argc, char *argv[])
             sim_crash = 1;
             break;
         case 't':
-            synth_trace = 1;
+            spec_synth = optarg;
             break;
         case 'v':
             call_standby = 1;
             break;
+        case 'P':
+            precond = 1;
+            fname_snap = optarg;
+            break;
+        case 'S':
+            precond = 0;
+            fname_snap = optarg;
+            break;
         default:
             fprintf(stderr, "Invalid option.\n");
             return 1;
         }
     }
 
-    if (argc <= optind) {
-        fprintf(stderr, "usage: ./vst trace_file ftl_obj\n");
-        return 1;
+    /* a workload or preconditioning takes the place of the trace file */
+    if (precond) {
+        fname_trace = "(preconditioning)";
+        optind--;
+    } else if (spec_synth != NULL) {
+        fname_trace = spec_synth;
+        optind--;
     }
-
-    fp_trace = fopen(argv[optind], "r");
-    if (fp_trace == NULL) {
-        fprintf(stderr, "Fail opening trace file.\n");
+    if (argc <= optind + 1) {
+        fprintf(stderr, "usage: ./vst trace_file ftl_obj [ftl_obj ...]\n"
+                "       ./vst -t workload ftl_obj [ftl_obj ...]\n"
+                "       ./vst -P snapshot ftl_obj\n");
         return 1;
     }
-    fname_trace = argv[optind];
 
-    handle = dlopen(argv[optind + 1], RTLD_LAZY);
-    if (handle == NULL) {
-        fprintf(stderr, "Fail opening ftl shared object: %s\n", dlerror());
+    if (!precond && spec_synth == NULL) {
+        if (access(argv[optind], R_OK)) {
+            fprintf(stderr, "Fail opening trace file.\n");
+            return 1;
+        }
+        fname_trace = argv[optind];
+    } else if (sim_crash || run_check_prefix) {
+        fprintf(stderr, "Crash simulation and prefix checks replay a trace "
+                "file, not a workload.\n");
         return 1;
     }
-
-    vst_open_ftl = (void (*)(void))dlsym(handle, "vst_open_ftl");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "Fail resolving symbol vst_open_ftl.\n");
+    if (fname_snap != NULL && (sim_crash || run_check_prefix)) {
+        fprintf(stderr, "Crash simulation and prefix checks replay the trace "
+                "from a new device, not from a snapshot.\n");
         return 1;
     }
 
-    int has_close_ftl = 1;
-    vst_close_ftl = (void (*)(void))dlsym(handle, "vst_close_ftl");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "No vst_close_ftl provided.\n");
-        has_close_ftl = 0;
+    n_ftls = argc - optind - 1;
+    if (n_ftls == 1)
+        return run_ftl(argv[optind + 1], "./vst.log");
+    if (sim_crash || run_check_prefix || fname_img != NULL || precond) {
+        fprintf(stderr, "Crash simulation, prefix checks, flash images and "
+                "preconditioning take one FTL object.\n");
+        return 1;
     }
+    return run_ftls(&argv[optind + 1], n_ftls);
+}
 
-    vst_read_sector = (void (*)(uint32_t, uint32_t))dlsym(
-            handle, 
-            "vst_read_sector");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "Fail resolving symbol vst_read_sector.\n");
+/**
+ * Run the FTL objects side by side on the trace. Each runs in a child
+ * process of its own, since the firmware keeps its state in globals and
+ * addresses the emulated DRAM at a fixed base; the children map the same
+ * trace cache. Their outputs are printed in order once all are done.
+ */
+static int run_ftls(char **fnames_ftl, int n_ftls)
+{
+    FILE **fps;
+    pid_t *pids_ftl;
+    char fname_log[32];
+    char buf[4096];
+    size_t n;
+    int status, ret = 0;
+
+    fps = calloc(n_ftls, sizeof(FILE *));
+    pids_ftl = calloc(n_ftls, sizeof(pid_t));
+    if (fps == NULL || pids_ftl == NULL) {
+        fprintf(stderr, "Fail calloc() `pids_ftl`.\n");
         return 1;
     }
 
-    vst_write_sector = (void (*)(uint32_t, uint32_t))dlsym(
-            handle, 
-            "vst_write_sector");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "Fail resolving symbol vst_write_sector.\n");
-        return 1;
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < n_ftls; i++) {
+        fps[i] = tmpfile();
+        if (fps[i] == NULL) {
+            fprintf(stderr, "Fail creating the output of FTL %d.\n", i);
+            return 1;
+        }
+        pids_ftl[i] = fork();
+        if (pids_ftl[i] == -1) {
+            fprintf(stderr, "Error: fork().\n");
+            return 1;
+        }
+        if (!pids_ftl[i]) {
+            dup2(fileno(fps[i]), STDOUT_FILENO);
+            dup2(fileno(fps[i]), STDERR_FILENO);
+            sprintf(fname_log, "./vst-%d.log", i);
+            exit(run_ftl(fnames_ftl[i], fname_log));
+        }
     }
 
-    vst_flush_cache = (void (*)(void))dlsym(handle, "vst_flush_cache");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "Fail resolving symbol vst_flush_cache.\n");
-        return 1;
+    for (int i = 0; i < n_ftls; i++) {
+        waitpid(pids_ftl[i], &status, 0);
+        printf("----------FTL %d: %s----------\n", i, fnames_ftl[i]);
+        rewind(fps[i]);
+        while ((n = fread(buf, 1, sizeof(buf), fps[i])) > 0)
+            fwrite(buf, 1, n, stdout);
+        fclose(fps[i]);
+        if (WIFSIGNALED(status)) {
+            printf("[VST] FTL %d killed by signal %d.\n", i, WTERMSIG(status));
+            ret = 1;
+        } else if (WEXITSTATUS(status) != 0) {
+            printf("[VST] FTL %d failed with exit code %d.\n", i, WEXITSTATUS(status));
+            ret = 1;
+        }
     }
+    free(fps);
+    free(pids_ftl);
+    return ret;
+}
 
-    int has_standby = 1;
-    vst_standby = (void (*)(void))dlsym(handle, "vst_standby");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "No vst_standby provided.\n");
-        has_standby = 0;
+/* resolve the interface of an FTL object; the optional parts may be NULL */
+static int load_ftl(vst_ftl_t *ftl, const char *fname, int need_epoch)
+{
+    struct {
+        const char *name;
+        void **sym;
+        const char *msg_missing;
+    } syms[] = {
+        {"vst_open_ftl", (void **)&ftl->open_ftl, NULL},
+        {"vst_close_ftl", (void **)&ftl->close_ftl,
+            "No vst_close_ftl provided."},
+        {"vst_read_sector", (void **)&ftl->read_sector, NULL},
+        {"vst_write_sector", (void **)&ftl->write_sector, NULL},
+        {"vst_flush_cache", (void **)&ftl->flush_cache, NULL},
+        {"vst_standby", (void **)&ftl->standby, "No vst_standby provided."},
+        {"vst_trim_sector", (void **)&ftl->trim_sector,
+            "No vst_trim_sector provided. Trims are ignored."},
+        {"vst_get_epoch_incomplete", (void **)&ftl->get_epoch_incomplete,
+            need_epoch ? NULL : ""},
+        {"vst_rwbuf_config", (void **)&ftl->rwbuf_config, NULL},
+        {"vst_gc_triggered", (void **)&ftl->gc_triggered, ""},
+    };
+
+    memset(ftl, 0, sizeof(vst_ftl_t));
+    ftl->handle = dlopen(fname, RTLD_LAZY);
+    if (ftl->handle == NULL) {
+        fprintf(stderr, "Fail opening ftl shared object: %s\n", dlerror());
+        return 1;
     }
 
-    if (run_check_prefix || sim_crash) {
-        vst_get_epoch_incomplete = (uint32_t (*)(void))dlsym(handle,
-                "vst_get_epoch_incomplete");
-        dl_err = dlerror();
-        if (dl_err != NULL) {
-            fprintf(stderr, "Fail resolving symbol vst_get_epoch_incomplete.\n");
+    for (int i = 0; i < sizeof(syms) / sizeof(syms[0]); i++) {
+        dlerror();
+        *syms[i].sym = dlsym(ftl->handle, syms[i].name);
+        if (dlerror() == NULL)
+            continue;
+        *syms[i].sym = NULL;
+        if (syms[i].msg_missing == NULL) {
+            fprintf(stderr, "Fail resolving symbol %s.\n", syms[i].name);
             return 1;
         }
+        if (syms[i].msg_missing[0] != '\0')
+            fprintf(stderr, "%s\n", syms[i].msg_missing);
     }
+    return 0;
+}
 
-    vst_rwbuf_config = (void (*)(uint64_t *, uint32_t *, uint64_t *, uint32_t *))dlsym(handle, "vst_rwbuf_config");
-    dl_err = dlerror();
-    if (dl_err != NULL) {
-        fprintf(stderr, "Fail resolving symbol vst_rwbuf_config.\n");
+/* simulate the SSD with one FTL object on the loaded trace */
+static int run_ftl(const char *fname_ftl, const char *fname_log)
+{
+    FILE *fp_img;
+    struct trace_ent ent;
+    uint32_t lba, sec_num, rw;
+    int done;
+    int n_wr_between_two_flushes = 0;
+
+    if (load_ftl(&ftl, fname_ftl, run_check_prefix || sim_crash))
         return 1;
-    }
 
-    vst_rwbuf_config(&raddr, &rsize, &waddr, &wsize);
+    ftl.rwbuf_config(&raddr, &rsize, &waddr, &wsize);
 
-    init();
+    init(fname_log);
 
     if (fname_img != NULL) {
         fp_img = fopen(fname_img, "r");
@@ -349,22 +481,30 @@ int main(int argc, char *argv[])
 
     atexit(cleanup);
 
+    if (precond) {
+        ftl.open_ftl();
+        precondition();
+        return save_snapshot(fname_snap);
+    }
     done = 0;
-    traces = (struct trace_ent *)malloc(MAX_SIZE_TRACE * 
-            sizeof(struct trace_ent));
-    if (synth_trace)
-        size_trace = synthesize_trace(traces, 0);
-    else
-        size_trace = load_trace(fp_trace, traces);
+    if (spec_synth != NULL) {
+        workload = open_synth(spec_synth, rsize, wsize);
+        if (workload == NULL)
+            return 1;
+        print_synth(workload);
+    } else {
+        size_trace = map_trace(fname_trace, &traces);
+    }
 
-    vst_open_ftl();
+    /* a snapshot is of an open FTL */
+    if (fname_snap != NULL)
+        load_snapshot(fname_snap);
+    else
+        ftl.open_ftl();
 
     if (run_check_prefix) {
-        for (uint32_t lba = 0; lba < VST_MAX_LBA; lba++) {
-            vst_read_sector(lba, 1);
-            keep_version(lba);
-        }
-        uint32_t epoch_incomplete = vst_get_epoch_incomplete();
+        read_all_versions();
+        uint32_t epoch_incomplete = ftl.get_epoch_incomplete();
         if (!check_prefix(traces, size_trace, epoch_incomplete))
             printf("Order-preserving semantics IS preserved.\n");
         else
@@ -378,22 +518,25 @@ int main(int argc, char *argv[])
         printf("Trace id = %d\n", trace_cnt);
         fflush(stdout);
         record(LOG_GENERAL, "Trace id = %d\n", trace_cnt);
-        for (int i = 0; i < size_trace; i++) {
-            lba = traces[i].lba;
-            sec_num = traces[i].sec_num;
-            rw = traces[i].rw;
-            lba += (trace_cnt * 1024); // offset
-            if (lba > VST_MAX_LBA) {
+        for (int i = 0; next_ent(i, &ent); i++) {
+            lba = ent.lba;
+            sec_num = ent.sec_num;
+            rw = ent.rw;
+            /* a workload is generated afresh for each pass */
+            if (workload == NULL)
+                lba += (trace_cnt * 1024); // offset
+            /* keep the trace intact so the crash checker replays it as run */
+            if (lba > VST_MAX_LBA)
                 lba %= (VST_MAX_LBA + 1);
-                traces[i].lba = lba;
-            }
             if (lba + sec_num > VST_MAX_LBA + 1)
                 sec_num = VST_MAX_LBA + 1 - lba;
             /* write */
             if (rw == 0) {
                 record(LOG_IO, "W: (%u, %u)\n", lba, sec_num);
                 send_to_wbuf(lba, sec_num);
-                vst_write_sector(lba, sec_num);
+                begin_request();
+                ftl.write_sector(lba, sec_num);
+                end_request(0);
                 wid_vst++;
                 inc_byte_write(sec_num * VST_BYTES_PER_SECTOR);
                 if (!one_pass && get_byte_write() > bound) {
@@ -407,14 +550,39 @@ int main(int argc, char *argv[])
                 n_wr_between_two_flushes++;
                 if (n_wr_between_two_flushes == freq_flush) {
                     n_wr_between_two_flushes = 0;
-                    vst_flush_cache();
+                    begin_request();
+                    ftl.flush_cache();
+                    end_request(SYNTH_RW_FLUSH);
                     wid_latest_flush = wid_vst;
+                    commit_versions();
                 }
             }
+            /* flush of a workload */
+            else if (rw == SYNTH_RW_FLUSH) {
+                record(LOG_IO, "F\n");
+                begin_request();
+                ftl.flush_cache();
+                end_request(SYNTH_RW_FLUSH);
+                wid_latest_flush = wid_vst;
+                commit_versions();
+            }
+            /* trim, which is committed before it completes */
+            else if (rw == 2) {
+                record(LOG_IO, "T: (%u, %u)\n", lba, sec_num);
+                send_trim_to_wbuf(lba, sec_num);
+                begin_request();
+                ftl.trim_sector(lba, sec_num);
+                end_request(2);
+                wid_vst++;
+                wid_latest_flush = wid_vst;
+                commit_versions();
+            }
             /* read */
             else {
                 record(LOG_IO, "R: (%u, %u)\n", lba, sec_num);
-                vst_read_sector(lba, sec_num);
+                begin_request();
+                ftl.read_sector(lba, sec_num);
+                end_request(1);
                 recv_from_rbuf(lba, sec_num);
                 inc_byte_read(sec_num * VST_BYTES_PER_SECTOR);
             }
@@ -426,11 +594,11 @@ int main(int argc, char *argv[])
 
     allow_sim_crash = 0;
 
-    if (has_standby && call_standby)
-        vst_standby();
+    if (ftl.standby != NULL && call_standby)
+        ftl.standby();
 
-    if (has_close_ftl)
-        vst_close_ftl();
+    if (ftl.close_ftl != NULL)
+        ftl.close_ftl();
 
     if (sim_crash) {
         int status;
@@ -456,11 +624,11 @@ int main(int argc, char *argv[])
     return 0;
 }
 
-static void init(void)
+static void init(const char *fname_log)
 {
-    open_logger("./vst.log");
+    open_logger(fname_log);
     /* open_logger must precede other open_xxx */
-    if (open_flash(sim_crash))
+    if (open_flash(sim_crash, rate_fail))
         exit(1);
     if (open_ram(raddr, rsize, waddr, wsize))
         exit(1);
@@ -475,6 +643,7 @@ static void cleanup(void)
         serialize_flash(fp);
         fclose(fp);
     }
+    close_synth(workload);
     close_flash();
     close_ram();
     close_stat();
@@ -500,63 +669,297 @@ static void print_ssd_config(void)
     printf("----------SSD Configuration----------\n");
 }
 
+/**
+ * Map the trace, cut to the buffer sizes of the FTL, from a binary cache
+ * next to the trace file. The cache is built once, under a lock on the
+ * trace file, and every run maps it read-only, so parallel runs share one
+ * copy in the page cache. A cache older than the trace is rebuilt; if none
+ * can be written, the trace is cut into an unnamed file instead.
+ */
+static int map_trace(const char *fname, const struct trace_ent **traces)
+{
+    char fname_cache[4096], fname_tmp[4096 + 32];
+    trace_hdr_t hdr;
+    struct stat st_trace, st_cache;
+    FILE *fp_trace, *fp_out;
+    int fd_trace, fd;
+    void *map;
+
+    fd_trace = open(fname, O_RDONLY);
+    if (fd_trace == -1 || fstat(fd_trace, &st_trace)) {
+        fprintf(stderr, "Fail opening trace file.\n");
+        exit(1);
+    }
+    snprintf(fname_cache, sizeof(fname_cache), "%s.r%uw%u%s.vtr", fname,
+            rsize, wsize, ftl.trim_sector != NULL ? "t" : "");
+    flock(fd_trace, LOCK_EX);
+
+    fd = open(fname_cache, O_RDONLY);
+    if (fd != -1) {
+        if (fstat(fd, &st_cache) ||
+                pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+                hdr.rsize != rsize || hdr.wsize != wsize ||
+                st_cache.st_size != sizeof(hdr) + hdr.n_ents * sizeof(struct trace_ent) ||
+                st_cache.st_mtime < st_trace.st_mtime) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd == -1) {
+        snprintf(fname_tmp, sizeof(fname_tmp), "%s.%d", fname_cache, getpid());
+        fp_out = fopen(fname_tmp, "w+");
+        if (fp_out == NULL) {
+            fname_tmp[0] = '\0';
+            fp_out = tmpfile();
+        }
+        fp_trace = fdopen(dup(fd_trace), "r");
+        if (fp_out == NULL || fp_trace == NULL) {
+            fprintf(stderr, "Fail building trace cache: %s\n", fname_cache);
+            exit(1);
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        fwrite(&hdr, sizeof(hdr), 1, fp_out);
+        memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.rsize = rsize;
+        hdr.wsize = wsize;
+        hdr.n_ents = load_trace(fp_trace, fp_out);
+        hdr.n_lines = n_lines_trace;
+        rewind(fp_out);
+        fwrite(&hdr, sizeof(hdr), 1, fp_out);
+        if (fflush(fp_out)) {
+            fprintf(stderr, "Fail building trace cache: %s\n", fname_cache);
+            exit(1);
+        }
+        if (fname_tmp[0] != '\0' && rename(fname_tmp, fname_cache))
+            unlink(fname_tmp);
+        fd = dup(fileno(fp_out));
+        fclose(fp_out);
+    }
+    flock(fd_trace, LOCK_UN);
+    close(fd_trace);
+
+    map = mmap(NULL, sizeof(hdr) + hdr.n_ents * sizeof(struct trace_ent),
+            PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Fail mapping trace cache: %s\n", fname_cache);
+        exit(1);
+    }
+    close(fd);
+    *traces = (const struct trace_ent *)((uint8_t *)map + sizeof(hdr));
+    printf("Has %u lines. Create %u entries.\n", hdr.n_lines, hdr.n_ents);
+    return hdr.n_ents;
+}
+
 /**
  * This function must be called after vst_rwbuf_config() is called to get
- * the valid read write buffer size.
+ * the valid read write buffer size. Reads and writes are cut to the buffer
+ * sizes, while a trim is sent as one DSM command however large it is.
  */
-static int load_trace(FILE *fp_trace, struct trace_ent *traces)
+static int load_trace(FILE *fp_trace, FILE *fp_out)
 {
     char buf[64];
+    struct trace_ent ent;
     uint64_t lba;
-    uint32_t sec_num, rw;
+    uint32_t sec_num, size_buf;
     int n = 0, n_lines = 0;
 
-    fseek(fp_trace, 0, SEEK_SET);
     while (fscanf(fp_trace, "%*[^,],%*[^,],%*[^,],%[^,],%lu,%u,%*u", 
         buf, &lba, &sec_num) != EOF &&
         n < MAX_SIZE_TRACE) {
-        if (!strcmp(buf, "Write"))
-            rw = 0;
-        else
-            rw = 1;
         lba /= 512;
         sec_num /= 512;
+        n_lines++;
+        if (!strcmp(buf, "Trim")) {
+            if (ftl.trim_sector != NULL && sec_num != 0) {
+                ent.lba = lba;
+                ent.sec_num = sec_num;
+                ent.rw = 2;
+                fwrite(&ent, sizeof(ent), 1, fp_out);
+                n++;
+            }
+            continue;
+        }
+        ent.rw = strcmp(buf, "Write") ? 1 : 0;
+        size_buf = ent.rw == 0 ? wsize : rsize;
         do {
-            uint32_t sec_num_this;
-            if (rw == 0 && sec_num > wsize)
-                sec_num_this = wsize;
-            else if (rw == 1 && sec_num > rsize)
-                sec_num_this = rsize;
-            else
-                sec_num_this = sec_num;
-            traces[n].lba = lba;
-            traces[n].sec_num = sec_num_this;
-            traces[n].rw = rw;
-            lba += sec_num_this;
-            sec_num -= sec_num_this;
+            ent.lba = lba;
+            ent.sec_num = sec_num > size_buf ? size_buf : sec_num;
+            fwrite(&ent, sizeof(ent), 1, fp_out);
+            lba += ent.sec_num;
+            sec_num -= ent.sec_num;
             n++;
         } while (sec_num != 0);
-        n_lines++;
     }
     fclose(fp_trace);
-    printf("Has %u lines. Create %u entries.\n", n_lines, n);
+    n_lines_trace = n_lines;
     return n;
 }
 
-static int synthesize_trace(struct trace_ent *traces, int pattern)
+/* the i-th request of this pass, from the trace or the workload */
+static int next_ent(int i, struct trace_ent *ent)
 {
-    int n = 0;
-
-    /* sequential access */
-    if (pattern == 0) {
-        int lpn_max = MAX_LBA / VST_SECTORS_PER_PAGE;
-        for (int lpn = 0; lpn < lpn_max; lpn++) {
-            traces[n].lba = lpn * VST_SECTORS_PER_PAGE;
-            traces[n].sec_num = VST_SECTORS_PER_PAGE;
-            traces[n].rw = 0;
-            n++;
+    if (workload != NULL)
+        return synth_next(workload, ent);
+    if (i >= size_trace)
+        return 0;
+    *ent = traces[i];
+    return 1;
+}
+
+/**
+ * Age a new device to steady state like ftl_idle(), but through the host
+ * interface, so that GC moves real data and every page keeps its version:
+ * random writes until the first GC and PRECOND_EXTRA_BYTES more.
+ * vst_gc_triggered() only tells whether any batch GC has run, so the extra
+ * bytes are a margin for the other banks to reach their GC threshold too,
+ * not a guarantee. Without vst_gc_triggered() the random writes cover the
+ * device once. The writes are of a page per bank, aligned, as in
+ * ftl_idle(). The FTL is left open and flushed for the snapshot.
+ */
+static void precondition(void)
+{
+    char spec[64];
+    struct trace_ent ent;
+    synth_t *s;
+    uint64_t extra = 0;
+    uint32_t gran = VST_SECTORS_PER_PAGE * VST_NUM_BANKS * VST_BYTES_PER_SECTOR;
+
+    printf("Preconditioning: random writes.\n");
+    sprintf(spec, "pattern=uniform,size=%u,seed=815", gran);
+    s = open_synth(spec, rsize, wsize);
+    if (ftl.gc_triggered == NULL) {
+        while (synth_next(s, &ent))
+            precond_write(ent.lba, ent.sec_num);
+    } else {
+        while (extra < PRECOND_EXTRA_BYTES) {
+            if (!synth_next(s, &ent))
+                continue;
+            precond_write(ent.lba, ent.sec_num);
+            if (ftl.gc_triggered())
+                extra += ent.sec_num * VST_BYTES_PER_SECTOR;
         }
     }
-    printf("Trace synthesis done. Create %u entries.\n", n);
-    return n;
+    close_synth(s);
+
+    ftl.flush_cache();
+    wid_latest_flush = wid_vst;
+    commit_versions();
+    printf("Preconditioning done.\n");
+}
+
+static void precond_write(uint32_t lba, uint32_t n_sect)
+{
+    send_to_wbuf(lba, n_sect);
+    ftl.write_sector(lba, n_sect);
+    wid_vst++;
+    inc_byte_write(n_sect * VST_BYTES_PER_SECTOR);
+    /* versions are only kept for a crash, so drop them as we go */
+    commit_versions();
+}
+
+static void fill_snap_hdr(snap_hdr_t *hdr)
+{
+    const char *cfg = getenv("FTL_CONFIG");
+
+    memset(hdr, 0, sizeof(snap_hdr_t));
+    memcpy(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic));
+    hdr->n_banks = VST_NUM_BANKS;
+    hdr->blks_per_bank = VST_BLOCKS_PER_BANK;
+    hdr->pages_per_blk = VST_PAGES_PER_BLOCK;
+    hdr->sects_per_page = VST_SECTORS_PER_PAGE;
+    hdr->max_lba = VST_MAX_LBA;
+    if (cfg != NULL)
+        strncpy(hdr->cfg, cfg, sizeof(hdr->cfg) - 1);
+}
+
+/* written to a temporary file first, so a snapshot is never seen half done */
+static int save_snapshot(const char *fname)
+{
+    char fname_tmp[4096 + 32];
+    snap_hdr_t hdr;
+    FILE *fp;
+
+    snprintf(fname_tmp, sizeof(fname_tmp), "%s.%d", fname, getpid());
+    fp = fopen(fname_tmp, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Fail creating snapshot: %s\n", fname);
+        return 1;
+    }
+    fill_snap_hdr(&hdr);
+    hdr.wid = wid_vst;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    serialize_flash(fp);
+    save_ram(fp);
+    if (save_ftl_state(ftl.handle, fp)) {
+        fclose(fp);
+        unlink(fname_tmp);
+        return 1;
+    }
+    if (fclose(fp) || rename(fname_tmp, fname)) {
+        fprintf(stderr, "Fail writing snapshot: %s\n", fname);
+        unlink(fname_tmp);
+        return 1;
+    }
+    printf("Snapshot: %s\n", fname);
+    return 0;
+}
+
+/**
+ * Start from a snapshot of a preconditioned device, in place of opening the
+ * FTL. The FTL resumes as it was rather than recovering, so its block lists
+ * and valid counts are exact. The snapshot is only read, so every run from
+ * it starts from the same state.
+ */
+static void load_snapshot(const char *fname)
+{
+    snap_hdr_t hdr, hdr_cur;
+    FILE *fp;
+
+    fp = fopen(fname, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Fail opening snapshot: %s\n", fname);
+        exit(1);
+    }
+    fill_snap_hdr(&hdr_cur);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic))) {
+        fprintf(stderr, "Not a snapshot: %s\n", fname);
+        exit(1);
+    }
+    if (memcmp(&hdr.n_banks, &hdr_cur.n_banks,
+                offsetof(snap_hdr_t, wid) - offsetof(snap_hdr_t, n_banks))) {
+        fprintf(stderr, "The snapshot is of another SSD configuration.\n");
+        exit(1);
+    }
+    if (strncmp(hdr.cfg, hdr_cur.cfg, sizeof(hdr.cfg)))
+        printf("[VST] The snapshot keeps the FTL_CONFIG=\"%s\" it was "
+                "preconditioned with.\n", hdr.cfg);
+    deserialize_flash(fp);
+    if (load_ram(fp) || load_ftl_state(ftl.handle, fp)) {
+        fprintf(stderr, "Fail reading snapshot: %s\n", fname);
+        exit(1);
+    }
+    fclose(fp);
+    wid_vst = hdr.wid;
+    wid_latest_flush = hdr.wid;
+    printf("Snapshot: %s\n", fname);
+}
+
+/**
+ * Read back the whole device a page at a time, keeping the version of every
+ * sector for check_prefix().
+ */
+static void read_all_versions(void)
+{
+    uint32_t n_sect;
+
+    for (uint32_t lba = 0; lba <= VST_MAX_LBA; lba += n_sect) {
+        n_sect = VST_SECTORS_PER_PAGE - lba % VST_SECTORS_PER_PAGE;
+        if (n_sect > VST_MAX_LBA + 1 - lba)
+            n_sect = VST_MAX_LBA + 1 - lba;
+        ftl.read_sector(lba, n_sect);
+        keep_version(lba, n_sect);
+    }
 }
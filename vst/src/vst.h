@@ -13,6 +13,21 @@ struct trace_ent {
     uint32_t sec_num, rw;
 };
 
+/* the interface VST resolves from an FTL object; optional parts may be NULL */
+typedef struct {
+    void *handle;
+    void (*open_ftl)(void);
+    void (*close_ftl)(void);
+    void (*read_sector)(uint32_t, uint32_t);
+    void (*write_sector)(uint32_t, uint32_t);
+    void (*flush_cache)(void);
+    void (*standby)(void);
+    void (*trim_sector)(uint32_t, uint32_t);
+    uint32_t (*get_epoch_incomplete)(void);
+    void (*rwbuf_config)(uint64_t *, uint32_t *, uint64_t *, uint32_t *);
+    uint32_t (*gc_triggered)(void);
+} vst_ftl_t;
+
 void simulate_crash(void);
 
 #endif // VST_H